@@ -9,6 +9,12 @@
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static int maxruns = 10; /* most runs of f per measurement */
+
+/* With the interval timer and gettimeofday, stop once the K fastest
+   runs agree to within EPSILON */
+#define FSECS_K       3
+#define FSECS_EPSILON 0.02
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -39,6 +45,17 @@ void init_fsecs(void)
 #endif
 }
 
+/*
+ * set_fsecs_maxruns - Set the largest number of times fsecs runs f
+ */
+void set_fsecs_maxruns(int n)
+{
+    maxruns = n > 0 ? n : 1;
+#if USE_FCYC
+    set_fcyc_maxsamples(maxruns);
+#endif
+}
+
 /*
  * fsecs - Return the running time of a function f (in seconds)
  */
@@ -48,9 +65,9 @@ double fsecs(fsecs_test_funct f, void *argp)
     double cycles = fcyc(f, argp);
     return cycles/(Mhz*1e6);
 #elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
+    return ftimer_itimer(f, argp, maxruns);
 #elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
+    return ftimer_gettod_kbest(f, argp, FSECS_K, maxruns, FSECS_EPSILON);
 #endif 
 }
 
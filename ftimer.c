@@ -12,6 +12,9 @@
 #include <sys/time.h>
 #include "ftimer.h"
 
+/* largest K accepted by ftimer_gettod_kbest */
+#define MAXK 16
+
 /* function prototypes */
 static void init_etime(void);
 static double get_etime(void);
@@ -52,6 +55,41 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
     return (1E-3*diff);
 }
 
+/* 
+ * ftimer_gettod_kbest - Use gettimeofday to time f(argp) one run at a
+ * time, keeping the k fastest runs in ascending order. Stop as soon as
+ * they are within a factor 1+epsilon of each other, or after maxruns
+ * runs, and return the fastest.
+ */
+double ftimer_gettod_kbest(ftimer_test_funct f, void *argp, int k,
+			   int maxruns, double epsilon)
+{
+    double best[MAXK] = {0};
+    double t;
+    int i, j, n = 0;
+    struct timeval stv, etv;
+
+    if (k > MAXK)
+	k = MAXK;
+    for (i = 0; i < maxruns; i++) {
+	gettimeofday(&stv, NULL);
+	f(argp);
+	gettimeofday(&etv, NULL);
+	t = (etv.tv_sec - stv.tv_sec) + 1E-6*(etv.tv_usec - stv.tv_usec);
+
+	/* Insert t among the k best, dropping the slowest if they are full */
+	if (n < k)
+	    n++;
+	if (n < k || t < best[k-1]) {
+	    for (j = n - 1; j > 0 && best[j-1] > t; j--)
+		best[j] = best[j-1];
+	    best[j] = t;
+	}
+	if (n == k && best[k-1] <= (1 + epsilon) * best[0])
+	    break;
+    }
+    return best[0];
+}
 
 /*
  * Routines for manipulating the Unix interval timer
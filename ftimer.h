@@ -12,3 +12,7 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
    Return the average of n runs */
 double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 
+/* Time f(argp) with gettimeofday until the k fastest of at most maxruns
+   runs are within a factor 1+epsilon of each other. Return the fastest */
+double ftimer_gettod_kbest(ftimer_test_funct f, void *argp, int k,
+			   int maxruns, double epsilon);
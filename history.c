@@ -0,0 +1,432 @@
+/*
+ * history.c - Record mdriver results in an append-only store and report
+ *     their trends.
+ *
+ * A run is written with a single append, so that runs recorded at once
+ * into one store do not interleave. The report groups the runs by host
+ * and follows each trace's throughput and utilization from run to run.
+ * Change points are found by binary segmentation: the split of a series
+ * with the largest difference of means, measured in standard errors, is
+ * a change point if that exceeds CHANGE_T and the shift is large enough
+ * to matter, and the two halves are searched in turn.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "history.h"
+
+#define HISTORY_MAGIC "#mdriver-results 1"
+#define MAXLINE       4096 /* longest line read from the store */
+#define TREND_RUNS    16   /* most recent runs drawn in the trend column */
+#define CHANGE_T      4.0  /* standard errors for a change point */
+#define CHANGE_MAX    4    /* change points reported per series */
+
+#if !defined(MM_BUILD_FLAGS)
+#define MM_BUILD_FLAGS "unknown"
+#endif
+
+/* How a series is searched for change points */
+typedef struct {
+    int minseg;     /* fewest runs on either side of a change */
+    double minrel;  /* smallest shift reported, relative to the mean */
+    double noise;   /* floor on the standard deviation, relative */
+} rule_t;
+
+/* Throughput is noisy; utilization is a deterministic function of code */
+static const rule_t kops_rule = {2, 0.05, 0.02};
+static const rule_t util_rule = {1, 0.002, 0.001};
+
+/* A trace line of the store, with the run it belongs to */
+typedef struct {
+    int run;
+    history_trace_t t;
+} entry_t;
+
+static void copy_field(char *dst, const char *src);
+static int split_fields(char *line, char **fields, int max);
+static int change_points(double *x, int lo, int hi, const rule_t *rule,
+			 int *out, int nout);
+static void sort_ints(int *a, int n);
+static void print_trend(double *x, int n);
+static void print_changes(char *what, double *x, int *runs, int n,
+			  const rule_t *rule, history_run_t *hist, int pts);
+
+/*
+ * history_identify - Fill in when and where a run is made: the time,
+ *     the git revision of the working tree, the host and its fingerprint,
+ *     the build flags and the command line
+ */
+void history_identify(history_run_t *run, int argc, char **argv)
+{
+    char line[MAXLINE], print[MAXLINE], cpu[HISTORY_FIELD] = "";
+    struct utsname un;
+    unsigned hash = 2166136261u;
+    FILE *fp;
+    char *p;
+    size_t len;
+    int i;
+
+    memset(run, 0, sizeof(*run));
+    run->time = time(NULL);
+    run->perfindex = 0;
+
+    strcpy(run->revision, "unknown");
+    fp = popen("git describe --always --dirty 2>/dev/null", "r");
+    if (fp != NULL) {
+	if (fgets(line, sizeof(line), fp) != NULL && line[0] != '\n')
+	    copy_field(run->revision, line);
+	pclose(fp);
+    }
+
+    if ((fp = fopen("/proc/cpuinfo", "r")) != NULL) {
+	while (fgets(line, sizeof(line), fp) != NULL)
+	    if (strncmp(line, "model name", 10) == 0 &&
+		(p = strchr(line, ':')) != NULL) {
+		copy_field(cpu, p + 2);
+		break;
+	    }
+	fclose(fp);
+    }
+    if (uname(&un) < 0)
+	memset(&un, 0, sizeof(un));
+    copy_field(run->host, un.nodename[0] ? un.nodename : "unknown");
+    snprintf(print, sizeof(print), "%s|%s|%s|%s|%s|%ld", un.nodename,
+	     un.sysname, un.release, un.machine, cpu,
+	     sysconf(_SC_NPROCESSORS_ONLN));
+    for (p = print; *p; p++)
+	hash = (hash ^ (unsigned char)*p) * 16777619u;
+    sprintf(run->hostid, "%08x", hash);
+
+    copy_field(run->flags, MM_BUILD_FLAGS);
+    for (i = 0, len = 0; i < argc && len < sizeof(line) - 1; i++)
+	len += snprintf(line + len, sizeof(line) - len, "%s%s",
+			i ? " " : "", argv[i]);
+    copy_field(run->args, line);
+}
+
+/*
+ * history_append - Append a run and the results of its n traces to the
+ *     store at path, creating it if need be. Returns 0, or -1 if the
+ *     store could not be written.
+ */
+int history_append(char *path, history_run_t *run, history_trace_t *traces,
+		   int n)
+{
+    struct stat st;
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem;
+    int fd, i, ret;
+
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+	return -1;
+    if ((mem = open_memstream(&buf, &len)) == NULL) {
+	close(fd);
+	return -1;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+	fprintf(mem, "%s\n", HISTORY_MAGIC);
+    fprintf(mem, "run\t%ld\t%s\t%s\t%s\t%.2f\t%s\t%s\n", run->time,
+	    run->revision, run->hostid, run->host, run->perfindex,
+	    run->flags, run->args);
+    for (i = 0; i < n; i++)
+	fprintf(mem, "trace\t%s\t%d\t%.0f\t%.6f\t%.9f\n", traces[i].name,
+		traces[i].valid, traces[i].ops, traces[i].util,
+		traces[i].secs);
+    fclose(mem);
+    ret = write(fd, buf, len) == (ssize_t)len ? 0 : -1;
+    if (close(fd) < 0)
+	ret = -1;
+    free(buf);
+    return ret;
+}
+
+/*
+ * history_report - Read the store at path and print, for every host and
+ *     every trace run on it, the latest throughput and utilization, a
+ *     trend line of the last TREND_RUNS runs and the change points of
+ *     both. Returns 0, or -1 if the store could not be read.
+ */
+int history_report(char *path)
+{
+    char line[MAXLINE], *f[8], time0[32], time1[32];
+    history_run_t *runs = NULL, *r;
+    entry_t *entries = NULL, *e;
+    int nruns = 0, nentries = 0, bad = 0, nf, i, j, k, n, nhost;
+    int *hostruns, *series, seen;
+    double *kops, *util, *perf;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (line[0] == '#' || line[0] == '\n')
+	    continue;
+	line[strcspn(line, "\n")] = '\0';
+	nf = split_fields(line, f, 8);
+	if (nf == 8 && strcmp(f[0], "run") == 0) {
+	    if ((runs = realloc(runs, (nruns + 1) * sizeof(*runs))) == NULL)
+		goto nomem;
+	    r = &runs[nruns++];
+	    r->time = atol(f[1]);
+	    copy_field(r->revision, f[2]);
+	    copy_field(r->hostid, f[3]);
+	    copy_field(r->host, f[4]);
+	    r->perfindex = atof(f[5]);
+	    copy_field(r->flags, f[6]);
+	    copy_field(r->args, f[7]);
+	} else if (nf == 6 && strcmp(f[0], "trace") == 0 && nruns > 0) {
+	    entries = realloc(entries, (nentries + 1) * sizeof(*entries));
+	    if (entries == NULL)
+		goto nomem;
+	    e = &entries[nentries++];
+	    e->run = nruns - 1;
+	    copy_field(e->t.name, f[1]);
+	    e->t.valid = atoi(f[2]);
+	    e->t.ops = atof(f[3]);
+	    e->t.util = atof(f[4]);
+	    e->t.secs = atof(f[5]);
+	} else
+	    bad++;
+    }
+    fclose(fp);
+
+    if ((hostruns = calloc(nruns + 1, sizeof(int))) == NULL ||
+	(series = calloc(nruns + 1, sizeof(int))) == NULL ||
+	(kops = calloc(nruns + 1, sizeof(double))) == NULL ||
+	(util = calloc(nruns + 1, sizeof(double))) == NULL ||
+	(perf = calloc(nruns + 1, sizeof(double))) == NULL)
+	goto nomem;
+
+    for (i = 0, nhost = 0; i < nruns; i++)
+	for (j = 0; j <= i; j++)
+	    if (strcmp(runs[j].hostid, runs[i].hostid) == 0) {
+		nhost += j == i;
+		break;
+	    }
+    printf("Results history in %s: %d runs on %d hosts", path, nruns,
+	   nhost);
+    if (bad > 0)
+	printf(", %d malformed lines skipped", bad);
+    printf("\n");
+
+    for (i = 0; i < nruns; i++) {
+	/* Report each host once, at its first run */
+	for (j = 0; j < i && strcmp(runs[j].hostid, runs[i].hostid); j++)
+	    ;
+	if (j < i)
+	    continue;
+	for (j = i, n = 0; j < nruns; j++)
+	    if (strcmp(runs[j].hostid, runs[i].hostid) == 0) {
+		hostruns[n] = j;
+		perf[n++] = runs[j].perfindex;
+	    }
+	strftime(time0, sizeof(time0), "%Y-%m-%d %H:%M",
+		 localtime(&(time_t){runs[hostruns[0]].time}));
+	strftime(time1, sizeof(time1), "%Y-%m-%d %H:%M",
+		 localtime(&(time_t){runs[hostruns[n - 1]].time}));
+	printf("\nHost %s (%s): %d runs from %s (%s) to %s (%s)\n",
+	       runs[i].hostid, runs[i].host, n, time0,
+	       runs[hostruns[0]].revision, time1,
+	       runs[hostruns[n - 1]].revision);
+	printf("Perf index %.1f, trend ", perf[n - 1]);
+	print_trend(perf, n);
+	print_changes("index", perf, hostruns, n, &kops_rule, runs, 1);
+	printf("\n%-20s %5s %8s %7s  %-*s  %s\n", "trace", "runs", "Kops",
+	       "util", TREND_RUNS, "trend (Kops)", "change points");
+
+	/* Each trace at its first entry on this host */
+	for (k = 0; k < nentries; k++) {
+	    if (strcmp(runs[entries[k].run].hostid, runs[i].hostid))
+		continue;
+	    for (j = 0, seen = 0; j < k && !seen; j++)
+		seen = strcmp(entries[j].t.name, entries[k].t.name) == 0 &&
+		    strcmp(runs[entries[j].run].hostid, runs[i].hostid) == 0;
+	    if (seen)
+		continue;
+	    for (j = k, n = 0; j < nentries; j++) {
+		e = &entries[j];
+		if (strcmp(e->t.name, entries[k].t.name) ||
+		    strcmp(runs[e->run].hostid, runs[i].hostid) ||
+		    !e->t.valid || e->t.secs <= 0)
+		    continue;
+		series[n] = e->run;
+		kops[n] = e->t.ops / e->t.secs / 1e3;
+		util[n++] = 100.0 * e->t.util;
+	    }
+	    if (n == 0)
+		continue;
+	    printf("%-20.20s %5d %8.0f %6.1f%%  ", entries[k].t.name, n,
+		   kops[n - 1], util[n - 1]);
+	    print_trend(kops, n);
+	    print_changes("Kops", kops, series, n, &kops_rule, runs, 0);
+	    print_changes("util", util, series, n, &util_rule, runs, 1);
+	    printf("\n");
+	}
+    }
+    free(runs);
+    free(entries);
+    free(hostruns);
+    free(series);
+    free(kops);
+    free(util);
+    free(perf);
+    return 0;
+
+ nomem:
+    fprintf(stderr, "Out of memory reading %s\n", path);
+    exit(1);
+}
+
+/*
+ * change_points - Find up to nout change points of x[lo..hi) by binary
+ *     segmentation under rule, store the index of the first value after
+ *     each in out and return their number
+ */
+static int change_points(double *x, int lo, int hi, const rule_t *rule,
+			 int *out, int nout)
+{
+    double sum = 0, sq = 0, lsum, mean, ml, mr, var, t, best = 0;
+    int i, k, split = -1, n = hi - lo, found;
+
+    if (nout <= 0 || n < 2 * rule->minseg)
+	return 0;
+    for (i = lo; i < hi; i++) {
+	sum += x[i];
+	sq += x[i] * x[i];
+    }
+    mean = sum / n;
+    for (k = lo + rule->minseg, lsum = 0, i = lo; k <= hi - rule->minseg;
+	 k++) {
+	for (; i < k; i++)
+	    lsum += x[i];
+	ml = lsum / (k - lo);
+	mr = (sum - lsum) / (hi - k);
+	/* Spread around the two means, pooled */
+	var = (sq - lsum * ml - (sum - lsum) * mr) / (n > 2 ? n - 2 : 1);
+	if (var < rule->noise * rule->noise * mean * mean)
+	    var = rule->noise * rule->noise * mean * mean;
+	t = fabs(ml - mr) / sqrt(var * (1.0 / (k - lo) + 1.0 / (hi - k)));
+	if (t > best && fabs(mr - ml) >= rule->minrel * fabs(ml)) {
+	    best = t;
+	    split = k;
+	}
+    }
+    if (split < 0 || best < CHANGE_T)
+	return 0;
+    out[0] = split;
+    found = 1;
+    found += change_points(x, lo, split, rule, out + found, nout - found);
+    found += change_points(x, split, hi, rule, out + found, nout - found);
+    return found;
+}
+
+/*
+ * print_changes - Print the change points of the series x of n runs,
+ *     whose run numbers are in runs, as the shift of the mean across
+ *     each and the revision that starts it. Shifts are in percent, or in
+ *     points if pts is set.
+ */
+static void print_changes(char *what, double *x, int *runs, int n,
+			  const rule_t *rule, history_run_t *hist, int pts)
+{
+    int cp[CHANGE_MAX + 2], ncp, c, i, lo, hi;
+    double before, after;
+
+    ncp = change_points(x, 0, n, rule, cp, CHANGE_MAX);
+    sort_ints(cp, ncp);
+    for (c = 0; c < ncp; c++) {
+	lo = c > 0 ? cp[c - 1] : 0;
+	hi = c + 1 < ncp ? cp[c + 1] : n;
+	for (before = 0, i = lo; i < cp[c]; i++)
+	    before += x[i];
+	for (after = 0, i = cp[c]; i < hi; i++)
+	    after += x[i];
+	before /= cp[c] - lo;
+	after /= hi - cp[c];
+	if (pts)
+	    printf(" %s %+.1f pts at %s", what, after - before,
+		   hist[runs[cp[c]]].revision);
+	else
+	    printf(" %s %+.1f%% at %s", what,
+		   before ? 100.0 * (after - before) / before : 0.0,
+		   hist[runs[cp[c]]].revision);
+    }
+}
+
+/*
+ * print_trend - Draw the last TREND_RUNS values of x as a line of
+ *     characters from low to high, padded to TREND_RUNS columns
+ */
+static void print_trend(double *x, int n)
+{
+    static const char levels[] = "_.,-=+*#";
+    double lo, hi;
+    int i, first = n > TREND_RUNS ? n - TREND_RUNS : 0, l;
+
+    for (lo = hi = x[first], i = first; i < n; i++) {
+	if (x[i] < lo)
+	    lo = x[i];
+	if (x[i] > hi)
+	    hi = x[i];
+    }
+    for (i = first; i < n; i++) {
+	l = hi > lo ? (x[i] - lo) / (hi - lo) * (sizeof(levels) - 2) + 0.5 :
+	    (int)(sizeof(levels) - 2) / 2;
+	putchar(levels[l]);
+    }
+    printf("%*s ", TREND_RUNS - (n - first), "");
+}
+
+/*
+ * split_fields - Split line at tabs into at most max fields. Returns the
+ *     number of fields, which is max + 1 if there were more.
+ */
+static int split_fields(char *line, char **fields, int max)
+{
+    int n = 0;
+    char *p = line;
+
+    while (p != NULL) {
+	if (n == max)
+	    return max + 1;
+	fields[n++] = p;
+	if ((p = strchr(p, '\t')) != NULL)
+	    *p++ = '\0';
+    }
+    return n;
+}
+
+/*
+ * copy_field - Copy src into a field of HISTORY_FIELD bytes, cut short
+ *     at a newline and with tabs made spaces, so that it stays one field
+ */
+static void copy_field(char *dst, const char *src)
+{
+    int i;
+
+    for (i = 0; i < HISTORY_FIELD - 1 && src[i] && src[i] != '\n'; i++)
+	dst[i] = src[i] == '\t' ? ' ' : src[i];
+    dst[i] = '\0';
+}
+
+/*
+ * sort_ints - Sort the n ints of a, which are few
+ */
+static void sort_ints(int *a, int n)
+{
+    int i, j, v;
+
+    for (i = 1; i < n; i++) {
+	for (v = a[i], j = i; j > 0 && a[j - 1] > v; j--)
+	    a[j] = a[j - 1];
+	a[j] = v;
+    }
+}
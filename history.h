@@ -0,0 +1,46 @@
+/*
+ * history.h - An append-only store of mdriver results, and the trend
+ *     report built from it
+ *
+ * Every recorded run appends one "run" line followed by one "trace" line
+ * per trace to a text file, with tab separated fields:
+ *
+ *     run    <time> <revision> <host id> <host> <perf index> <flags> <args>
+ *     trace  <name> <valid> <ops> <util> <secs>
+ *
+ * The host id is a hash of the host name, kernel, machine and CPU model,
+ * so that throughput is only ever compared between runs on one host.
+ * Lines starting with '#' are comments.
+ */
+
+#define HISTORY_FIELD 256  /* longest field kept, the rest is cut off */
+
+/* The results of one trace of a run */
+typedef struct {
+    char name[HISTORY_FIELD];
+    int valid;
+    double ops;
+    double util;
+    double secs;
+} history_trace_t;
+
+/* One run of mdriver */
+typedef struct {
+    long time;                      /* seconds since the epoch */
+    char revision[HISTORY_FIELD];   /* git describe of the tree */
+    char hostid[HISTORY_FIELD];     /* hash of the host fingerprint */
+    char host[HISTORY_FIELD];       /* host name */
+    double perfindex;
+    char flags[HISTORY_FIELD];      /* CFLAGS of the build */
+    char args[HISTORY_FIELD];       /* mdriver's command line */
+} history_run_t;
+
+/* Fill in the time, revision, host and flags of a run about to be recorded */
+void history_identify(history_run_t *run, int argc, char **argv);
+
+/* Append a run and its n traces to the store at path; 0 or -1 */
+int history_append(char *path, history_run_t *run, history_trace_t *traces,
+		   int n);
+
+/* Print the trends of every trace in the store, with their change points */
+int history_report(char *path);
@@ -15,11 +15,22 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
+#include "perfctr.h"
+#include "mmlock.h"
+#include "trace.h"
+#include "history.h"
 #include "config.h"
 
 /**********************
@@ -31,6 +42,38 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Scale factors of a size sweep (-x) and the width of its bars */
+#define MAXSCALES     32
+#define BARWIDTH      30
+
+/* Coalescing modes compared by -L, in MM_COALESCE_* order */
+#define NUMCOALESCE    4
+
+/* Bytes of each payload written and read back by eval_mm_touch */
+#define TOUCHBYTES    64
+
+/* Resident size samples taken per replay by eval_mm_huge */
+#define HUGESAMPLES   256
+
+/* Demand phases each thread of eval_mm_steal leads, and blocks per phase */
+#define STEALROUNDS   8
+#define STEALBLOCKS   2000
+#define STEALMAXSIZE  4096
+
+/* Bursts each thread of eval_mm_store runs, and blocks per burst */
+#define STOREROUNDS   64
+#define STOREBLOCKS   1024
+#define STORECACHE    (64 << 20) /* tcache cap, so only the bins overflow */
+
+/* Shape of the linked structures eval_mm_near builds */
+#define NEARLISTS     16     /* lists grown in turn */
+#define NEARPASSES    20     /* traversals timed */
+#define NEARFILL      2      /* filler blocks per node, half freed */
+
+/* Fresh processes timed by eval_mm_startup, and its default allocations */
+#define STARTUPRUNS   5
+#define STARTUPALLOCS 1000
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
@@ -38,30 +81,11 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
-typedef struct range_t {
-    char *lo;              /* low payload address */
-    char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
-} range_t;
-
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
-/* Holds the information for one trace file*/
+/* Records which ALIGNMENT-byte units of the heap hold a payload */
 typedef struct {
-    unsigned sugg_heapsize;   /* suggested heap size (unused) */
-    unsigned num_ids;         /* number of alloc/realloc ids */
-    unsigned num_ops;         /* number of distinct requests */
-    unsigned weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
-    char **blocks;       /* array of ptrs returned by malloc/realloc... */
-    size_t *block_sizes; /* ... and a corresponding array of payload sizes */
-} trace_t;
+    unsigned long *bits;   /* bit u is set if unit u is in a payload */
+    size_t nwords;         /* number of words in bits */
+} range_t;
 
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
@@ -71,8 +95,61 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    char checksum;   /* keeps the payload reads of eval_mm_touch alive */
+    int ntags;       /* tags that eval_mm_tag_speed cycles through */
 } speed_t;
 
+/* Holds the params to each thread of eval_mm_threads and eval_mm_replay */
+typedef struct {
+    trace_t *trace;
+    char **blocks;               /* this thread's copy of trace->blocks */
+    pthread_barrier_t *start;    /* released when every thread is ready */
+    struct timeval t0, t1;       /* when this thread started and finished */
+    int failed;                  /* set if an mm call returned NULL */
+    int tid;                     /* thread tag replayed (eval_mm_replay) */
+    unsigned *done;              /* ops completed per index (eval_mm_replay) */
+    unsigned long waits;         /* ops that waited on another thread */
+} thread_t;
+
+/* Holds the params to each thread of eval_mm_steal */
+typedef struct {
+    int tid, nthreads;
+    pthread_barrier_t *phase;    /* passed by every thread between phases */
+    int failed;                  /* set if an mm call returned NULL */
+} steal_t;
+
+/* Holds the params to each thread of eval_mm_store */
+typedef struct {
+    int tid;
+    pthread_barrier_t *start;    /* released when every thread is ready */
+    struct timeval t0, t1;       /* when this thread started and finished */
+    int failed;                  /* set if an mm call returned NULL */
+} store_t;
+
+/* Phases of a fresh process timed by eval_mm_startup */
+enum { STARTUP_MEM_INIT, STARTUP_MM_INIT, STARTUP_ALLOCS, STARTUP_PHASES };
+
+/* Cycles and minor page faults of each phase of one fresh process */
+typedef struct {
+    long cycles[STARTUP_PHASES];
+    long faults[STARTUP_PHASES];
+} startup_t;
+
+/* A node of the lists and the search tree of eval_mm_near */
+typedef struct near_node {
+    struct near_node *next, *left, *right;
+    long key;
+} near_node_t;
+
+/* Holds the structures eval_mm_near traverses under the counters */
+typedef struct {
+    near_node_t *lists[NEARLISTS];
+    near_node_t *root;
+    long *keys;                  /* every key, in insertion order */
+    int nodes;
+    long sum;                    /* keeps the traversal alive */
+} near_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -82,6 +159,8 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    long long events[PC_NEVENTS]; /* hw events while touching payloads (-e) */
+    struct mm_limit_stats limits; /* heap limit events (-S, -H) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -96,6 +175,11 @@ char msg[MAXLINE];      /* for whenever we need to compose an error message */
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* Names of the coalescing modes accepted by -C, indexed by MM_COALESCE_* */
+static char *coalesce_names[NUMCOALESCE] = {
+    "none", "immediate", "deferred", "incremental"
+};
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {  
     DEFAULT_TRACEFILES, NULL
@@ -107,14 +191,11 @@ static char *default_tracefiles[] = {
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(range_t *ranges, char *lo, int size, 
 		     int tracenum, int opnum);
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
-
-/* These functions read, allocate, and free storage for traces */
-static trace_t *read_trace(char *tracedir, char *filename);
-static void free_trace(trace_t *trace);
+static void remove_range(range_t *ranges, char *lo, int size);
+static void clear_ranges(range_t *ranges);
+static char *range_bits(range_t *ranges, char *lo, int size, int op);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -122,13 +203,50 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, int tracenum, range_t *ranges,
+			 double *util);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_tag_speed(void *ptr);
+static void eval_mm_touch(void *ptr);
+static void eval_mm_threads(trace_t *trace, int nthreads);
+static void *eval_mm_thread(void *ptr);
+static void eval_mm_replay(trace_t *trace);
+static void *eval_mm_replay_thread(void *ptr);
+static void eval_mm_sweep(trace_t *trace, int tracenum, double *scales,
+			  int nscales);
+static void eval_mm_capacity(trace_t *trace, int steps, size_t soft,
+			     size_t hard);
+static size_t eval_mm_min_heap(trace_t *trace, size_t lo, size_t hi,
+			       int reclaim);
+static int eval_mm_fits(trace_t *trace, size_t limit, int reclaim);
+static void eval_mm_latency(trace_t *trace, int tracenum, int mode,
+			    int budget);
+static int eval_mm_timed(trace_t *trace, long *nsecs);
+static void eval_mm_mesh(trace_t *trace, int tracenum, unsigned long period);
+static void eval_mm_huge(trace_t *trace, int tracenum, speed_t *params);
+static void eval_mm_tags(trace_t *trace, int tracenum, speed_t *params);
+static void eval_mm_steal(int nthreads);
+static void *eval_mm_steal_thread(void *ptr);
+static double eval_mm_store_run(int nthreads, pthread_t *tids, store_t *args);
+static void eval_mm_store(int maxthreads);
+static void *eval_mm_store_thread(void *ptr);
+static void eval_mm_near(int nodes);
+static void eval_mm_near_walk(void *ptr);
+static void eval_mm_near_lists(near_t *nt);
+static void eval_mm_near_tree(near_t *nt);
+static void eval_mm_startup(int nallocs, startup_t *median);
+static void eval_mm_startup_child(int nallocs, int fd);
+static int cmp_long(const void *a, const void *b);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printevents(int n, stats_t *stats);
+static void printlimits(int n, stats_t *stats);
+static void printstartup(int nallocs, startup_t *startup);
+static void printbar(double fraction);
 static void usage(void);
+static int parse_fit_policy(char *name);
+static int parse_coalesce(char *arg, int *budget);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
 static void app_error(char *msg);
@@ -143,7 +261,8 @@ int main(int argc, char **argv)
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
+    trace_t **traces = NULL;   /* every trace, read once for all passes */
+    range_t ranges = {NULL, 0};/* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
@@ -151,6 +270,32 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int count_events = 0;/* If set, count hw events touching payloads (-e) */
+    int print_stats = 0; /* If set, print allocator statistics (-s) */
+    int nthreads = 0;    /* If set, also replay in this many threads (-T) */
+    int replay = 0;      /* If set, replay thread tags in parallel (-r) */
+    int timing_runs = 10;/* Most timed replays per trace, 0 = none (-n) */
+    double scales[MAXSCALES];/* Size scale factors to sweep (-x) */
+    int nscales = 0;
+    char *tok;
+    size_t soft_limit = 0;/* Soft limit on the heap size (-S) */
+    size_t hard_limit = 0;/* Hard limit on the heap size (-H) */
+    int coalesce = MM_COALESCE_INCREMENTAL;/* Coalescing mode (-C) */
+    int budget = 0;      /* Merges per call in incremental mode (-C) */
+    int latency = 0;     /* If set, compare coalescing latencies (-L) */
+    long page_heap = -1; /* Largest page heap request, -1 = unset (-P) */
+    unsigned long mesh = 0;/* Span frees between meshing passes (-M) */
+    int hugepages = 0;   /* If set, compare the hugepage layer (-U) */
+    int steal_threads = 0;/* Threads of the alternating demand run (-W) */
+    int store_threads = 0;/* Most threads of the central store run (-B) */
+    int near_nodes = 0;  /* Nodes of the locality hint run (-N) */
+    int ntags = 0;       /* Tags of the tagged allocation run (-G) */
+    int capacity = -1;   /* Limits timed by capacity planning, -1 = off (-K) */
+    int startup = -1;    /* First allocations timed at startup, -1 = unset (-I) */
+    startup_t startup_stats;
+    char *record = NULL; /* Results store to append this run to (-R) */
+    history_run_t run;
+    history_trace_t *results;
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -159,7 +304,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:p:k:c:m:C:P:M:T:S:H:W:B:N:G:K:I:R:Y:x:n:ULreshvVgal")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -168,7 +313,7 @@ int main(int argc, char **argv)
             num_tracefiles = 1;
             if ((tracefiles = realloc(tracefiles, 2*sizeof(char *))) == NULL)
 		unix_error("ERROR: realloc failed in main");
-	    strcpy(tracedir, "./"); 
+	    strcpy(tracedir, optarg[0] == '/' ? "" : "./"); 
             tracefiles[0] = strdup(optarg);
             tracefiles[1] = NULL;
             break;
@@ -179,6 +324,103 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+	case 'p': /* Placement policy used by mm_malloc */
+	    mm_set_fit_policy(parse_fit_policy(optarg));
+	    break;
+	case 'k': /* Candidates examined by the good fit policy */
+	    mm_set_fit_depth(atoi(optarg));
+	    break;
+	case 'c': /* Cache colours for chunk starts */
+	    mm_set_cache_colors(atoi(optarg));
+	    break;
+	case 'C': /* Coalescing mode and incremental budget */
+	    coalesce = parse_coalesce(optarg, &budget);
+	    break;
+	case 'P': /* Serve small requests from the page heap */
+	    page_heap = strtol(optarg, NULL, 0);
+	    break;
+	case 'M': /* Mesh the page heap and report its resident size */
+	    mesh = strtoul(optarg, NULL, 0);
+	    break;
+	case 'W': /* Alternate demand between threads, with and without stealing */
+	    steal_threads = atoi(optarg);
+	    break;
+	case 'N': /* Build linked structures with and without locality hints */
+	    near_nodes = atoi(optarg);
+	    break;
+	case 'G': /* Time tagged allocation and check the tag counts */
+	    ntags = atoi(optarg);
+	    if (ntags < 1 || ntags >= MM_TAGS) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'K': /* Find the smallest heap each trace runs in */
+	    capacity = atoi(optarg);
+	    if (capacity < 0) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'I': /* Time startup up to this many allocations; 0 skips it */
+	    startup = atoi(optarg);
+	    if (startup < 0) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'R': /* Append the results of this run to a store */
+	    record = optarg;
+	    break;
+	case 'Y': /* Report the trends in a results store and exit */
+	    if (history_report(optarg) < 0) {
+		perror(optarg);
+		exit(1);
+	    }
+	    exit(0);
+	case 'B': /* Compare central store modes at up to this many threads */
+	    store_threads = atoi(optarg);
+	    break;
+	case 'U': /* Back the heap with hugepages and report their use */
+	    hugepages = 1;
+	    break;
+	case 'L': /* Compare per-op latencies under every coalescing mode */
+	    latency = 1;
+	    break;
+	case 'e': /* Count cache and TLB misses on a payload-touching run */
+	    count_events = 1;
+	    break;
+	case 'm': /* Cap on the bytes held in thread caches */
+	    mm_set_tcache_limit(strtoul(optarg, NULL, 0));
+	    break;
+	case 's': /* Print allocator statistics after each trace */
+	    print_stats = 1;
+	    break;
+	case 'T': /* Replay each trace concurrently in this many threads */
+	    nthreads = atoi(optarg);
+	    break;
+	case 'x': /* Sweep the request sizes over these scale factors */
+	    for (tok = strtok(optarg, ","); tok != NULL;
+		 tok = strtok(NULL, ",")) {
+		if (nscales == MAXSCALES || atof(tok) <= 0) {
+		    usage();
+		    exit(1);
+		}
+		scales[nscales++] = atof(tok);
+	    }
+	    break;
+	case 'n': /* Most timed replays per trace; 0 skips the timing */
+	    timing_runs = atoi(optarg);
+	    break;
+	case 'r': /* Replay thread-tagged traces with one thread per tag */
+	    replay = 1;
+	    break;
+	case 'S': /* Soft limit on the heap size */
+	    soft_limit = strtoul(optarg, NULL, 0);
+	    break;
+	case 'H': /* Hard limit on the heap size */
+	    hard_limit = strtoul(optarg, NULL, 0);
+	    break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
@@ -239,6 +481,16 @@ int main(int argc, char **argv)
 
     /* Initialize the timing package */
     init_fsecs();
+    set_fsecs_maxruns(timing_runs > 0 ? timing_runs : 1);
+
+    /* Read every trace once; the libc and mm passes share the ops */
+    if ((traces = calloc(num_tracefiles, sizeof(trace_t *))) == NULL)
+	unix_error("traces calloc in main failed");
+    for (i=0; i < num_tracefiles; i++) {
+	if (verbose > 1)
+	    printf("Reading tracefile: %s\n", tracefiles[i]);
+	traces[i] = read_trace(tracedir, tracefiles[i]);
+    }
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -254,18 +506,17 @@ int main(int argc, char **argv)
 	
 	/* Evaluate the libc malloc package using the K-best scheme */
 	for (i=0; i < num_tracefiles; i++) {
-	    trace = read_trace(tracedir, tracefiles[i]);
+	    trace = traces[i];
 	    libc_stats[i].ops = trace->num_ops;
 	    if (verbose > 1)
 		printf("Checking libc malloc for correctness, ");
 	    libc_stats[i].valid = eval_libc_valid(trace, i);
-	    if (libc_stats[i].valid) {
+	    if (libc_stats[i].valid && timing_runs > 0) {
 		speed_params.trace = trace;
 		if (verbose > 1)
 		    printf("and performance.\n");
 		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
 	    }
-	    free_trace(trace);
 	}
 
 	/* Display the libc results in a compact table */
@@ -287,27 +538,112 @@ int main(int argc, char **argv)
 	unix_error("mm_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
+    mem_set_hugepages(hugepages);
     mem_init(); 
+    mm_set_heap_limits(soft_limit, hard_limit);
+    mm_set_coalesce(coalesce, budget);
+    /* Meshing works on spans, so -M turns the whole page heap on. */
+    if (page_heap < 0 && mesh > 0)
+	page_heap = LONG_MAX;
+    if (page_heap > 0)
+	mm_set_page_heap(page_heap);
+    mm_set_mesh(mesh);
+
+    /* Time the startup of fresh processes configured like this one */
+    if (startup < 0)
+	startup = verbose ? STARTUPALLOCS : 0;
+    if (startup > 0)
+	eval_mm_startup(startup, &startup_stats);
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
+	trace = traces[i];
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	    printf("Checking mm_malloc for correctness and efficiency, ");
+	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges,
+					  &mm_stats[i].util);
+	mm_get_limit_stats(&mm_stats[i].limits);
 	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
 	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
+	    speed_params.ranges = &ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    mm_profile_reset();
+	    if (timing_runs > 0)
+		mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+#if defined(MM_PROFILE)
+	    printf("\nPhase profile of %s:\n", tracefiles[i]);
+	    mm_profile_report();
+#endif
+	    if (count_events)
+		perfctr_measure(eval_mm_touch, &speed_params,
+				mm_stats[i].events);
+	    if (print_stats) {
+		printf("\nAllocator statistics for %s:\n", tracefiles[i]);
+		mm_print_stats();
+	    }
+	    if (nthreads > 0) {
+		printf("\nConcurrent replay of %s:\n", tracefiles[i]);
+		eval_mm_threads(trace, nthreads);
+		if (print_stats)
+		    mm_print_stats();
+	    }
+	    if (replay && trace->num_threads > 1) {
+		printf("\nTagged replay of %s:\n", tracefiles[i]);
+		eval_mm_replay(trace);
+		if (print_stats)
+		    mm_print_stats();
+	    }
+	    if (nscales > 0) {
+		printf("\nSize sweep of %s:\n", tracefiles[i]);
+		eval_mm_sweep(trace, i, scales, nscales);
+	    }
+	    if (capacity >= 0) {
+		printf("\nCapacity of %s:\n", tracefiles[i]);
+		eval_mm_capacity(trace, capacity, soft_limit, hard_limit);
+	    }
+	    if (latency) {
+		printf("\nOp latencies of %s by coalescing mode:\n",
+		       tracefiles[i]);
+		eval_mm_latency(trace, i, coalesce, budget);
+	    }
+	    if (mesh > 0) {
+		printf("\nResident heap of %s, meshing every %lu span frees:\n",
+		       tracefiles[i], mesh);
+		eval_mm_mesh(trace, i, mesh);
+	    }
+	    if (hugepages) {
+		printf("\nHugepages of %s, without and with the hugepage "
+		       "layer:\n", tracefiles[i]);
+		eval_mm_huge(trace, i, &speed_params);
+	    }
+	    if (ntags > 0) {
+		printf("\nTagged allocation of %s in %d tags:\n",
+		       tracefiles[i], ntags);
+		speed_params.ntags = ntags;
+		eval_mm_tags(trace, i, &speed_params);
+	    }
 	}
 	free_trace(trace);
     }
+    free(traces);
+    free(ranges.bits);
+
+    if (steal_threads > 0) {
+	printf("\nAlternating demand in %d threads, with and without "
+	       "stealing:\n", steal_threads);
+	eval_mm_steal(steal_threads);
+    }
+    if (near_nodes > 0) {
+	printf("\nLinked structures of %d nodes, without and with "
+	       "locality hints:\n", near_nodes);
+	eval_mm_near(near_nodes);
+    }
+    if (store_threads > 0) {
+	printf("\nBurst throughput by central store mode:\n");
+	eval_mm_store(store_threads);
+    }
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -315,6 +651,22 @@ int main(int argc, char **argv)
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (startup > 0) {
+	printf("Startup of a fresh process, median of %d:\n", STARTUPRUNS);
+	printstartup(startup, &startup_stats);
+	printf("\n");
+    }
+    if (count_events) {
+	printf("Hardware events while touching payloads:\n");
+	printevents(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+    if (soft_limit || hard_limit) {
+	printf("Heap limits: soft %zu, hard %zu bytes\n", soft_limit,
+	       hard_limit);
+	printlimits(num_tracefiles, mm_stats);
+	printf("\n");
+    }
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -335,7 +687,12 @@ int main(int argc, char **argv)
     /* 
      * Compute and print the performance index 
      */
-    if (errors == 0) {
+    if (errors == 0 && timing_runs == 0) {
+	perfindex = UTIL_WEIGHT * avg_mm_util * 100.0;
+	printf("Perf index = %.0f/%.0f (util), throughput not measured "
+	       "(-n 0)\n", perfindex, UTIL_WEIGHT*100);
+    }
+    else if (errors == 0) {
 	avg_mm_throughput = ops/secs;
 
 	p1 = UTIL_WEIGHT * avg_mm_util;
@@ -359,6 +716,25 @@ int main(int argc, char **argv)
 	printf("Terminated with %d errors\n", errors);
     }
 
+    /* Record the run with every per-trace metric */
+    if (record != NULL) {
+	history_identify(&run, argc, argv);
+	run.perfindex = perfindex;
+	if ((results = calloc(num_tracefiles, sizeof(*results))) == NULL)
+	    unix_error("results calloc in main failed");
+	for (i = 0; i < num_tracefiles; i++) {
+	    snprintf(results[i].name, sizeof(results[i].name), "%s",
+		     tracefiles[i]);
+	    results[i].valid = mm_stats[i].valid;
+	    results[i].ops = mm_stats[i].ops;
+	    results[i].util = mm_stats[i].util;
+	    results[i].secs = mm_stats[i].secs;
+	}
+	if (history_append(record, &run, results, num_tracefiles) < 0)
+	    unix_error("could not append to the results store");
+	free(results);
+    }
+
     if (autograder) {
 	printf("correct:%d\n", numcorrect);
 	printf("perfidx:%.0f\n", perfindex);
@@ -369,22 +745,31 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range map, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range map to detect any overlapping allocated blocks. It has one
+ * bit per ALIGNMENT bytes of the heap, so that checking a payload
+ * costs about as much as filling it, however many blocks are live.
  ****************************************************************/
 
+/* Operations of range_bits */
+#define RANGE_TEST   0
+#define RANGE_SET    1
+#define RANGE_CLEAR  2
+
+#define WORDBITS (8 * sizeof(unsigned long))
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we mark its extent in the range map.
  */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(range_t *ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    char *p;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -407,166 +792,78 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    if ((p = range_bits(ranges, lo, size, RANGE_TEST)) != NULL) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload at %p\n",
+		lo, hi, p);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
-    /* 
-     * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
-     */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
-    p->lo = lo;
-    p->hi = hi;
-    *ranges = p;
+    /* Everything looks OK, so remember the extent of this block */
+    range_bits(ranges, lo, size, RANGE_SET);
     return 1;
 }
 
 /* 
- * remove_range - Free the range record of block whose payload starts at lo 
+ * remove_range - Forget the block whose payload of size bytes starts at lo
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(range_t *ranges, char *lo, int size)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    range_bits(ranges, lo, size, RANGE_CLEAR);
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * clear_ranges - forget every block of a trace, allocating the map the
+ *     first time
  */
-static void clear_ranges(range_t **ranges)
+static void clear_ranges(range_t *ranges)
 {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (ranges->bits == NULL) {
+	ranges->nwords = (MAX_HEAP / ALIGNMENT + WORDBITS - 1) / WORDBITS;
+	if ((ranges->bits = calloc(ranges->nwords,
+				   sizeof(unsigned long))) == NULL)
+	    unix_error("calloc error in clear_ranges");
     }
-    *ranges = NULL;
+    else
+	memset(ranges->bits, 0, ranges->nwords * sizeof(unsigned long));
 }
 
-
-/**********************************************
- * The following routines manipulate tracefiles
- *********************************************/
-
 /*
- * read_trace - read a trace file and store it in memory
+ * range_bits - Test, set or clear the bits of the units covered by the
+ *     size bytes at lo, which lie within the heap. RANGE_TEST returns
+ *     the first unit already in a payload, or NULL if there is none.
  */
-static trace_t *read_trace(char *tracedir, char *filename)
+static char *range_bits(range_t *ranges, char *lo, int size, int op)
 {
-    FILE *tracefile;
-    trace_t *trace;
-    char type[MAXLINE];
-    char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
-
-    if (verbose > 1)
-	printf("Reading tracefile: %s\n", filename);
-
-    /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
-	unix_error("malloc 1 failed in read_trance");
-	
-    /* Read the trace file header */
-    strcpy(path, tracedir);
-    strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
-	sprintf(msg, "Could not open %s in read_trace", path);
-	unix_error(msg);
-    }
-    fscanf(tracefile, "%u", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%u", &(trace->num_ids));     
-    fscanf(tracefile, "%u", &(trace->num_ops));     
-    fscanf(tracefile, "%u", &(trace->weight));        /* not used */
-    
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
-
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = 
-	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-	unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes = 
-	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-	unix_error("malloc 4 failed in read_trace");
-    
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
+    size_t first = (lo - (char *)mem_heap_lo()) / ALIGNMENT;
+    size_t last = (lo + size - 1 - (char *)mem_heap_lo()) / ALIGNMENT;
+    size_t w, u;
+    unsigned long mask, hit;
+
+    for (w = first / WORDBITS; w <= last / WORDBITS; w++) {
+	mask = ~0UL;
+	if (w == first / WORDBITS)
+	    mask &= ~0UL << (first % WORDBITS);
+	if (w == last / WORDBITS && last % WORDBITS != WORDBITS - 1)
+	    mask &= (1UL << (last % WORDBITS + 1)) - 1;
+	switch (op) {
+	case RANGE_TEST:
+	    if ((hit = ranges->bits[w] & mask) != 0) {
+		u = w * WORDBITS + __builtin_ctzl(hit);
+		return (char *)mem_heap_lo() + u * ALIGNMENT;
+	    }
 	    break;
-	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
+	case RANGE_SET:
+	    ranges->bits[w] |= mask;
 	    break;
-	case 'f':
-	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
+	case RANGE_CLEAR:
+	    ranges->bits[w] &= ~mask;
 	    break;
-	default:
-	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
-	    exit(1);
 	}
-	op_index++;
-	
     }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
-    
-    return trace;
+    return NULL;
 }
 
-/*
- * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
- */
-void free_trace(trace_t *trace)
-{
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);      
-    free(trace->block_sizes);
-    free(trace);              /* and the trace record itself... */
-}
 
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
@@ -574,9 +871,20 @@ void free_trace(trace_t *trace)
  **********************************************************************/
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * eval_mm_valid - Check the mm malloc package for correctness, and
+ *   evaluate its space utilization on the same replay.
+ *
+ *   The idea is to remember the high water mark "hwm" of the heap for 
+ *   an optimal allocator, i.e., no gaps and no internal fragmentation.
+ *   Utilization is the ratio hwm/heapsize, where heapsize is the 
+ *   high water mark of the heap in bytes while running the student's
+ *   malloc package on the trace, as reported by mem_heappeak(), so
+ *   that a heap trimmed at the end of the trace gains nothing. The
+ *   checks touch only the payloads, never the allocator's state, so
+ *   the heap grows exactly as it would in a replay of its own.
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
+static int eval_mm_valid(trace_t *trace, int tracenum, range_t *ranges,
+			 double *util) 
 {
     unsigned i, j;
     int index;
@@ -585,6 +893,8 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *newp;
     char *oldp;
     char *p;
+    size_t total_size = 0;
+    size_t max_total_size = 0;
     
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
@@ -629,6 +939,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remember region */
 	    trace->blocks[index] = p;
 	    trace->block_sizes[index] = size;
+
+	    /* Keep track of the peak total size of all allocated blocks */
+	    total_size += size;
+	    if (total_size > max_total_size)
+		max_total_size = total_size;
 	    break;
 
         case REALLOC: /* mm_realloc */
@@ -640,8 +955,8 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
-	    remove_range(ranges, oldp);
+	    /* Remove the old region from the range map */
+	    remove_range(ranges, oldp, trace->block_sizes[index]);
 	    
 	    /* Check new block for correctness and add it to range list */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
@@ -655,7 +970,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -664,16 +979,20 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    memset(newp, index & 0xFF, size);
 
 	    /* Remember region */
+	    total_size += size - trace->block_sizes[index];
+	    if (total_size > max_total_size)
+		max_total_size = total_size;
 	    trace->blocks[index] = newp;
 	    trace->block_sizes[index] = size;
 	    break;
 
         case FREE: /* mm_free */
 	    
-	    /* Remove region from list and call student's free function */
+	    /* Remove region from map and call student's free function */
 	    p = trace->blocks[index];
-	    remove_range(ranges, p);
+	    remove_range(ranges, p, trace->block_sizes[index]);
 	    mm_free(p);
+	    total_size -= trace->block_sizes[index];
 	    break;
 
 	default:
@@ -683,107 +1002,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     }
 
     /* As far as we know, this is a valid malloc package */
+    *util = (double)max_total_size / (double)mem_heappeak();
     return 1;
 }
 
-/* 
- * eval_mm_util - Evaluate the space utilization of the student's package
- *   The idea is to remember the high water mark "hwm" of the heap for 
- *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
- */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
-{   
-    unsigned i;
-    int index;
-    unsigned size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
-    char *p;
-    char *newp, *oldp;
-
-    /* Remove the unused variable warnings */
-    tracenum = tracenum;
-    ranges = ranges;
-
-    /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
-    if (mm_init() < 0)
-	app_error("mm_init failed in eval_mm_util");
-
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
-
-        case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-
-	    if ((p = mm_malloc(size)) == NULL) 
-		app_error("mm_malloc failed in eval_mm_util");
-	    
-	    /* Remember region and size */
-	    trace->blocks[index] = p;
-	    trace->block_sizes[index] = size;
-	    
-	    /* Keep track of current total size
-	     * of all allocated blocks */
-	    total_size += size;
-	    
-	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
-	    break;
-
-	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
-	    oldsize = trace->block_sizes[index];
-
-	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
-		app_error("mm_realloc failed in eval_mm_util");
-
-	    /* Remember region and size */
-	    trace->blocks[index] = newp;
-	    trace->block_sizes[index] = newsize;
-	    
-	    /* Keep track of current total size
-	     * of all allocated blocks */
-	    total_size += (newsize - oldsize);
-	    
-	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
-	    break;
-
-        case FREE: /* mm_free */
-	    index = trace->ops[i].index;
-	    size = trace->block_sizes[index];
-	    p = trace->blocks[index];
-	    
-	    mm_free(p);
-	    
-	    /* Keep track of current total size
-	     * of all allocated blocks */
-	    total_size -= size;
-	    
-	    break;
-
-	default:
-	    app_error("Nonexistent request type in eval_mm_util");
-
-        }
-    }
-
-    return ((double)max_total_size / (double)mem_heapsize());
-}
-
-
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
@@ -832,85 +1054,1427 @@ static void eval_mm_speed(void *ptr)
 }
 
 /*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
+ * eval_mm_tag_speed - Replay the trace like eval_mm_speed, allocating
+ *    every block with mm_malloc_tagged under one of the first ntags tags
+ *    by its index, as blocks of a few subsystems would be.
  */
-static int eval_libc_valid(trace_t *trace, int tracenum)
+static void eval_mm_tag_speed(void *ptr)
 {
-    unsigned i, newsize;
-    char *p, *newp, *oldp;
+    unsigned i, index, size;
+    char *p;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    int ntags = ((speed_t *)ptr)->ntags;
+
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_tag_speed");
 
     for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
         switch (trace->ops[i].type) {
 
-        case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
-		malloc_error(tracenum, i, "libc malloc failed");
-		unix_error("System message");
-	    }
-	    trace->blocks[trace->ops[i].index] = p;
+        case ALLOC: /* mm_malloc_tagged */
+	    if ((p = mm_malloc_tagged(size, 1 + index % ntags)) == NULL)
+		app_error("mm_malloc_tagged error in eval_mm_tag_speed");
+	    trace->blocks[index] = p;
 	    break;
 
-	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
-	    if ((newp = realloc(oldp, newsize)) == NULL) {
-		malloc_error(tracenum, i, "libc realloc failed");
-		unix_error("System message");
-	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	case REALLOC: /* mm_realloc, which keeps the tag */
+	    if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+		app_error("mm_realloc error in eval_mm_tag_speed");
+	    trace->blocks[index] = p;
 	    break;
-	    
-        case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+
+        case FREE: /* mm_free */
+	    mm_free(trace->blocks[index]);
 	    break;
 
 	default:
-	    app_error("invalid operation type  in eval_libc_valid");
-	}
+	    app_error("Nonexistent request type in eval_mm_tag_speed");
+        }
     }
-
-    return 1;
 }
 
-/* 
- * eval_libc_speed - This is the function that is used by fcyc() to
- *    measure the running time of the libc malloc package on the set
- *    of traces.
+/*
+ * eval_mm_touch - Replay the trace like eval_mm_speed, but write the
+ *    first TOUCHBYTES of every new payload and read them back before the
+ *    block is freed or reallocated. This makes the placement of the hot
+ *    first cache lines of blocks visible to the hardware event counters.
  */
-static void eval_libc_speed(void *ptr)
+static void eval_mm_touch(void *ptr)
 {
-    unsigned i;
-    int index, size, newsize;
-    char *p, *newp, *oldp, *block;
+    unsigned i, index, size, n;
+    volatile char *p;
+    char *oldp;
+    char sum = 0;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_touch");
+
     for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
         switch (trace->ops[i].type) {
-        case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
-		unix_error("malloc failed in eval_libc_speed");
-	    trace->blocks[index] = p;
+
+        case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(size)) == NULL)
+		app_error("mm_malloc error in eval_mm_touch");
+	    n = size < TOUCHBYTES ? size : TOUCHBYTES;
+	    memset((char *)p, index & 0xFF, n);
+	    trace->blocks[index] = (char *)p;
+	    trace->block_sizes[index] = size;
 	    break;
 
-	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	case REALLOC: /* mm_realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = realloc(oldp, newsize)) == NULL)
-		unix_error("realloc failed in eval_libc_speed\n");
-	    
-	    trace->blocks[index] = newp;
+	    sum += oldp[0];
+	    if ((p = mm_realloc(oldp, size)) == NULL)
+		app_error("mm_realloc error in eval_mm_touch");
+	    n = size < TOUCHBYTES ? size : TOUCHBYTES;
+	    memset((char *)p, index & 0xFF, n);
+	    trace->blocks[index] = (char *)p;
+	    trace->block_sizes[index] = size;
 	    break;
-	    
-        case FREE: /* free */
-	    index = trace->ops[i].index;
-	    block = trace->blocks[index];
-	    free(block);
+
+        case FREE: /* mm_free */
+	    p = trace->blocks[index];
+	    n = trace->block_sizes[index];
+	    n = n < TOUCHBYTES ? n : TOUCHBYTES;
+	    while (n-- > 0)
+		sum += p[n];
+	    mm_free((char *)p);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_touch");
+        }
+    }
+    ((speed_t *)ptr)->checksum = sum;
+}
+
+/*
+ * eval_mm_threads - Replay the trace in nthreads threads at once, each
+ *    with its own set of blocks, and report the throughput followed by
+ *    the contention on the allocator's locks during the run.
+ */
+static void eval_mm_threads(trace_t *trace, int nthreads)
+{
+    pthread_t *tids;
+    thread_t *args;
+    pthread_barrier_t start;
+    double t0 = DBL_MAX, t1 = 0, secs;
+    int t, failed = 0;
+
+    if ((tids = calloc(nthreads, sizeof(pthread_t))) == NULL ||
+	(args = calloc(nthreads, sizeof(thread_t))) == NULL)
+	unix_error("calloc failed in eval_mm_threads");
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_threads");
+    mm_lock_reset();
+
+    /* Release all threads together and time from the first start to the
+       last finish */
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (t = 0; t < nthreads; t++) {
+	args[t].trace = trace;
+	args[t].start = &start;
+	if ((args[t].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+	    unix_error("calloc failed in eval_mm_threads");
+	if (pthread_create(&tids[t], NULL, eval_mm_thread, &args[t]) != 0)
+	    unix_error("pthread_create failed in eval_mm_threads");
+    }
+    pthread_barrier_wait(&start);
+    for (t = 0; t < nthreads; t++) {
+	pthread_join(tids[t], NULL);
+	failed += args[t].failed;
+	free(args[t].blocks);
+	if (args[t].t0.tv_sec + args[t].t0.tv_usec / 1e6 < t0)
+	    t0 = args[t].t0.tv_sec + args[t].t0.tv_usec / 1e6;
+	if (args[t].t1.tv_sec + args[t].t1.tv_usec / 1e6 > t1)
+	    t1 = args[t].t1.tv_sec + args[t].t1.tv_usec / 1e6;
+    }
+    pthread_barrier_destroy(&start);
+    secs = t1 - t0;
+    printf("%d threads, %u ops each: %.6f secs, %.0f Kops",
+	   nthreads, trace->num_ops, secs,
+	   secs > 0 ? (double)nthreads * trace->num_ops / 1e3 / secs : 0.0);
+    if (failed)
+	printf(" (%d threads ran out of memory)", failed);
+    printf("\n");
+    mm_lock_report();
+
+    free(tids);
+    free(args);
+}
+
+/*
+ * eval_mm_thread - Body of one eval_mm_threads thread. Stops at the
+ *    first failed request, freeing what it still holds.
+ */
+static void *eval_mm_thread(void *ptr)
+{
+    thread_t *arg = ptr;
+    trace_t *trace = arg->trace;
+    char **blocks = arg->blocks;
+    unsigned i, index, size;
+    char *p;
+
+    pthread_barrier_wait(arg->start);
+    gettimeofday(&arg->t0, NULL);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(size)) == NULL)
+		goto fail;
+	    blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(blocks[index], size)) == NULL)
+		goto fail;
+	    blocks[index] = p;
+	    break;
+
+        case FREE: /* mm_free */
+	    mm_free(blocks[index]);
+	    blocks[index] = NULL;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_thread");
+        }
+    }
+    gettimeofday(&arg->t1, NULL);
+    return NULL;
+
+ fail:
+    gettimeofday(&arg->t1, NULL);
+    arg->failed = 1;
+    for (i = 0; i < trace->num_ids; i++)
+	mm_free(blocks[i]);
+    return NULL;
+}
+
+/*
+ * eval_mm_replay - Replay a thread-tagged trace with one thread per tag.
+ *    Each thread runs the ops with its tag in trace order, so the only
+ *    ordering kept between threads is the real one: an op on a block
+ *    waits until the previous op on the same block, possibly made by
+ *    another thread, has completed. Reports the throughput, how many ops
+ *    had to wait and how many blocks were freed by a thread other than
+ *    the one that allocated them, followed by the lock contention.
+ */
+static void eval_mm_replay(trace_t *trace)
+{
+    pthread_t *tids;
+    thread_t *args;
+    pthread_barrier_t start;
+    char **blocks;
+    unsigned *done;
+    int *owner;
+    double t0 = DBL_MAX, t1 = 0, secs;
+    unsigned long waits = 0, remote = 0;
+    unsigned i, nthreads = trace->num_threads;
+    int failed = 0;
+
+    if ((tids = calloc(nthreads, sizeof(pthread_t))) == NULL ||
+	(args = calloc(nthreads, sizeof(thread_t))) == NULL ||
+	(blocks = calloc(trace->num_ids, sizeof(char *))) == NULL ||
+	(done = calloc(trace->num_ids, sizeof(unsigned))) == NULL ||
+	(owner = calloc(trace->num_ids, sizeof(int))) == NULL)
+	unix_error("calloc failed in eval_mm_replay");
+
+    /* Count the frees made by a thread other than the allocating one */
+    for (i = 0; i < trace->num_ops; i++) {
+	if (trace->ops[i].type == FREE) {
+	    if (owner[trace->ops[i].index] != trace->ops[i].tid)
+		remote++;
+	} else
+	    owner[trace->ops[i].index] = trace->ops[i].tid;
+    }
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_replay");
+    mm_lock_reset();
+
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+	args[i].trace = trace;
+	args[i].blocks = blocks;
+	args[i].start = &start;
+	args[i].tid = i;
+	args[i].done = done;
+	if (pthread_create(&tids[i], NULL, eval_mm_replay_thread,
+			   &args[i]) != 0)
+	    unix_error("pthread_create failed in eval_mm_replay");
+    }
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(tids[i], NULL);
+	failed += args[i].failed;
+	waits += args[i].waits;
+	if (args[i].t0.tv_sec + args[i].t0.tv_usec / 1e6 < t0)
+	    t0 = args[i].t0.tv_sec + args[i].t0.tv_usec / 1e6;
+	if (args[i].t1.tv_sec + args[i].t1.tv_usec / 1e6 > t1)
+	    t1 = args[i].t1.tv_sec + args[i].t1.tv_usec / 1e6;
+    }
+    pthread_barrier_destroy(&start);
+    secs = t1 - t0;
+    printf("%u threads, %u ops: %.6f secs, %.0f Kops, %lu waits, "
+	   "%lu cross-thread frees", nthreads, trace->num_ops, secs,
+	   secs > 0 ? trace->num_ops / 1e3 / secs : 0.0, waits, remote);
+    if (failed)
+	printf(" (%d threads ran out of memory)", failed);
+    printf("\n");
+    mm_lock_report();
+
+    /* Blocks the trace never freed */
+    for (i = 0; i < trace->num_ids; i++)
+	mm_free(blocks[i]);
+    free(tids);
+    free(args);
+    free(blocks);
+    free(done);
+    free(owner);
+}
+
+/*
+ * eval_mm_replay_thread - Body of one eval_mm_replay thread. A failed
+ *    request leaves a NULL block behind and the replay goes on, so that
+ *    the threads waiting on that block are not stranded.
+ */
+static void *eval_mm_replay_thread(void *ptr)
+{
+    thread_t *arg = ptr;
+    trace_t *trace = arg->trace;
+    char **blocks = arg->blocks;
+    traceop_t *op;
+    unsigned i;
+    char *p;
+
+    pthread_barrier_wait(arg->start);
+    gettimeofday(&arg->t0, NULL);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	op = &trace->ops[i];
+	if (op->tid != arg->tid)
+	    continue;
+
+	/* Wait for the previous op on this block */
+	if (__atomic_load_n(&arg->done[op->index], __ATOMIC_ACQUIRE) !=
+	    op->seq) {
+	    arg->waits++;
+	    while (__atomic_load_n(&arg->done[op->index], __ATOMIC_ACQUIRE) !=
+		   op->seq)
+		sched_yield();
+	}
+
+        switch (op->type) {
+
+        case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(op->size)) == NULL)
+		arg->failed = 1;
+	    blocks[op->index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(blocks[op->index], op->size)) == NULL) {
+		arg->failed = 1;
+		mm_free(blocks[op->index]);
+	    }
+	    blocks[op->index] = p;
+	    break;
+
+        case FREE: /* mm_free */
+	    mm_free(blocks[op->index]);
+	    blocks[op->index] = NULL;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_replay_thread");
+        }
+	__atomic_store_n(&arg->done[op->index], op->seq + 1, __ATOMIC_RELEASE);
+    }
+    gettimeofday(&arg->t1, NULL);
+    return NULL;
+}
+
+/*
+ * eval_mm_sweep - Scale the request sizes of the trace by each factor in
+ *    turn and chart the utilization and the throughput of each scaled
+ *    trace. A scaled trace that the allocator cannot run is shown as
+ *    invalid; that is a finding, not a driver error, so it does not
+ *    count towards the error total.
+ */
+static void eval_mm_sweep(trace_t *trace, int tracenum, double *scales,
+			  int nscales)
+{
+    trace_t *scaled;
+    range_t ranges = {NULL, 0};
+    speed_t params;
+    stats_t stats[MAXSCALES];
+    double max_kops = 0;
+    int i, saved_errors = errors;
+
+    for (i = 0; i < nscales; i++) {
+	scaled = trace_scale(trace, scales[i]);
+	stats[i].ops = scaled->num_ops;
+	stats[i].valid = eval_mm_valid(scaled, tracenum, &ranges,
+				       &stats[i].util);
+	if (stats[i].valid) {
+	    params.trace = scaled;
+	    params.ranges = &ranges;
+	    stats[i].secs = fsecs(eval_mm_speed, &params);
+	    if (stats[i].ops / 1e3 / stats[i].secs > max_kops)
+		max_kops = stats[i].ops / 1e3 / stats[i].secs;
+	}
+	free_trace(scaled);
+    }
+    free(ranges.bits);
+    errors = saved_errors;
+
+    printf("%7s%7s %5s %8s  %-*s %s\n", "scale", " valid", "util",
+	   "Kops", BARWIDTH + 2, "util", "throughput");
+    for (i = 0; i < nscales; i++) {
+	if (!stats[i].valid) {
+	    printf("%7.3g%7s %5s %8s\n", scales[i], "no", "-", "-");
+	    continue;
+	}
+	printf("%7.3g%7s %4.0f%% %8.0f  ", scales[i], "yes",
+	       stats[i].util * 100.0, stats[i].ops / 1e3 / stats[i].secs);
+	printbar(stats[i].util);
+	printf(" ");
+	printbar(stats[i].ops / 1e3 / stats[i].secs / max_kops);
+	printf("\n");
+    }
+}
+
+/*
+ * eval_mm_capacity - Find the smallest memlib heap limit that the trace
+ *    runs in without a failed call, first with the allocator unaware of
+ *    the limit and then with it passed on as mm's hard limit, so that
+ *    mm_malloc flushes its caches and reclaims before it gives up. Each
+ *    is bisected down to a page between the trace's peak live bytes,
+ *    which no heap can go below, and the peak heap of an unlimited run.
+ *    The bisection takes a limit that fits to mean that every larger one
+ *    does too; a placement policy that breaks this is still shown a
+ *    limit it fits in, only not always the smallest. With steps > 0 the
+ *    trace is then timed, reclaiming, at steps + 1 limits from the
+ *    unlimited peak down to the smallest, to show what a tight heap
+ *    costs in throughput. The -S and -H limits are restored afterwards.
+ */
+static void eval_mm_capacity(trace_t *trace, int steps, size_t soft,
+			     size_t hard)
+{
+    speed_t params;
+    size_t page = mem_pagesize(), live = 0, max_live = 0;
+    size_t peak, final, top, min[2], limit;
+    double secs[MAXSCALES], max_kops = 0;
+    unsigned i, index;
+    int k;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	if (trace->ops[i].type != ALLOC)
+	    live -= trace->block_sizes[index];
+	trace->block_sizes[index] =
+	    trace->ops[i].type == FREE ? 0 : trace->ops[i].size;
+	live += trace->block_sizes[index];
+	if (live > max_live)
+	    max_live = live;
+    }
+
+    if (!eval_mm_fits(trace, 0, 0)) {
+	printf("the trace does not run in an unlimited heap\n");
+	mm_set_heap_limits(soft, hard);
+	return;
+    }
+    peak = mem_heappeak();
+    final = mem_heapsize();
+    top = (peak + page - 1) / page * page;
+    for (k = 0; k < 2; k++)
+	min[k] = eval_mm_min_heap(trace, max_live / page * page, top, k);
+
+    printf("%12s %12s %12s %12s %12s\n", "min heap(KB)", "reclaim(KB)",
+	   "peak live(KB)", "peak heap(KB)", "final(KB)");
+    printf("%12zu %12zu %12zu %12zu %12zu\n", min[0] / 1024, min[1] / 1024,
+	   max_live / 1024, peak / 1024, final / 1024);
+
+    if (steps > 0) {
+	if (steps >= MAXSCALES)
+	    steps = MAXSCALES - 1;
+	params.trace = trace;
+	for (k = 0; k <= steps; k++) {
+	    limit = top - (top - min[1]) / page * k / steps * page;
+	    secs[k] = 0;
+	    if (!eval_mm_fits(trace, limit, 1))
+		continue;
+	    secs[k] = fsecs(eval_mm_speed, &params);
+	    if (trace->num_ops / 1e3 / secs[k] > max_kops)
+		max_kops = trace->num_ops / 1e3 / secs[k];
+	}
+	printf("\n%12s %10s %8s  %s\n", "limit(KB)", "live/limit", "Kops",
+	       "throughput");
+	for (k = 0; k <= steps; k++) {
+	    limit = top - (top - min[1]) / page * k / steps * page;
+	    printf("%12zu %9.0f%% ", limit / 1024, 100.0 * max_live / limit);
+	    if (secs[k] == 0) {
+		printf("%8s\n", "-");
+		continue;
+	    }
+	    printf("%8.0f  ", trace->num_ops / 1e3 / secs[k]);
+	    printbar(trace->num_ops / 1e3 / secs[k] / max_kops);
+	    printf("\n");
+	}
+    }
+    mem_set_limit(0);
+    mm_set_heap_limits(soft, hard);
+}
+
+/*
+ * eval_mm_min_heap - Bisect for the smallest multiple of the page size
+ *    in (lo, hi] that the trace fits in, given that it does not fit in lo
+ *    and does in hi.
+ */
+static size_t eval_mm_min_heap(trace_t *trace, size_t lo, size_t hi,
+			       int reclaim)
+{
+    size_t page = mem_pagesize(), mid;
+
+    while (hi - lo > page) {
+	mid = lo + (hi - lo) / page / 2 * page;
+	if (eval_mm_fits(trace, mid, reclaim))
+	    hi = mid;
+	else
+	    lo = mid;
+    }
+    return hi;
+}
+
+/*
+ * eval_mm_fits - Replay the trace with the heap limited to limit bytes,
+ *    0 for none, and passed on to mm as its hard limit if reclaim is set.
+ *    The limits are left in place. Returns 0 if mm_init or a call fails.
+ */
+static int eval_mm_fits(trace_t *trace, size_t limit, int reclaim)
+{
+    unsigned i, index;
+    char *p;
+
+    mem_set_limit(limit);
+    mm_set_heap_limits(0, reclaim ? limit : 0);
+    mem_reset_brk();
+    if (mm_init() < 0)
+	return 0;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	    p = mm_malloc(trace->ops[i].size);
+	    break;
+	case REALLOC:
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    break;
+	case FREE:
+	    mm_free(trace->blocks[index]);
+	    p = trace->blocks[index];
+	    break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_fits");
+	}
+	if (p == NULL)
+	    return 0;
+	trace->blocks[index] = p;
+    }
+    return 1;
+}
+
+/*
+ * eval_mm_latency - Replay the trace once under each coalescing mode,
+ *    timing every call, and print the utilization and the latency
+ *    percentiles of each mode. Modes differ in when they pay for
+ *    merging: immediate on every free, deferred in one pass over the
+ *    heap on a fit miss, incremental a few blocks per call, so the tail
+ *    tells them apart where the mean does not. As in eval_mm_sweep, a
+ *    mode that cannot run the trace is a finding, not a driver error.
+ *    The mode selected with -C is restored afterwards.
+ */
+static void eval_mm_latency(trace_t *trace, int tracenum, int mode,
+			    int budget)
+{
+    range_t ranges = {NULL, 0};
+    long *nsecs;
+    double util, sum;
+    unsigned i;
+    int m, saved_errors = errors;
+
+    if ((nsecs = malloc(trace->num_ops * sizeof(long))) == NULL)
+	unix_error("malloc failed in eval_mm_latency");
+
+    printf("%12s %5s %8s %8s %8s %8s %9s\n", "mode", "util", "mean",
+	   "p50", "p99", "p99.9", "max(ns)");
+    for (m = 0; m < NUMCOALESCE; m++) {
+	mm_set_coalesce(m, budget);
+	if (!eval_mm_valid(trace, tracenum, &ranges, &util) ||
+	    !eval_mm_timed(trace, nsecs)) {
+	    printf("%12s %5s\n", coalesce_names[m], "-");
+	    continue;
+	}
+	for (i = 0, sum = 0; i < trace->num_ops; i++)
+	    sum += nsecs[i];
+	qsort(nsecs, trace->num_ops, sizeof(long), cmp_long);
+	printf("%12s %4.0f%% %8.0f %8ld %8ld %8ld %9ld\n",
+	       coalesce_names[m], util * 100.0, sum / trace->num_ops,
+	       nsecs[trace->num_ops / 2],
+	       nsecs[(size_t)(trace->num_ops * 0.99)],
+	       nsecs[(size_t)(trace->num_ops * 0.999)],
+	       nsecs[trace->num_ops - 1]);
+    }
+    mm_set_coalesce(mode, budget);
+    free(ranges.bits);
+    free(nsecs);
+    errors = saved_errors;
+}
+
+/*
+ * eval_mm_timed - Replay the trace like eval_mm_speed, storing the time
+ *    each call took in nsecs. Returns 0 if a call fails.
+ */
+static int eval_mm_timed(trace_t *trace, long *nsecs)
+{
+    struct timespec t0, t1;
+    unsigned i, index;
+    char *p;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_timed");
+
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	    p = mm_malloc(trace->ops[i].size);
+	    break;
+	case REALLOC:
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    break;
+	case FREE:
+	    mm_free(trace->blocks[index]);
+	    p = trace->blocks[index];
+	    break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_timed");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (p == NULL)
+	    return 0;
+	trace->blocks[index] = p;
+	nsecs[i] = (t1.tv_sec - t0.tv_sec) * 1000000000L +
+	    (t1.tv_nsec - t0.tv_nsec);
+    }
+    return 1;
+}
+
+/*
+ * eval_mm_mesh - Replay the trace without meshing and then meshing every
+ *    period span frees, reading the heap's resident size after every
+ *    call, and print the peak and mean of each with the cost of the
+ *    passes. The heap's pages are dropped before each replay so that both
+ *    start from nothing. Payloads are filled as in eval_mm_valid and
+ *    checked before they are reallocated or freed, so an object that a
+ *    mesh failed to carry over is reported as an error.
+ */
+static void eval_mm_mesh(trace_t *trace, int tracenum, unsigned long period)
+{
+    struct mm_mesh_stats ms;
+    size_t rss, peak[2];
+    double mean[2];
+    unsigned i, j, index, size;
+    int m, type;
+    char *p;
+
+    printf("%6s %10s %10s %7s %7s %7s %9s %9s\n", "mesh", "peak(KB)",
+	   "mean(KB)", "passes", "meshed", "pages", "mean(us)", "max(us)");
+    for (m = 0; m < 2; m++) {
+	mm_set_mesh(m ? period : 0);
+	mem_reset_brk();
+	mem_drop();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_mesh");
+
+	peak[m] = 0;
+	mean[m] = 0;
+	for (i = 0; i < trace->num_ops; i++) {
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    type = trace->ops[i].type;
+	    if (type != ALLOC) {
+		p = trace->blocks[index];
+		for (j = 0; j < trace->block_sizes[index]; j++) {
+		    if ((unsigned char)p[j] != (index & 0xFF)) {
+			malloc_error(tracenum, i, "block data changed while "
+				     "meshing");
+			break;
+		    }
+		}
+	    }
+	    if (type == FREE)
+		mm_free(trace->blocks[index]);
+	    else {
+		p = type == ALLOC ? mm_malloc(size) :
+		    mm_realloc(trace->blocks[index], size);
+		if (p == NULL) {
+		    malloc_error(tracenum, i, "mm_malloc failed.");
+		    mm_set_mesh(period);
+		    return;
+		}
+		memset(p, index & 0xFF, size);
+		trace->blocks[index] = p;
+		trace->block_sizes[index] = size;
+	    }
+	    rss = mem_heaprss();
+	    if (rss > peak[m])
+		peak[m] = rss;
+	    mean[m] += rss;
+	}
+	mean[m] /= trace->num_ops;
+
+	mm_get_mesh_stats(&ms);
+	printf("%6s %10zu %10.0f %7lu %7lu %7lu %9.1f %9.1f\n",
+	       m ? "on" : "off", peak[m] / 1024, mean[m] / 1024, ms.passes,
+	       ms.meshed, ms.pages,
+	       ms.passes ? ms.nsecs / 1e3 / ms.passes : 0.0,
+	       ms.max_nsecs / 1e3);
+    }
+    mm_set_mesh(period);
+    if (peak[0] == 0)
+	printf("The heap is not memfd backed; its resident size is unknown.\n");
+    else
+	printf("Reduction: peak %.1f%%, mean %.1f%%\n",
+	       100.0 * (1.0 - (double)peak[1] / peak[0]),
+	       100.0 * (1.0 - mean[1] / mean[0]));
+}
+
+/*
+ * eval_mm_huge - Replay the trace with the allocator's hugepage layer off
+ *    and then on, filling every payload so that its pages are resident,
+ *    and print for each the utilization, the peak and mean resident heap,
+ *    the share of it mapped by hugepages and the share of hugepage regions
+ *    at least 7/8 in use, sampled HUGESAMPLES times per replay, and the
+ *    hugepages the layer gave back. The dTLB misses of an eval_mm_touch
+ *    run with the same setting follow, or "-" where the counter is
+ *    unavailable.
+ */
+static void eval_mm_huge(trace_t *trace, int tracenum, speed_t *params)
+{
+    struct mm_huge_stats hs;
+    long long events[PC_NEVENTS];
+    size_t rss, huge, peak, total, max_total;
+    double mean, coverage, dense;
+    unsigned i, index, size, every, samples;
+    int m, type;
+    char *p;
+
+    every = trace->num_ops / HUGESAMPLES + 1;
+    printf("%6s %6s %10s %10s %9s %8s %8s %12s\n", "layer", "util",
+	   "peak(KB)", "mean(KB)", "coverage", "dense", "returned",
+	   "dTLB misses");
+    for (m = 0; m < 2; m++) {
+	mm_set_hugepage(m);
+	mem_reset_brk();
+	mem_drop();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_huge");
+
+	peak = total = max_total = 0;
+	mean = coverage = dense = 0;
+	samples = 0;
+	for (i = 0; i < trace->num_ops; i++) {
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    type = trace->ops[i].type;
+	    if (type != ALLOC)
+		total -= trace->block_sizes[index];
+	    if (type == FREE)
+		mm_free(trace->blocks[index]);
+	    else {
+		p = type == ALLOC ? mm_malloc(size) :
+		    mm_realloc(trace->blocks[index], size);
+		if (p == NULL) {
+		    malloc_error(tracenum, i, "mm_malloc failed.");
+		    mm_set_hugepage(0);
+		    return;
+		}
+		memset(p, index & 0xFF, size);
+		trace->blocks[index] = p;
+		trace->block_sizes[index] = size;
+		total += size;
+		if (total > max_total)
+		    max_total = total;
+	    }
+	    if (i % every == 0 || i == trace->num_ops - 1) {
+		rss = mem_heaprss();
+		huge = mem_heaphuge();
+		if (rss > peak)
+		    peak = rss;
+		mean += rss;
+		coverage += rss ? (double)huge / rss : 0;
+		mm_get_huge_stats(&hs);
+		dense += hs.regions ? (double)hs.dense / hs.regions : 0;
+		samples++;
+	    }
+	}
+	mm_get_huge_stats(&hs);
+	perfctr_measure(eval_mm_touch, params, events);
+
+	printf("%6s %5.1f%% %10zu %10.0f %8.1f%% %7.1f%% %8lu ",
+	       m ? "on" : "off", 100.0 * max_total / mem_heappeak(),
+	       peak / 1024, mean / samples / 1024,
+	       100.0 * coverage / samples, 100.0 * dense / samples,
+	       hs.returned);
+	if (events[PC_DTLB_MISS] >= 0)
+	    printf("%12lld\n", events[PC_DTLB_MISS]);
+	else
+	    printf("%12s\n", "-");
+    }
+    mm_set_hugepage(0);
+}
+
+/*
+ * eval_mm_tags - Time the trace untagged and with every block tagged as
+ *    eval_mm_tag_speed does, and print the throughput of both in Kops
+ *    with the overhead of tagging. The first half of the trace is then
+ *    replayed tagged to check the tag counts: the blocks live at that
+ *    point must be counted under their tags, and freeing them must bring
+ *    every count back to zero.
+ */
+static void eval_mm_tags(trace_t *trace, int tracenum, speed_t *params)
+{
+    struct mm_tag_stats ts[MM_TAGS];
+    long expect[MM_TAGS], nlive, bytes;
+    double secs[2];
+    unsigned i, index, size, half;
+    char *p;
+    int t, ntags = params->ntags;
+
+    secs[0] = fsecs(eval_mm_speed, params);
+    secs[1] = fsecs(eval_mm_tag_speed, params);
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_tags");
+    half = trace->num_ops / 2;
+    memset(trace->block_sizes, 0, trace->num_ids * sizeof(size_t));
+    for (i = 0; i < half; i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	if (trace->ops[i].type == FREE) {
+	    mm_free(trace->blocks[index]);
+	    trace->block_sizes[index] = 0;
+	    continue;
+	}
+	p = trace->ops[i].type == ALLOC ?
+	    mm_malloc_tagged(size, 1 + index % ntags) :
+	    mm_realloc(trace->blocks[index], size);
+	if (p == NULL) {
+	    malloc_error(tracenum, i, "mm_malloc_tagged failed.");
+	    return;
+	}
+	trace->blocks[index] = p;
+	trace->block_sizes[index] = size;
+    }
+
+    memset(expect, 0, sizeof(expect));
+    for (index = 0; index < trace->num_ids; index++)
+	if (trace->block_sizes[index] != 0)
+	    expect[1 + index % ntags]++;
+    mm_get_tag_stats(ts);
+    for (nlive = bytes = 0, t = 0; t < MM_TAGS; t++) {
+	if (ts[t].blocks != expect[t]) {
+	    malloc_error(tracenum, half, "tag counts do not match the "
+			 "live blocks.");
+	    return;
+	}
+	nlive += ts[t].blocks;
+	bytes += ts[t].bytes;
+    }
+    for (index = 0; index < trace->num_ids; index++)
+	if (trace->block_sizes[index] != 0)
+	    mm_free(trace->blocks[index]);
+    mm_get_tag_stats(ts);
+    for (t = 0; t < MM_TAGS; t++)
+	if (ts[t].blocks != 0 || ts[t].bytes != 0) {
+	    malloc_error(tracenum, half, "tag counts left after every "
+			 "block was freed.");
+	    return;
+	}
+
+    printf("%10s %10s %9s %10s %12s\n", "untagged", "tagged", "overhead",
+	   "half live", "half KB");
+    printf("%10.0f %10.0f %8.1f%% %10ld %12ld\n",
+	   trace->num_ops / secs[0] / 1e3, trace->num_ops / secs[1] / 1e3,
+	   100.0 * (secs[1] - secs[0]) / secs[0], nlive, bytes / 1024);
+}
+
+/*
+ * eval_mm_steal - Run nthreads threads that take turns leading a demand
+ *    phase, STEALROUNDS phases each: the leader allocates STEALBLOCKS
+ *    blocks, fills them and frees them, while the others wait. The freed
+ *    blocks land in the leader's thread cache, where they sit idle while
+ *    the next leader grows the heap. The run is made with stealing
+ *    between thread caches off and then on, and prints the peak heap
+ *    size of each with the stealing statistics. The growth avoided is
+ *    the difference in peak heap size; the fits column only adds up the
+ *    extensions that the steals which found a fit skipped.
+ */
+static void eval_mm_steal(int nthreads)
+{
+    struct mm_steal_stats ss;
+    pthread_t *tids;
+    steal_t *args;
+    pthread_barrier_t phase;
+    size_t peak[2];
+    int m, t, failed;
+
+    if ((tids = calloc(nthreads, sizeof(pthread_t))) == NULL ||
+	(args = calloc(nthreads, sizeof(steal_t))) == NULL)
+	unix_error("calloc failed in eval_mm_steal");
+
+    printf("%6s %10s %7s %7s %8s %10s %9s\n", "steal", "peak(KB)",
+	   "tries", "steals", "blocks", "taken(KB)", "fits(KB)");
+    for (m = 0; m < 2; m++) {
+	mm_set_tcache_steal(m);
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_steal");
+
+	pthread_barrier_init(&phase, NULL, nthreads);
+	for (t = 0; t < nthreads; t++) {
+	    args[t].tid = t;
+	    args[t].nthreads = nthreads;
+	    args[t].phase = &phase;
+	    args[t].failed = 0;
+	    if (pthread_create(&tids[t], NULL, eval_mm_steal_thread,
+			       &args[t]) != 0)
+		unix_error("pthread_create failed in eval_mm_steal");
+	}
+	for (failed = 0, t = 0; t < nthreads; t++) {
+	    pthread_join(tids[t], NULL);
+	    failed += args[t].failed;
+	}
+	pthread_barrier_destroy(&phase);
+	if (failed)
+	    printf("%d threads saw an mm_malloc failure\n", failed);
+
+	peak[m] = mem_heappeak();
+	mm_get_steal_stats(&ss);
+	printf("%6s %10zu %7lu %7lu %8lu %10zu %9zu\n", m ? "on" : "off",
+	       peak[m] / 1024, ss.tries, ss.steals, ss.blocks,
+	       ss.bytes / 1024, ss.fits / 1024);
+    }
+    mm_set_tcache_steal(1);
+    printf("Heap growth avoided: %zd KB (%.1f%% of the peak)\n",
+	   ((ssize_t)peak[0] - (ssize_t)peak[1]) / 1024,
+	   100.0 * ((double)peak[0] - peak[1]) / peak[0]);
+    free(tids);
+    free(args);
+}
+
+/*
+ * eval_mm_steal_thread - Lead every nthreads-th demand phase of
+ *    eval_mm_steal, waiting for the other phases to pass. The sizes of a
+ *    phase depend only on its number, so both runs see the same requests.
+ */
+static void *eval_mm_steal_thread(void *ptr)
+{
+    steal_t *arg = ptr;
+    char *blocks[STEALBLOCKS];
+    unsigned seed, size;
+    int k, i;
+
+    for (k = 0; k < STEALROUNDS * arg->nthreads; k++) {
+	if (k % arg->nthreads == arg->tid) {
+	    seed = k + 1;
+	    for (i = 0; i < STEALBLOCKS; i++) {
+		size = 16 + rand_r(&seed) % STEALMAXSIZE;
+		if ((blocks[i] = mm_malloc(size)) == NULL) {
+		    arg->failed = 1;
+		    break;
+		}
+		memset(blocks[i], i & 0xFF, size);
+	    }
+	    while (--i >= 0)
+		mm_free(blocks[i]);
+	}
+	pthread_barrier_wait(arg->phase);
+    }
+    return NULL;
+}
+
+/*
+ * eval_mm_near - Build NEARLISTS linked lists, grown in turn, and an
+ *    unbalanced binary search tree of random keys, nodes nodes each, on
+ *    a heap fragmented by filler blocks of random sizes, half of them
+ *    freed. The run is made first with mm_malloc and then with
+ *    mm_malloc_near, each node hinted by its predecessor or parent. For
+ *    each it prints the build time, the time per node of a list
+ *    traversal and of a tree lookup over NEARPASSES passes, the mean
+ *    distance between the nodes of a list and the share of its links
+ *    within one page, the cache misses of both traversals, or "-" where
+ *    a counter is unavailable, and the share of hints served near.
+ */
+static void eval_mm_near(int nodes)
+{
+    struct mm_near_stats ns;
+    long long events[PC_NEVENTS];
+    near_t nt;
+    near_node_t *n, **link, *tails[NEARLISTS];
+    char **filler;
+    struct timespec t0, t1;
+    double build, lists, tree, dist;
+    unsigned long links, local;
+    unsigned seed;
+    int m, i, k, size;
+
+    if ((filler = calloc((size_t)nodes * NEARFILL, sizeof(char *))) == NULL ||
+	(nt.keys = calloc(nodes, sizeof(long))) == NULL)
+	unix_error("calloc failed in eval_mm_near");
+    nt.nodes = nodes;
+
+    printf("%5s %9s %8s %8s %9s %7s %10s %10s %7s\n", "hints", "build(s)",
+	   "list ns", "tree ns", "dist(B)", "local", "L1D miss", "LLC miss",
+	   "near");
+    for (m = 0; m < 2; m++) {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_near");
+	seed = 1;
+	for (i = 0; i < nodes * NEARFILL; i++) {
+	    size = 16 + rand_r(&seed) % 240;
+	    if ((filler[i] = mm_malloc(size)) == NULL)
+		app_error("mm_malloc failed in eval_mm_near");
+	}
+	for (i = 0; i < nodes * NEARFILL; i += 2)
+	    mm_free(filler[i]);
+
+	/* Build, hinting each node with the one it is linked from. */
+	memset(nt.lists, 0, sizeof(nt.lists));
+	memset(tails, 0, sizeof(tails));
+	nt.root = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nodes; i++) {
+	    k = i % NEARLISTS;
+	    n = m ? mm_malloc_near(sizeof(*n), tails[k]) :
+		mm_malloc(sizeof(*n));
+	    if (n == NULL)
+		app_error("mm_malloc failed in eval_mm_near");
+	    n->next = n->left = n->right = NULL;
+	    n->key = i;
+	    if (tails[k] != NULL)
+		tails[k]->next = n;
+	    else
+		nt.lists[k] = n;
+	    tails[k] = n;
+	}
+	for (i = 0; i < nodes; i++) {
+	    nt.keys[i] = rand_r(&seed);
+	    for (link = &nt.root, n = NULL; *link != NULL;
+		 link = nt.keys[i] < (*link)->key ? &(*link)->left :
+		     &(*link)->right)
+		n = *link;
+	    *link = m ? mm_malloc_near(sizeof(**link), n) :
+		mm_malloc(sizeof(**link));
+	    if (*link == NULL)
+		app_error("mm_malloc failed in eval_mm_near");
+	    (*link)->next = (*link)->left = (*link)->right = NULL;
+	    (*link)->key = nt.keys[i];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	build = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	/* Measure the locality of every link. */
+	dist = 0;
+	links = local = 0;
+	for (k = 0; k < NEARLISTS; k++)
+	    for (n = nt.lists[k]; n != NULL && n->next != NULL; n = n->next) {
+		dist += labs((char *)n->next - (char *)n);
+		local += labs((char *)n->next - (char *)n) < 4096;
+		links++;
+	    }
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < NEARPASSES; i++)
+	    eval_mm_near_lists(&nt);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	lists = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < NEARPASSES; i++)
+	    eval_mm_near_tree(&nt);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	tree = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	perfctr_measure(eval_mm_near_walk, &nt, events);
+	mm_get_near_stats(&ns);
+
+	printf("%5s %9.4f %8.1f %8.1f %9.0f %6.1f%% ", m ? "on" : "off",
+	       build, lists * 1e9 / NEARPASSES / nodes,
+	       tree * 1e9 / NEARPASSES / nodes, dist / links,
+	       100.0 * local / links);
+	for (k = PC_L1D_MISS; k <= PC_LLC_MISS; k++) {
+	    if (events[k] >= 0)
+		printf("%10lld ", events[k]);
+	    else
+		printf("%10s ", "-");
+	}
+	printf("%6.1f%%\n", ns.requests ? 100.0 * ns.near / ns.requests : 0.0);
+    }
+    free(filler);
+    free(nt.keys);
+}
+
+/*
+ * eval_mm_near_walk - Run both traversals of eval_mm_near
+ */
+static void eval_mm_near_walk(void *ptr)
+{
+    eval_mm_near_lists(ptr);
+    eval_mm_near_tree(ptr);
+}
+
+/*
+ * eval_mm_near_lists - Traverse every list of eval_mm_near
+ */
+static void eval_mm_near_lists(near_t *nt)
+{
+    near_node_t *n;
+    int k;
+
+    for (k = 0; k < NEARLISTS; k++)
+	for (n = nt->lists[k]; n != NULL; n = n->next)
+	    nt->sum += n->key;
+}
+
+/*
+ * eval_mm_near_tree - Look up every key of the tree of eval_mm_near
+ */
+static void eval_mm_near_tree(near_t *nt)
+{
+    near_node_t *n;
+    int i;
+
+    for (i = 0; i < nt->nodes; i++) {
+	for (n = nt->root; n != NULL && n->key != nt->keys[i];
+	     n = nt->keys[i] < n->key ? n->left : n->right)
+	    ;
+	nt->sum += n != NULL;
+    }
+}
+
+/*
+ * eval_mm_store - Time STOREROUNDS bursts of STOREBLOCKS small blocks in
+ *    1, 2, 4, ... up to maxthreads threads. A burst is larger than a
+ *    thread cache bin, so each one overflows its bins and must refill
+ *    them, which is the traffic the central store carries. Every thread
+ *    count runs with the store off, behind a mutex and lock-free, and
+ *    prints the throughput of each and the lock-free speedup over the
+ *    mutex. The cap on cached bytes is left at STORECACHE.
+ */
+static void eval_mm_store(int maxthreads)
+{
+    static const int modes[] = {
+	MM_STORE_NONE, MM_STORE_MUTEX, MM_STORE_LOCKFREE
+    };
+    double kops[3];
+    pthread_t *tids;
+    store_t *args;
+    int n, m;
+
+    if ((tids = calloc(maxthreads, sizeof(pthread_t))) == NULL ||
+	(args = calloc(maxthreads, sizeof(store_t))) == NULL)
+	unix_error("calloc failed in eval_mm_store");
+
+    mm_set_tcache_limit(STORECACHE);
+    printf("%7s %10s %10s %10s %8s\n", "threads", "none", "mutex",
+	   "lock-free", "speedup");
+    for (n = 1; n <= maxthreads; n = n < maxthreads && 2 * n > maxthreads ?
+	     maxthreads : 2 * n) {
+	for (m = 0; m < 3; m++) {
+	    mm_set_tcache_store(modes[m]);
+	    kops[m] = eval_mm_store_run(n, tids, args);
+	}
+	printf("%7d %10.0f %10.0f %10.0f %7.2fx\n", n, kops[0], kops[1],
+	       kops[2], kops[1] > 0 ? kops[2] / kops[1] : 0.0);
+    }
+    printf("(Kops; the speedup is lock-free over mutex)\n");
+    mm_set_tcache_store(MM_STORE_LOCKFREE);
+    free(tids);
+    free(args);
+}
+
+/*
+ * eval_mm_store_run - Run the bursts of eval_mm_store in nthreads threads
+ *    on a fresh heap and return the throughput in Kops
+ */
+static double eval_mm_store_run(int nthreads, pthread_t *tids, store_t *args)
+{
+    pthread_barrier_t start;
+    double t0 = 1e30, t1 = 0, secs;
+    int t, failed = 0;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_store");
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (t = 0; t < nthreads; t++) {
+	args[t].tid = t;
+	args[t].start = &start;
+	args[t].failed = 0;
+	if (pthread_create(&tids[t], NULL, eval_mm_store_thread,
+			   &args[t]) != 0)
+	    unix_error("pthread_create failed in eval_mm_store");
+    }
+    pthread_barrier_wait(&start);
+    for (t = 0; t < nthreads; t++) {
+	pthread_join(tids[t], NULL);
+	failed += args[t].failed;
+	if (args[t].t0.tv_sec + args[t].t0.tv_usec / 1e6 < t0)
+	    t0 = args[t].t0.tv_sec + args[t].t0.tv_usec / 1e6;
+	if (args[t].t1.tv_sec + args[t].t1.tv_usec / 1e6 > t1)
+	    t1 = args[t].t1.tv_sec + args[t].t1.tv_usec / 1e6;
+    }
+    pthread_barrier_destroy(&start);
+    if (failed)
+	printf("%d threads saw an mm_malloc failure\n", failed);
+    secs = t1 - t0;
+    return secs > 0 ?
+	2.0 * nthreads * STOREROUNDS * STOREBLOCKS / 1e3 / secs : 0.0;
+}
+
+/*
+ * eval_mm_store_thread - Allocate and free STOREROUNDS bursts of
+ *    STOREBLOCKS blocks in the cached size classes
+ */
+static void *eval_mm_store_thread(void *ptr)
+{
+    store_t *arg = ptr;
+    char *blocks[STOREBLOCKS];
+    unsigned seed = arg->tid + 1, size;
+    int k, i;
+
+    pthread_barrier_wait(arg->start);
+    gettimeofday(&arg->t0, NULL);
+    for (k = 0; k < STOREROUNDS; k++) {
+	for (i = 0; i < STOREBLOCKS; i++) {
+	    size = 16 + rand_r(&seed) % 8 * 16;
+	    if ((blocks[i] = mm_malloc(size)) == NULL) {
+		arg->failed = 1;
+		break;
+	    }
+	}
+	while (--i >= 0)
+	    mm_free(blocks[i]);
+	if (arg->failed)
+	    break;
+    }
+    gettimeofday(&arg->t1, NULL);
+    return NULL;
+}
+
+/*
+ * eval_mm_startup - Time what a short-lived program pays before its
+ *    first allocations are served: mem_init, mm_init and the first
+ *    nallocs calls to mm_malloc, in cycles and minor page faults, each
+ *    in a fresh process forked from this one with the same mm settings.
+ *    The child drops the heap it inherits, so that it starts from no
+ *    mapping, and sends its counts back through a pipe. Each count is
+ *    the median of STARTUPRUNS processes.
+ */
+static void eval_mm_startup(int nallocs, startup_t *median)
+{
+    startup_t runs[STARTUPRUNS];
+    long sorted[STARTUPRUNS];
+    int fds[2], status, r, p;
+    ssize_t n;
+    pid_t pid;
+
+    fflush(stdout);
+    for (r = 0; r < STARTUPRUNS; r++) {
+	if (pipe(fds) < 0)
+	    unix_error("pipe failed in eval_mm_startup");
+	if ((pid = fork()) < 0)
+	    unix_error("fork failed in eval_mm_startup");
+	if (pid == 0) {
+	    close(fds[0]);
+	    eval_mm_startup_child(nallocs, fds[1]);
+	}
+	close(fds[1]);
+	n = read(fds[0], &runs[r], sizeof(startup_t));
+	close(fds[0]);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+	    app_error("the child of eval_mm_startup died");
+	if (WEXITSTATUS(status) != 0)
+	    app_error("mm_init or mm_malloc failed in eval_mm_startup");
+	if (n != sizeof(startup_t))
+	    app_error("no counts from the child of eval_mm_startup");
+    }
+
+    for (p = 0; p < STARTUP_PHASES; p++) {
+	for (r = 0; r < STARTUPRUNS; r++)
+	    sorted[r] = runs[r].cycles[p];
+	qsort(sorted, STARTUPRUNS, sizeof(long), cmp_long);
+	median->cycles[p] = sorted[STARTUPRUNS / 2];
+	for (r = 0; r < STARTUPRUNS; r++)
+	    sorted[r] = runs[r].faults[p];
+	qsort(sorted, STARTUPRUNS, sizeof(long), cmp_long);
+	median->faults[p] = sorted[STARTUPRUNS / 2];
+    }
+}
+
+/*
+ * eval_mm_startup_child - The fresh process of eval_mm_startup. The
+ *    requests cycle through the powers of two from 16 to 4096 bytes, so
+ *    that the first allocations reach every small class. Exits with
+ *    status 1 if a call fails.
+ */
+static void eval_mm_startup_child(int nallocs, int fd)
+{
+    startup_t s;
+    struct rusage ru;
+    long faults;
+    int i;
+
+    mem_deinit();
+    getrusage(RUSAGE_SELF, &ru);
+    faults = ru.ru_minflt;
+
+    start_counter();
+    mem_init();
+    s.cycles[STARTUP_MEM_INIT] = get_counter();
+    getrusage(RUSAGE_SELF, &ru);
+    s.faults[STARTUP_MEM_INIT] = ru.ru_minflt - faults;
+    faults = ru.ru_minflt;
+
+    start_counter();
+    if (mm_init() < 0)
+	_exit(1);
+    s.cycles[STARTUP_MM_INIT] = get_counter();
+    getrusage(RUSAGE_SELF, &ru);
+    s.faults[STARTUP_MM_INIT] = ru.ru_minflt - faults;
+    faults = ru.ru_minflt;
+
+    start_counter();
+    for (i = 0; i < nallocs; i++)
+	if (mm_malloc((size_t)16 << (i % 9)) == NULL)
+	    _exit(1);
+    s.cycles[STARTUP_ALLOCS] = get_counter();
+    getrusage(RUSAGE_SELF, &ru);
+    s.faults[STARTUP_ALLOCS] = ru.ru_minflt - faults;
+
+    if (write(fd, &s, sizeof(s)) != sizeof(s))
+	_exit(1);
+    _exit(0);
+}
+
+/*
+ * cmp_long - qsort comparison of two longs
+ */
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * eval_libc_valid - We run this function to make sure that the
+ *    libc malloc can run to completion on the set of traces.
+ *    We'll be conservative and terminate if any libc malloc call fails.
+ *
+ */
+static int eval_libc_valid(trace_t *trace, int tracenum)
+{
+    unsigned i, newsize;
+    char *p, *newp, *oldp;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* malloc */
+	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+	case REALLOC: /* realloc */
+            newsize = trace->ops[i].size;
+	    oldp = trace->blocks[trace->ops[i].index];
+	    if ((newp = realloc(oldp, newsize)) == NULL) {
+		malloc_error(tracenum, i, "libc realloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = newp;
+	    break;
+	    
+        case FREE: /* free */
+	    free(trace->blocks[trace->ops[i].index]);
+	    break;
+
+	default:
+	    app_error("invalid operation type  in eval_libc_valid");
+	}
+    }
+
+    return 1;
+}
+
+/* 
+ * eval_libc_speed - This is the function that is used by fcyc() to
+ *    measure the running time of the libc malloc package on the set
+ *    of traces.
+ */
+static void eval_libc_speed(void *ptr)
+{
+    unsigned i;
+    int index, size, newsize;
+    char *p, *newp, *oldp, *block;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+        case ALLOC: /* malloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if ((p = malloc(size)) == NULL)
+		unix_error("malloc failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* realloc */
+	    index = trace->ops[i].index;
+	    newsize = trace->ops[i].size;
+	    oldp = trace->blocks[index];
+	    if ((newp = realloc(oldp, newsize)) == NULL)
+		unix_error("realloc failed in eval_libc_speed\n");
+	    
+	    trace->blocks[index] = newp;
+	    break;
+	    
+        case FREE: /* free */
+	    index = trace->ops[i].index;
+	    block = trace->blocks[index];
+	    free(block);
 	    break;
 	}
     }
@@ -937,7 +2501,19 @@ static void printresults(int n, stats_t *stats)
     printf("%5s%7s %5s%8s%10s %6s\n", 
 	   "trace", " valid", "util", "ops", "secs", "Kops");
     for (i=0; i < n; i++) {
-	if (stats[i].valid) {
+	if (stats[i].valid && stats[i].secs == 0) {
+	    /* Not timed (-n 0) */
+	    printf("%2d%10s%5.0f%%%8.0f%10s %6s\n", 
+		   i,
+		   "yes",
+		   stats[i].util*100.0,
+		   stats[i].ops,
+		   "-",
+		   "-");
+	    ops += stats[i].ops;
+	    util += stats[i].util;
+	}
+	else if (stats[i].valid) {
 	    printf("%2d%10s%5.0f%%%8.0f%10.6f %6.0f\n", 
 		   i,
 		   "yes",
@@ -961,7 +2537,15 @@ static void printresults(int n, stats_t *stats)
     }
 
     /* Print the aggregate results for the set of traces */
-    if (errors == 0) {
+    if (errors == 0 && secs == 0) {
+	printf("%12s%5.0f%%%8.0f%10s %6s\n", 
+	       "Total       ",
+	       (util/n)*100.0,
+	       ops, 
+	       "-",
+	       "-");
+    }
+    else if (errors == 0) {
 	printf("%12s%5.0f%%%8.0f%10.6f %6.0f\n", 
 	       "Total       ",
 	       (util/n)*100.0,
@@ -980,6 +2564,84 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printevents - prints the hardware event counts gathered with -e
+ */
+static void printevents(int n, stats_t *stats)
+{
+    int i, e;
+
+    printf("%5s", "trace");
+    for (e = 0; e < PC_NEVENTS; e++)
+	printf("%12s", perfctr_name(e));
+    printf("\n");
+    for (i = 0; i < n; i++) {
+	printf("%2d   ", i);
+	for (e = 0; e < PC_NEVENTS; e++) {
+	    if (stats[i].valid && stats[i].events[e] >= 0)
+		printf("%12lld", stats[i].events[e]);
+	    else
+		printf("%12s", "-");
+	}
+	printf("\n");
+    }
+}
+
+/*
+ * printstartup - prints the cycles and page faults of each phase of a
+ *     fresh process, as timed by eval_mm_startup
+ */
+static void printstartup(int nallocs, startup_t *startup)
+{
+    char label[32];
+    long cycles = 0, faults = 0;
+    int p;
+
+    printf("%-16s %12s %8s\n", "phase", "cycles", "faults");
+    for (p = 0; p < STARTUP_PHASES; p++) {
+	if (p == STARTUP_ALLOCS)
+	    snprintf(label, sizeof(label), "first %d", nallocs);
+	else
+	    snprintf(label, sizeof(label), "%s",
+		     p == STARTUP_MEM_INIT ? "mem_init" : "mm_init");
+	printf("%-16s %12ld %8ld\n", label, startup->cycles[p],
+	       startup->faults[p]);
+	cycles += startup->cycles[p];
+	faults += startup->faults[p];
+    }
+    printf("%-16s %12ld %8ld\n", "total", cycles, faults);
+}
+
+/*
+ * printlimits - prints how often each heap limit was reached during the
+ *     correctness run of each trace
+ */
+static void printlimits(int n, stats_t *stats)
+{
+    int i;
+
+    printf("%5s%7s %8s %8s %8s %10s\n", "trace", " valid", "soft", "hard",
+	   "merged", "trimmed");
+    for (i = 0; i < n; i++)
+	printf("%2d%10s %8lu %8lu %8lu %10zu\n", i,
+	       stats[i].valid ? "yes" : "no", stats[i].limits.soft,
+	       stats[i].limits.hard, stats[i].limits.merged,
+	       stats[i].limits.trimmed);
+}
+
+/*
+ * printbar - prints a bar of BARWIDTH characters filled to fraction
+ */
+static void printbar(double fraction)
+{
+    int i, n = (int)(fraction * BARWIDTH + 0.5);
+
+    printf("|");
+    for (i = 0; i < BARWIDTH; i++)
+	printf("%c", i < n ? '#' : ' ');
+    printf("|");
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -998,6 +2660,45 @@ void unix_error(char *msg)
     exit(1);
 }
 
+/*
+ * parse_fit_policy - Map a policy name given with -p to its MM_FIT_* value
+ */
+static int parse_fit_policy(char *name)
+{
+    if (!strcmp(name, "first"))
+	return MM_FIT_SEGREGATED_FIRST;
+    if (!strcmp(name, "best"))
+	return MM_FIT_SEGREGATED_BEST;
+    if (!strcmp(name, "good"))
+	return MM_FIT_SEGREGATED_GOOD;
+    if (!strcmp(name, "adaptive"))
+	return MM_FIT_ADAPTIVE;
+    fprintf(stderr, "Unknown placement policy: %s\n", name);
+    usage();
+    exit(1);
+}
+
+/*
+ * parse_coalesce - Map a -C argument, mode[:budget], to its MM_COALESCE_*
+ *    value and store the budget, if one is given, in *budget
+ */
+static int parse_coalesce(char *arg, int *budget)
+{
+    char *colon = strchr(arg, ':');
+    int m;
+
+    if (colon != NULL) {
+	*colon = '\0';
+	*budget = atoi(colon + 1);
+    }
+    for (m = 0; m < NUMCOALESCE; m++)
+	if (!strcmp(arg, coalesce_names[m]))
+	    return m;
+    fprintf(stderr, "Unknown coalescing mode: %s\n", arg);
+    usage();
+    exit(1);
+}
+
 /*
  * malloc_error - Report an error returned by the mm_malloc package
  */
@@ -1012,14 +2713,39 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValersL] [-f <file>] [-t <dir>] [-p <policy>] [-k <depth>] [-c <colors>] [-m <bytes>] [-C <mode>[:<n>]] [-P <bytes>] [-M <frees>] [-U] [-T <threads>] [-W <threads>] [-B <threads>] [-N <nodes>] [-G <tags>] [-K <steps>] [-I <allocs>] [-R <file>] [-Y <file>] [-S <bytes>] [-H <bytes>] [-x <scales>] [-n <runs>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-c <colors> Cache colours for the chunks carved by mm_init.\n");
+    fprintf(stderr, "\t-C <mode>[:<n>] Coalescing: none, immediate, deferred or\n\t           incremental (default), merging <n> queued frees per call.\n");
+    fprintf(stderr, "\t-e         Count cache/TLB misses on a payload-touching run.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file, text or packed by tracetool -z.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <bytes> Hard limit on the heap size.\n");
+    fprintf(stderr, "\t-K <steps> Find the smallest heap each trace runs in, and time the\n\t           trace at <steps> + 1 limits from its unlimited peak down\n\t           to that heap (0 = no timing).\n");
+    fprintf(stderr, "\t-I <allocs> Time mem_init, mm_init and the first <allocs> allocations\n\t           in fresh processes (default %d with -v, 0 = skip).\n", STARTUPALLOCS);
+    fprintf(stderr, "\t-k <depth> Candidates examined by -p good (0 = all).\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Compare op latencies under every coalescing mode.\n");
+    fprintf(stderr, "\t-m <bytes> Cap on thread cached bytes (0 disables them).\n");
+    fprintf(stderr, "\t-M <frees> Mesh the page heap every <frees> span frees and\n\t           report the resident heap size (implies -P 1024).\n");
+    fprintf(stderr, "\t-n <runs>  Most timed replays per trace (default 10, 0 = no timing).\n");
+    fprintf(stderr, "\t-P <bytes> Serve requests up to <bytes> from page spans (max 1024).\n");
+    fprintf(stderr, "\t-p <policy> Placement policy: first (default), best, good\n\t           or adaptive.\n");
+    fprintf(stderr, "\t-r         Replay thread-tagged traces with one thread per tag.\n");
+    fprintf(stderr, "\t-s         Print allocator statistics after each trace.\n");
+    fprintf(stderr, "\t-S <bytes> Soft limit on the heap size; reclaim before growing past it.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <threads> Also replay each trace in <threads> threads at once.\n");
+    fprintf(stderr, "\t-U         Back the heap with transparent hugepages and compare\n\t           their coverage with and without the hugepage layer.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-W <threads> Alternate demand phases between <threads> threads and report\n\t           the heap growth that stealing between thread caches avoids.\n");
+    fprintf(stderr, "\t-N <nodes> Build linked lists and a search tree of <nodes> nodes each on a\n\t           fragmented heap, without and with mm_malloc_near, and time\n\t           their traversal.\n");
+    fprintf(stderr, "\t-R <file>  Append this run's results to the results store <file>.\n");
+    fprintf(stderr, "\t-Y <file>  Report the trends and change points in the results\n\t           store <file>, and exit.\n");
+    fprintf(stderr, "\t-G <tags>  Time each trace with its blocks spread over <tags> tags\n\t           by mm_malloc_tagged, and check the per-tag counts.\n");
+    fprintf(stderr, "\t-B <threads> Time bursts of small blocks in 1, 2, 4, ... <threads> threads\n\t           with the central store off, behind a mutex and lock-free.\n");
+    fprintf(stderr, "\t-x <scales> Chart util and throughput with the sizes scaled, e.g. 0.5,1,2.\n");
 }
@@ -3,35 +3,85 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* memfd_create, fallocate */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
 
 #include "memlib.h"
+#include "mmlock.h"
 #include "config.h"
 
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_peak_brk;   /* high water mark of mem_brk */
+static size_t mem_limit;     /* cap on the heap size, 0 for MAX_HEAP */
+static int mem_fd = -1;      /* memfd behind the heap, -1 if anonymous */
+static int mem_mapped;       /* the heap was mmap'ed, not malloc'ed */
+static int mem_huge;         /* back the heap with transparent hugepages */
+static int mem_remapped;     /* some page is not mapped onto its own */
+static mm_lock_t sbrk_lock = MM_LOCK_INITIALIZER("mem_sbrk"); /* guards mem_brk */
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-    	fprintf(stderr, "mem_init_vm: malloc error\n");
-    	exit(1);
+    char *p, *start;
+    size_t slack = HUGE_PAGE;
+
+    /*
+     * The heap starts on a hugepage boundary, so that its hugepage
+     * regions are those of the MMU. By default it is a memfd mapped
+     * shared, so that mem_remap can point one virtual page at the
+     * physical page of another. With mem_set_hugepages it is anonymous
+     * memory advised for transparent hugepages instead, which shared
+     * memory gets only if the system enables it for shmem. Failing
+     * both, the heap is plain malloc'ed memory and mem_remap fails.
+     */
+    mem_fd = mem_huge ? -1 : memfd_create("mm heap", MFD_CLOEXEC);
+    p = mmap(NULL, MAX_HEAP + slack, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+	start = (char *)(((uintptr_t)p + slack - 1) & ~(slack - 1));
+	if (start > p)
+	    munmap(p, start - p);
+	munmap(start + MAX_HEAP, p + slack - start);
+	if (mem_fd >= 0 && (ftruncate(mem_fd, MAX_HEAP) < 0 ||
+			    mmap(start, MAX_HEAP, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_FIXED, mem_fd, 0) ==
+			    MAP_FAILED)) {
+	    close(mem_fd);
+	    mem_fd = -1;
+	}
+	if (mem_huge)
+	    madvise(start, MAX_HEAP, MADV_HUGEPAGE);
+	mem_start_brk = start;
+	mem_mapped = 1;
+    } else {
+	if (mem_fd >= 0)
+	    close(mem_fd);
+	mem_fd = -1;
+	/* allocate the storage we will use to model the available VM */
+	if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+	    fprintf(stderr, "mem_init_vm: malloc error\n");
+	    exit(1);
+	}
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_peak_brk = mem_start_brk;
+    mm_lock_register(&sbrk_lock);
 }
 
 /* 
@@ -39,32 +89,128 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    if (mem_fd >= 0) {
+	close(mem_fd);
+	mem_fd = -1;
+    }
+    if (mem_mapped)
+	munmap(mem_start_brk, MAX_HEAP);
+    else
+	free(mem_start_brk);
+    mem_mapped = 0;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_set_hugepages - back the heap that the next mem_init creates with
+ *     transparent hugepages if on is set, at the cost of mem_remap
+ */
+void mem_set_hugepages(int on)
+{
+    mem_huge = on;
+}
+
+/*
+ * mem_set_limit - refuse to grow the heap past bytes, 0 for MAX_HEAP. A
+ *     heap already past the limit keeps its pages but cannot grow.
+ */
+void mem_set_limit(size_t bytes)
+{
+    mem_limit = bytes < MAX_HEAP ? bytes : 0;
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *     undoing any mem_remap so that every page is its own again
  */
 void mem_reset_brk()
 {
+    if (mem_remapped) {
+	if (mmap(mem_start_brk, MAX_HEAP, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, mem_fd, 0) == MAP_FAILED) {
+	    fprintf(stderr, "mem_reset_brk: mmap error\n");
+	    exit(1);
+	}
+	mem_remapped = 0;
+    }
     mem_brk = mem_start_brk;
+    mem_peak_brk = mem_start_brk;
+}
+
+/*
+ * mem_release - return the physical pages behind [lo, hi) to the system;
+ *     both ends must be page aligned
+ */
+static void mem_release(uintptr_t lo, uintptr_t hi)
+{
+    if (mem_fd >= 0)
+	fallocate(mem_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  (off_t)(lo - (uintptr_t)mem_start_brk), hi - lo);
+    else
+	madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * mem_discard - return the physical pages that lie wholly inside the
+ *     len bytes at addr to the system; they read as zeroes afterwards
+ */
+void mem_discard(void *addr, size_t len)
+{
+    uintptr_t page = mem_pagesize();
+    uintptr_t lo = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)addr + len) & ~(page - 1);
+
+    if (lo < hi)
+	mem_release(lo, hi);
+}
+
+/*
+ * mem_drop - return every physical page of the heap to the system, so
+ *     that mem_heaprss starts from zero. The contents are lost.
+ */
+void mem_drop()
+{
+    mem_release((uintptr_t)mem_start_brk, (uintptr_t)mem_max_addr);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, and the whole pages given back
+ *    are returned to the system. A hugepage backed heap gives back only
+ *    whole hugepages, so that the one holding the new brk is not split.
+ *    Running into a limit set with mem_set_limit fails quietly, as the
+ *    caller asked for it; running out of the whole heap is reported.
  */
 void *mem_sbrk(intptr_t incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk;
+    char *max_addr;
+    uintptr_t lo, hi, page;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    mm_lock(&sbrk_lock);
+    old_brk = mem_brk;
+    max_addr = mem_limit ? mem_start_brk + mem_limit : mem_max_addr;
+    if ((mem_brk + incr < mem_start_brk) || (mem_brk + incr > max_addr)) {
+	mm_unlock(&sbrk_lock);
 	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+	if (!mem_limit)
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (mem_brk > mem_peak_brk)
+	mem_peak_brk = mem_brk;
+    mm_unlock(&sbrk_lock);
+
+    if (incr < 0) {
+	page = mem_huge ? HUGE_PAGE : mem_pagesize();
+	lo = ((uintptr_t)mem_brk + page - 1) & ~(page - 1);
+	hi = ((uintptr_t)old_brk + page - 1) & ~(page - 1);
+	if (hi > (uintptr_t)mem_max_addr)
+	    hi = (uintptr_t)mem_max_addr;
+	if (lo < hi)
+	    mem_release(lo, hi);
+    }
     return (void *)old_brk;
 }
 
@@ -92,6 +238,110 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_heappeak() - returns the largest heap size since the last reset
+ */
+size_t mem_heappeak()
+{
+    return (size_t)(mem_peak_brk - mem_start_brk);
+}
+
+/*
+ * mem_smaps - sum the kB fields starting with one of the names, NULL
+ *     terminated, over the mappings of the heap in /proc/self/smaps, and
+ *     return the sum in bytes, or 0 if smaps cannot be read
+ */
+static size_t mem_smaps(const char **names)
+{
+    char line[256];
+    unsigned long lo, hi, kb;
+    size_t sum = 0;
+    int in = 0, i;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/smaps", "r")) == NULL)
+	return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+	    in = lo >= (uintptr_t)mem_start_brk &&
+		 hi <= (uintptr_t)mem_max_addr;
+	    continue;
+	}
+	for (i = 0; in && names[i] != NULL; i++) {
+	    if (!strncmp(line, names[i], strlen(names[i])) &&
+		sscanf(line + strlen(names[i]), "%lu", &kb) == 1)
+		sum += (size_t)kb * 1024;
+	}
+    }
+    fclose(fp);
+    return sum;
+}
+
+/*
+ * mem_heaprss() - returns the bytes of physical memory behind the heap:
+ *     the memfd's allocated blocks, or the heap's resident set if it is
+ *     anonymous
+ */
+size_t mem_heaprss()
+{
+    static const char *rss[] = {"Rss:", NULL};
+    struct stat st;
+
+    if (mem_fd < 0)
+	return mem_mapped ? mem_smaps(rss) : 0;
+    if (fstat(mem_fd, &st) < 0)
+	return 0;
+    return (size_t)st.st_blocks * 512;
+}
+
+/*
+ * mem_heaphuge() - returns the bytes of the heap that are mapped with
+ *     hugepages
+ */
+size_t mem_heaphuge()
+{
+    static const char *huge[] = {"AnonHugePages:", "ShmemPmdMapped:",
+				 "FilePmdMapped:", NULL};
+
+    return mem_mapped ? mem_smaps(huge) : 0;
+}
+
+/*
+ * mem_remap - map the len bytes of virtual pages at dst onto the physical
+ *     pages behind src, and release the physical pages dst had. Both must
+ *     be page aligned heap addresses and src must be mapped onto its own
+ *     pages. Returns -1 if the heap is not memfd backed.
+ */
+int mem_remap(void *dst, const void *src, size_t len)
+{
+    off_t off = (const char *)src - mem_start_brk;
+
+    if (mem_fd < 0)
+	return -1;
+    if (mmap(dst, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+	     mem_fd, off) == MAP_FAILED)
+	return -1;
+    mem_remapped = 1;
+    mem_release((uintptr_t)dst, (uintptr_t)dst + len);
+    return 0;
+}
+
+/*
+ * mem_unmap_alias - map the len bytes of virtual pages at addr back onto
+ *     their own physical pages, which read as zeroes after mem_remap
+ */
+int mem_unmap_alias(void *addr, size_t len)
+{
+    off_t off = (char *)addr - mem_start_brk;
+
+    if (mem_fd < 0)
+	return -1;
+    if (mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+	     mem_fd, off) == MAP_FAILED)
+	return -1;
+    return 0;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
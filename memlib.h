@@ -1,8 +1,20 @@
+/* Size of a transparent hugepage; the heap starts on a boundary of one */
+#define HUGE_PAGE ((size_t)1 << 21)
+
 void mem_init(void);               
+void mem_set_hugepages(int on);
+void mem_set_limit(size_t bytes);
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heappeak(void);
+size_t mem_heaprss(void);
+size_t mem_heaphuge(void);
+void mem_drop(void);
+void mem_discard(void *addr, size_t len);
+int mem_remap(void *dst, const void *src, size_t len);
+int mem_unmap_alias(void *addr, size_t len);
 size_t mem_pagesize(void);
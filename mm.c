@@ -14,13 +14,25 @@
  * as a pointer, i.e., sizeof(uintptr_t) == sizeof(void *).
  */
 
+#include <sys/mman.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 
 #include "memlib.h"
 #include "mm.h"
+#include "mmlock.h"
+#include "pagemap.h"
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
  * provide your team information in the following struct.
@@ -45,6 +57,65 @@ team_t team = {
 
 #define NUM_HEAPS	21
 
+#define CACHE_LINE	64	/* Cache line size (bytes) */
+#define CACHE_COLORS	1	/* Default number of chunk start colours */
+
+/* Thread cache parameters: */
+#define TCACHE_CLASSES	10	/* Classes below this are cached per thread */
+#define TCACHE_MIN_CAP	4	/* Initial and minimum blocks per class */
+#define TCACHE_MAX_CAP	256	/* Maximum blocks per class */
+#define TCACHE_GROW	2	/* Refills in a row that double the capacity */
+#define TCACHE_SHRINK	2	/* Flushes in a row that halve the capacity */
+#define TCACHE_IDLE	4096	/* Operations between idle class checks */
+#define TCACHE_BYTES	(1 << 16) /* Default cap on cached bytes */
+#define TCACHE_THREADS	64	/* Thread caches tracked for statistics */
+#define TCACHE_BATCH	16	/* Blocks moved through the store at once */
+#define STORE_DEPTH	64	/* Batches the store keeps per class */
+
+/* Coalescing */
+#define COALESCE_QUEUE	4096	/* Frees waiting to be merged */
+#define COALESCE_BUDGET	4	/* Default merges per operation */
+#define COALESCE_MISS	16	/* A fit miss merges this many budgets */
+
+/* Adaptive placement */
+#define ADAPT_START	1	/* Mode after mm_init, "good" */
+#define ADAPT_WINDOW	256	/* Central mallocs per sample */
+#define ADAPT_HOLD	3	/* Samples in a row needed to switch */
+#define ADAPT_TRIAL	4	/* Samples a tighter mode has to prove itself */
+#define ADAPT_LOG	32	/* Switches kept for mm_print_stats */
+#define ADAPT_MISS_HIGH	(1.0 / 16) /* Misses per malloc to tighten */
+#define ADAPT_MISS_LOW	(1.0 / 64) /* Misses per malloc to relax */
+#define ADAPT_FRAG_HIGH	0.50	/* Fragmentation that tightens at MISS_LOW */
+#define ADAPT_COST_HIGH	32.0	/* Blocks examined per malloc worth saving */
+
+/* Page heap */
+#define SPAN_PAGE	PAGEMAP_PAGE
+#define SPAN_ALIGN	(2 * WSIZE)	/* Object size granularity */
+#define SPAN_CLASSES	64	/* Object sizes up to SPAN_CLASSES * SPAN_ALIGN */
+#define SPAN_OBJECTS	16	/* Objects a span holds at least */
+#define SPAN_SLAB	(64 * 1024) /* Bytes of descriptors mapped at once */
+#define SPAN_BITS	(8 * (int)sizeof(unsigned long))
+#define SPAN_WORDS	((int)(SPAN_PAGE / SPAN_ALIGN) / SPAN_BITS) /* Bitmap */
+
+/* Meshing */
+#define MESH_ALIASES	3	/* Spans one physical span may stand in for */
+#define MESH_CANDIDATES	1024	/* Partial spans looked at per class */
+#define MESH_TRIES	64	/* Partners each candidate is tried against */
+
+/* Allocation near a hint */
+#define NEAR_RANGE	4096	/* Farthest a block may lie from the hint */
+#define NEAR_BLOCKS	64	/* Blocks walked each way from the hint */
+
+/* Hugepage-aware placement */
+#define HUGE_SHIFT	21	/* log2 of HUGE_PAGE */
+#define HUGE_REGIONS	64	/* Hugepages tracked, from the heap's start */
+#define HUGE_DEPTH	16	/* Blocks compared per request */
+
+/* Heap limits */
+#define PRESSURE_CALLBACKS 8	/* Callbacks mm_add_pressure_callback keeps */
+#define PRESSURE_STEP	8	/* Above the soft limit, reclaim again after
+				   growing by 1/PRESSURE_STEP of it */
+
 #define MAX(x, y)  ((x) > (y) ? (x) : (y))  
 
 /* Pack a size and allocated bit into a word. */
@@ -54,9 +125,24 @@ team_t team = {
 #define GET(p)       (*(uintptr_t *)(p))
 #define PUT(p, val)  (*(uintptr_t *)(p) = (val))
 
-/* Read the size and allocated fields from address p. */
-#define GET_SIZE(p)   (GET(p) & ~(WSIZE - 1))
+/*
+ * Read the size and allocated fields from address p.  Blocks are smaller
+ * than 4 GB, so the high half of a free block's header and footer is free
+ * to hold its position + 1 in the coalescing queue, or 0.
+ */
+#define QUEUE_SHIFT   32
+#define GET_SIZE(p)   (GET(p) & ((((uintptr_t)1 << QUEUE_SHIFT) - 1) & \
+			  ~(WSIZE - 1)))
 #define GET_ALLOC(p)  (GET(p) & 0x1)
+#define GET_QUEUED(p) (GET(p) >> QUEUE_SHIFT)
+
+/*
+ * An allocated block uses the same high half for the tag it was allocated
+ * with by mm_malloc_tagged, or 0.  The tag is cleared when the block is
+ * freed, before it can reach a thread cache or the free lists.
+ */
+#define GET_TAG(p)    ((int)(GET(p) >> QUEUE_SHIFT))
+#define PACK_TAG(size, tag) ((size) | 0x1 | (uintptr_t)(tag) << QUEUE_SHIFT)
 
 /* Given block ptr bp, compute address of its header and footer. */
 #define HDRP(bp)  ((char *)(bp) - WSIZE)
@@ -69,34 +155,488 @@ team_t team = {
 #define NEXT_PTR(bp) FTRP(bp) - WSIZE
 #define PREV_PTR(bp) FTRP(bp) - 2*WSIZE
 
+/*
+ * A free block's first payload word holds its slot in the size index of its
+ * class, or SLOT_NONE if the index was full when the block was inserted.
+ */
+#define SLOT(bp)   GET(bp)
+#define SLOT_NONE  ((uintptr_t)-1)
+
+/* Capacity of the size index of one class. */
+#define SIZE_INDEX_CAP	4096
+
+/*
+ * Struct-of-arrays index of the free blocks of one class.  The sizes are
+ * kept in a contiguous, vector aligned array so that the best candidate can
+ * be found with a handful of SIMD compares instead of chasing NEXT_PTR
+ * links through the heap.  Blocks inserted while the index is full are
+ * only on the linked list and are counted in "spilled".
+ */
+struct size_index {
+	uint32_t sizes[SIZE_INDEX_CAP] __attribute__((aligned(32)));
+	void *blocks[SIZE_INDEX_CAP];
+	int count;
+	int spilled;
+};
+
+/*
+ * One class of a thread cache.  Cached blocks stay marked as allocated, so
+ * they are invisible to the central lists, and are linked through their
+ * NEXT_PTR words.  The capacity adapts: it doubles after TCACHE_GROW
+ * refills from the central lists in a row and halves after TCACHE_SHRINK
+ * flushes in a row, or when the class sat idle for TCACHE_IDLE operations.
+ *
+ * Only the owner pushes and pops, but a thread whose heap is about to
+ * grow may steal every block of the bin at once, see tcache_steal.  The
+ * head word therefore packs the first block with the number of blocks
+ * above TC_SHIFT, and the owner updates it with compare-and-swap while a
+ * thief swaps in an empty list.  Pops cannot suffer ABA: the head only
+ * returns to an old value through a push, and the owner is the one
+ * pushing.
+ */
+#define TC_SHIFT	48
+#define TC_PTR(h)	((void *)((h) & (((uintptr_t)1 << TC_SHIFT) - 1)))
+#define TC_COUNT(h)	((int)((h) >> TC_SHIFT))
+#define TC_HEAD(bp, n)	((uintptr_t)(bp) | (uintptr_t)(n) << TC_SHIFT)
+
+struct tcache_bin {
+	uintptr_t head;		/* Cached blocks and their number */
+	int capacity;		/* Blocks kept before a flush */
+	int refills;		/* Refills since the last flush */
+	int flushes;		/* Flushes since the last refill */
+	bool used;		/* Touched since the last idle check */
+	size_t bytes;		/* Bytes of cached blocks, less "stolen" */
+	size_t stolen;		/* Bytes taken by other threads */
+	unsigned long hits;	/* Requests served from the cache */
+	unsigned long misses;	/* Requests sent to the central lists */
+	unsigned long overflows;/* Frees refused by the process-wide cap */
+	unsigned long grows;	/* Capacity doublings */
+	unsigned long shrinks;	/* Capacity halvings */
+};
+
+/*
+ * The central store sits between the thread caches and the central lists:
+ * per cached class, a stack of batches of TCACHE_BATCH blocks that a
+ * flushing cache pushes and a missing cache pops whole.  A batch is its
+ * blocks linked through NEXT_PTR like a bin, and batches are linked
+ * through the first payload word of their first block.  In the
+ * lock-free mode the stack is a Treiber stack: the head word packs the
+ * top batch with a tag in the bits above TC_SHIFT that every push and pop
+ * bumps, so that a pop whose top batch went away and came back fails its
+ * compare-and-swap.  The tag wraps after 65536 changes, far more than a
+ * pop can sleep through between reading the head and swapping it.  The
+ * mutex mode keeps the same stacks behind store_lock, for comparison.
+ * Blocks in the store stay marked allocated and count as cached bytes.
+ */
+struct tcache_store {
+	uintptr_t head;		/* Top batch and tag */
+	int depth;		/* Batches on the stack */
+	unsigned long pushes;	/* Batches pushed */
+	unsigned long pops;	/* Batches popped */
+	unsigned long full;	/* Pushes refused at STORE_DEPTH */
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ * A thread's cache, valid while "generation" matches heap_generation.  It
+ * also counts the tagged blocks the thread allocated less those it freed,
+ * so either may be negative; mm_get_tag_stats adds up every thread.
+ */
+struct tcache {
+	unsigned generation;
+	unsigned ops;		/* Operations, for the idle check */
+	int slot;		/* Index in tcaches, or -1 */
+	struct tcache_bin bins[TCACHE_CLASSES];
+	struct mm_tag_stats tags[MM_TAGS];
+};
+
+/* Statistics are updated by the owner and read by mm_print_stats. */
+#define STAT_INC(x)	__atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+#define STAT_READ(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STAT_ADD(x, n)	__atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
 /* Global variables: */
 static char *heap_listp; /* Pointer to first block */  
 static void *last_bp; /* Pointer to the last used block */
 
 static uintptr_t beginning_heap[NUM_HEAPS];
+static struct size_index size_index[NUM_HEAPS];
+static int fit_policy = MM_FIT_SEGREGATED_FIRST;
+static int fit_depth = 0; /* Candidates examined by good fit, 0 = all */
+static int cache_colors = CACHE_COLORS;
+static int next_color;    /* Colour of the next chunk carved into blocks */
 int heap_index;
 
+/*
+ * The central lists, the size index and the heap itself are shared and
+ * guarded by central_lock.  The registry of thread caches and the
+ * statistics of exited threads are guarded by tcache_lock.
+ */
+static mm_lock_t central_lock = MM_LOCK_INITIALIZER("central lists");
+static mm_lock_t tcache_lock = MM_LOCK_INITIALIZER("thread caches");
+
+static __thread struct tcache tcache;
+static struct tcache *tcaches[TCACHE_THREADS]; /* Live caches */
+static struct tcache_bin tcache_retired[TCACHE_CLASSES]; /* Exited threads */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static unsigned heap_generation = 1; /* Bumped by mm_init */
+static size_t tcache_limit = TCACHE_BYTES; /* 0 disables the caches */
+static size_t tcache_bytes;               /* Cached bytes, all threads */
+static bool tcache_stealing = true;       /* A growing heap robs caches */
+static int store_mode = MM_STORE_LOCKFREE;
+static struct tcache_store tcache_store[TCACHE_CLASSES];
+static mm_lock_t store_lock = MM_LOCK_INITIALIZER("central store");
+static struct mm_steal_stats steal_stats; /* Since the last mm_init */
+
+/*
+ * Tagged blocks of exited threads, guarded by tcache_lock, and of threads
+ * with no cache in tcaches, updated atomically.
+ */
+static struct mm_tag_stats tag_retired[MM_TAGS];
+static struct mm_tag_stats tag_shared[MM_TAGS];
+
+/*
+ * The phase profiler, compiled in with -DMM_PROFILE.  PROF_START takes a
+ * cycle counter reading when an operation begins and every PROF_MARK
+ * charges the cycles since the last reading to a phase and to the class
+ * set by PROF_CLASS.  Each thread counts in its own prof_thread, found
+ * through prof_threads until it exits and folded into prof_retired then;
+ * both are guarded by prof_lock.  Threads past PROF_THREADS count in
+ * prof_shared, whose updates may race.
+ */
+enum {
+	PHASE_CLASS,		/* Size adjustment and class computation */
+	PHASE_TCACHE,		/* Thread cache pushes, pops and refills */
+	PHASE_LOCK,		/* Taking and dropping the central lock */
+	PHASE_FIT,		/* The free list search */
+	PHASE_PLACE,		/* Splitting the chosen block */
+	PHASE_EXTEND,		/* extend_heap and mem_sbrk */
+	PHASE_COALESCE,		/* Freeing to the lists and merging */
+	PHASE_SPAN,		/* The page heap */
+	PHASE_COPY,		/* The copy of mm_realloc */
+	PHASES
+};
+
+#if defined(MM_PROFILE)
+#define PROF_THREADS	TCACHE_THREADS
+#define PROF_CALIBRATE	100000	/* Readings timed to price one reading */
+
+struct prof_thread {
+	uint64_t last;		/* The last reading */
+	int class;		/* Class of the current operation */
+	bool started;		/* No phase of it charged yet */
+	int slot;		/* Index in prof_threads, -1 if none yet */
+	unsigned long readings;
+	unsigned long ops[NUM_HEAPS];
+	uint64_t cycles[PHASES][NUM_HEAPS];
+};
+
+static __thread struct prof_thread prof_self = { .slot = -1 };
+static struct prof_thread *prof_threads[PROF_THREADS];
+static struct prof_thread prof_retired, prof_shared;
+static pthread_key_t prof_key;
+static pthread_once_t prof_once = PTHREAD_ONCE_INIT;
+static mm_lock_t prof_lock = MM_LOCK_INITIALIZER("profiler");
+
+static void prof_attach(struct prof_thread *pt);
+static void prof_exit(void *arg);
+static void prof_init(void);
+static void prof_add(struct prof_thread *sum, struct prof_thread *pt);
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the cycle counter, or nanoseconds where there is none.
+ */
+static inline uint64_t
+prof_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (__builtin_ia32_rdtsc());
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Charge the cycles since the last reading to "phase" and the class of
+ *   the current operation, and count the operation in its class if this
+ *   is its first phase.
+ */
+static inline void
+prof_mark(int phase)
+{
+	struct prof_thread *pt = &prof_self;
+	uint64_t now = prof_now();
+
+	if (pt->slot == -1)
+		prof_attach(pt);
+	if (pt->slot < 0)
+		pt = &prof_shared;
+	STAT_ADD(pt->cycles[phase][prof_self.class], now - prof_self.last);
+	STAT_INC(pt->readings);
+	if (prof_self.started) {
+		STAT_INC(pt->ops[prof_self.class]);
+		prof_self.started = false;
+	}
+	prof_self.last = now;
+}
+
+#define PROF_START()	(prof_self.last = prof_now(), prof_self.class = 0, \
+			    prof_self.started = true)
+#define PROF_CLASS(c)	(prof_self.class = (c) < NUM_HEAPS ? (c) : \
+			    NUM_HEAPS - 1)
+#define PROF_MARK(ph)	prof_mark(ph)
+#else
+#define PROF_START()	((void)0)
+#define PROF_CLASS(c)	((void)0)
+#define PROF_MARK(ph)	((void)0)
+#endif
+
+/*
+ * Heap limits, guarded by central_lock.  "pressure_mark" is the heap size
+ * below which reaching the soft limit again does not reclaim.
+ */
+static size_t soft_limit, hard_limit;	/* 0 = no limit */
+static size_t pressure_mark;
+static bool reclaiming;			/* Reclamation is in progress */
+static struct {
+	mm_pressure_fn fn;
+	void *arg;
+} pressure_callbacks[PRESSURE_CALLBACKS];
+static int npressure_callbacks;
+static struct mm_limit_stats limit_stats; /* Since the last mm_init */
+
+/*
+ * Coalescing, guarded by central_lock.  In MM_COALESCE_INCREMENTAL mode
+ * freed blocks go on the free lists at once and are also queued; every
+ * locked mm_malloc and mm_free merges up to coalesce_budget of them with
+ * their free neighbours.  A block taken off the free lists leaves the
+ * queue, so every queued block is free.
+ */
+static int coalesce_mode = MM_COALESCE_INCREMENTAL;
+static int coalesce_budget = COALESCE_BUDGET;
+static void *coalesce_queue[COALESCE_QUEUE];
+static int coalesce_len;
+static unsigned long coalesce_merged;	/* Since the last mm_init */
+static int coalesce_peak;		/* Longest queue since mm_init */
+
+/*
+ * Adaptive placement, guarded by central_lock.  Under MM_FIT_ADAPTIVE the
+ * placement follows one of the modes below, ordered from the cheapest to
+ * the tightest.  Every ADAPT_WINDOW central mallocs the controller
+ * samples the fragmentation of the free blocks, the blocks examined per
+ * fit and the fraction of fits that missed and grew the heap although
+ * the free blocks added up to the request.  Many misses, or some misses
+ * with high fragmentation, ask for the next tighter mode; few misses at a
+ * high search cost ask for the next cheaper one.  A mode is entered only
+ * after ADAPT_HOLD samples in a row ask for it, and the gap between the
+ * high and low miss thresholds keeps a workload near one of them from
+ * flapping.  Misses that a tighter fit
+ * cannot avoid, such as those of a growing live set, are kept from
+ * pinning the controller in the tightest mode by a trial, see
+ * adapt_sample.
+ */
+static const struct adapt_mode {
+	const char *name;
+	int policy;		/* MM_FIT_* constant */
+	int depth;		/* Good fit depth */
+	int eager;		/* Multiplier of the coalescing budget */
+} adapt_modes[] = {
+	{ "fast", MM_FIT_SEGREGATED_FIRST, 0, 1 },
+	{ "good", MM_FIT_SEGREGATED_GOOD, 16, 1 },
+	{ "pack", MM_FIT_SEGREGATED_GOOD, 64, 4 },
+};
+#define ADAPT_MODES	((int)(sizeof(adapt_modes) / sizeof(adapt_modes[0])))
+#define ADAPTING	(fit_policy == MM_FIT_ADAPTIVE)
+
+static int adapt_cur;			/* Index in adapt_modes */
+static int adapt_want, adapt_streak;	/* Pending switch */
+static unsigned long adapt_dwell;	/* Windows in the current mode */
+static double adapt_entry;		/* Miss rate that asked for it, or 0 */
+static unsigned long adapt_quiet;	/* No climbing before this window */
+static unsigned long adapt_backoff;	/* Next wait after a failed trial */
+static unsigned long adapt_mallocs, adapt_misses, adapt_probes; /* Window */
+static unsigned long adapt_windows;	/* Since the last mm_init */
+static unsigned long adapt_time[ADAPT_MODES]; /* Windows spent per mode */
+static unsigned long adapt_switches;
+static struct adapt_switch {
+	unsigned long window;
+	int from, to;
+	double frag, cost, miss;
+} adapt_log[ADAPT_LOG];			/* The last switches, a ring */
+static size_t free_bytes;		/* Bytes on the central lists */
+
+/*
+ * The page heap, guarded by central_lock.  Requests of up to span_max
+ * bytes are served from spans: runs of whole pages, each carved into
+ * objects of one size class with no per-object header.  A span is itself
+ * an allocated block of the boundary tag heap whose payload starts on a
+ * page boundary, so the heap walk and reclamation see it as one block.
+ * The page map sends each page of a span to its descriptor; mm_free and
+ * mm_realloc find an object's class there without reading the object.
+ * A class keeps its spans with free objects on "partial" and the others
+ * on "full"; a span that becomes empty goes back to the heap unless it
+ * is the last partial span of its class.
+ *
+ * Meshing folds a partial span into another of its class whose objects
+ * in use sit in different slots: the objects are copied to the same
+ * offsets of the other span and memlib maps the folded span's pages onto
+ * the other's physical pages, giving its own back to the system.  The
+ * folded pages stay allocated in the heap as an alias, so pointers into
+ * them still reach their objects, and the page map sends them to the
+ * surviving descriptor.  Writes racing with the copy fault on the
+ * read-only pages and wait for the pass in mesh_fault.  When the span
+ * empties, its aliases' blocks go on the "clean" list, still allocated
+ * and with no pages behind them, for span_new to reuse before carving;
+ * freeing them would touch their pages for the block's links.
+ */
+#define SPAN_PARTIAL	0	/* On the partial list of its class */
+#define SPAN_FULL	1	/* On the full list of its class */
+
+struct span {
+	char *start;		/* First page, also the block's address */
+	size_t npages;
+	int sizeclass;		/* Objects of (sizeclass + 1) * SPAN_ALIGN */
+	int state;		/* SPAN_PARTIAL or SPAN_FULL */
+	int inuse;		/* Objects handed out */
+	int capacity;		/* Objects the span holds */
+	int naliases;
+	char *alias[MESH_ALIASES]; /* Meshed spans sharing these pages */
+	unsigned long used[SPAN_WORDS]; /* Slots handed out */
+	struct span *prev, *next; /* On the list of the state */
+};
+
+static struct {
+	struct span *partial, *full;
+	unsigned long spans;	/* Spans carved since the last mm_init */
+} span_classes[SPAN_CLASSES];
+static size_t span_max;			/* 0 disables the page heap */
+static struct span *span_spare;		/* Unused descriptors */
+static struct span *span_clean;		/* Blocks of released aliases */
+static unsigned long mesh_period;	/* Span frees per pass, 0 for none */
+static unsigned long mesh_frees;	/* Span frees since the last pass */
+static struct mm_mesh_stats mesh_stats;
+static int mesh_busy;			/* A pass is copying objects */
+static char *mesh_lo, *mesh_hi;		/* Bounds of every meshed span */
+static unsigned long mesh_epoch;	/* Passes started, for mesh_fault */
+static __thread char *mesh_retry;	/* Fault this thread retried ... */
+static __thread unsigned long mesh_retry_epoch; /* ... after this pass */
+static bool mesh_handler;		/* mesh_fault is installed */
+static struct sigaction mesh_oldact;	/* SIGSEGV action before ours */
+
+/*
+ * The hugepage layer, guarded by central_lock.  The heap is cut into
+ * HUGE_PAGE regions aligned like the MMU's hugepages, and the free bytes
+ * of each are counted as blocks enter and leave the free lists, whether
+ * or not the layer is on.  While it is on, placing prefers free blocks
+ * in the fullest regions, so that allocations pack into few hugepages
+ * and the others drain.  Once a region lies wholly inside a free block,
+ * clear of the block's header, slot, links and footer, its pages are
+ * given back to memlib; the region is marked released until a block
+ * overlapping it is allocated again.
+ */
+static bool huge_aware;			/* On since the last mm_init */
+static bool huge_want;			/* Set by mm_set_hugepage */
+static uintptr_t huge_base;		/* Heap start rounded down */
+static size_t huge_free[HUGE_REGIONS];	/* Free bytes per region */
+static bool huge_released[HUGE_REGIONS]; /* Pages given back */
+static struct mm_huge_stats huge_stats;
+
+/* Allocation near a hint, guarded by central_lock. */
+static struct mm_near_stats near_stats;	/* Since the last mm_init */
+
 /* Function prototypes for internal helper routines: */
 static void *coalesce(void *bp);
+static void free_block(void *bp);
+static void *heap_malloc(size_t size);
+static void heap_free(void *bp);
+static void tag_account(int tag, size_t size, int sign);
+static void coalesce_enqueue(void *bp);
+static void coalesce_dequeue(void *bp);
+static void *merge_fit(size_t asize);
+static void coalesce_step(int n);
+static unsigned long coalesce_heap(void);
 static void *extend_heap(size_t words);
+static void *heap_sbrk(size_t size);
+static bool heap_pressure(size_t size);
+static void heap_reclaim(void);
 static void *init_heap(size_t words);
+static void adapt_sample(void);
+static bool span_serves(size_t size, size_t alignment);
+static void *span_malloc(size_t size);
+static void *span_take(struct span *sp);
+static void *span_near(size_t size, void *hint);
+static void *near_fit(char *hint, size_t asize);
+static void span_free(void *bp);
+static struct span *span_new(int c);
+static struct span *span_desc(void);
+static void span_release(struct span *sp);
+static void span_flush_clean(void);
+static void span_link(struct span **list, struct span *sp);
+static void span_unlink(struct span **list, struct span *sp);
+static void *span_carve(size_t npages);
+static void span_reset(void);
+static unsigned long mesh_pass(void);
+static unsigned long mesh_class(int c);
+static bool mesh_spans(struct span *dst, struct span *src);
+static void mesh_fault(int sig, siginfo_t *info, void *ctx);
+static void huge_account(void *bp, size_t size, bool add);
+static void huge_release(void *bp);
+static void huge_use(void *lo, size_t len);
+static size_t huge_used(size_t r);
+static size_t largest_free(void);
+static size_t color_pad(void);
+static int request_class(size_t asize);
+static struct tcache *tcache_get(void);
+static void tcache_init(void);
+static void tcache_exit(void *arg);
+static void *tcache_pop(int i, size_t asize);
+static bool tcache_push(void *bp, int i);
+static void tcache_refill(int i);
+static void tcache_flush(struct tcache_bin *bin, int keep, bool batch);
+static void *tcache_fetch(int i);
+static bool store_push(int i, void *batch);
+static void *store_pop(int i);
+static void store_drain(void);
+static int tcache_put(struct tcache_bin *bin, void *first, void *last,
+    int n);
+static size_t tcache_steal(int i);
+static void tcache_tick(struct tcache *tc);
 
 static void place(void *bp, size_t asize);
+static int free_class(size_t size);
+static void insert_free_block(void *bp);
+static void remove_free_block(void *bp);
+static int size_index_best(const struct size_index *idx, size_t asize);
 void *find_fit(size_t asize);
 void *first_fit(size_t asize);
 void *segregated_first_fit(size_t asize);
+void *segregated_best_fit(size_t asize);
+void *segregated_good_fit(size_t asize);
+void *segregated_huge_fit(size_t asize);
 void *explicit_first_fit(size_t asize);
 void *next_fit(size_t asize);
 void *best_fit(size_t asize);
 void *explicit_best_fit(size_t asize);
 
 /* Function prototypes for heap consistency checker routine	s: */
-static void checkblock(void *bp);
-static void checkheap(bool verbose);
+static int checkblock(void *bp);
+static int checkheap(bool verbose);
+static int checkspans(void);
+static int checkhuge(void);
+static void print_spans(void);
 static void printblock(void *bp); 
 
-void attatch_blocks(uintptr_t next_block_pred, uintptr_t next_block_succ);
-
 /* 
  * Requires:
  *   None.
@@ -109,8 +649,34 @@ int
 mm_init(void) 
 {
 
+	memset(&limit_stats, 0, sizeof(limit_stats));
+	memset(&steal_stats, 0, sizeof(steal_stats));
+	pressure_mark = 0;
+	coalesce_len = 0;
+	coalesce_merged = 0;
+	coalesce_peak = 0;
+	adapt_cur = ADAPT_START;
+	adapt_streak = adapt_dwell = 0;
+	adapt_entry = 0;
+	adapt_quiet = 0;
+	adapt_backoff = ADAPT_TRIAL;
+	adapt_mallocs = adapt_misses = adapt_probes = 0;
+	adapt_windows = adapt_switches = 0;
+	memset(adapt_time, 0, sizeof(adapt_time));
+	span_reset();
+	mesh_frees = 0;
+	__atomic_store_n(&mesh_lo, NULL, __ATOMIC_RELAXED);
+	__atomic_store_n(&mesh_hi, NULL, __ATOMIC_RELAXED);
+	memset(&mesh_stats, 0, sizeof(mesh_stats));
+	huge_aware = huge_want;
+	huge_base = (uintptr_t)mem_heap_lo() & ~(HUGE_PAGE - 1);
+	memset(huge_free, 0, sizeof(huge_free));
+	memset(huge_released, 0, sizeof(huge_released));
+	memset(&huge_stats, 0, sizeof(huge_stats));
+	memset(&near_stats, 0, sizeof(near_stats));
+
 	/* Create the initial empty heap. */
-	if ((heap_listp = mem_sbrk(5 * WSIZE)) == (void *)-1)
+	if ((heap_listp = heap_sbrk(5 * WSIZE)) == (void *)-1)
 		return (-1);
 	PUT(heap_listp, 0);                            /* Alignment padding */
 	PUT(heap_listp + (1 * WSIZE), PACK(WSIZE, 1)); /* Prologue header */
@@ -119,6 +685,21 @@ mm_init(void)
 	heap_listp += (2 * WSIZE);
 
 	last_bp = heap_listp;
+	next_color = 0;
+
+	mm_lock_register(&central_lock);
+	mm_lock_register(&tcache_lock);
+
+	/* Every thread cache refers to the old heap; invalidate them. */
+	heap_generation++;
+	__atomic_store_n(&tcache_bytes, 0, __ATOMIC_RELAXED);
+	mm_lock(&tcache_lock);
+	memset(tcache_retired, 0, sizeof(tcache_retired));
+	memset(tag_retired, 0, sizeof(tag_retired));
+	memset(tag_shared, 0, sizeof(tag_shared));
+	mm_unlock(&tcache_lock);
+	memset(tcache_store, 0, sizeof(tcache_store));
+	mm_lock_register(&store_lock);
 	
 	if (init_heap(CHUNKSIZE / WSIZE) == NULL)
 		return (-1);
@@ -141,49 +722,106 @@ void *
 mm_malloc(size_t size) 
 {
 	void *bp;
-	size_t asize;      /* Adjusted block size */
-	size_t extendsize; /* Amount to extend heap if no fit */
-	int i;
-	heap_index = -1;
-		
+
 	/* Ignore spurious requests. */
 	if (size == 0)
 		return (NULL);
 
+	/* Small requests are served from spans if the page heap is on. */
+	if (size <= span_max) {
+		PROF_START();
+		PROF_CLASS(request_class(size));
+		bp = span_malloc(size);
+		PROF_MARK(PHASE_SPAN);
+		return (bp);
+	}
+	return (heap_malloc(size));
+}
+
+/*
+ * Requires:
+ *   "size" is not zero.
+ *
+ * Effects:
+ *   Allocate a block with at least "size" bytes of payload from the
+ *   boundary tag heap.  Returns the address of this block if the
+ *   allocation was successful and NULL otherwise, as it is for a size
+ *   that with the block overhead would not fit in an sbrk increment.
+ */
+static void *
+heap_malloc(size_t size)
+{
+	void *bp;
+	size_t asize;      /* Adjusted block size */
+	size_t extendsize; /* Amount to extend heap if no fit */
+	int i;
+
 	/* Adjust block size to include overhead and alignment reqs. */
+	PROF_START();
+	if (size > (size_t)INTPTR_MAX - 3 * DSIZE)
+		return (NULL);
 	if (size <= WSIZE)
 		asize = 5 * WSIZE;
 	else {
 		asize = size + 2 * DSIZE;
 		asize = (WSIZE * ((asize + (WSIZE - 1)) / WSIZE));
 	}
-	extendsize = asize;
-	for (i = 0; i < NUM_HEAPS; i++) {
-		
-		if ((int)(5*WSIZE * (1 << i)) > (int)asize) {
-			heap_index = i;
-			extendsize = 5*WSIZE * (1 << i); //TODO: See if this is necessary??
-			break;
-		}
+
+	/* Any block of class i or above fits; try this thread's cache. */
+	i = request_class(asize);
+	PROF_CLASS(i);
+	PROF_MARK(PHASE_CLASS);
+	if (i < TCACHE_CLASSES && ((bp = tcache_pop(i, asize)) != NULL ||
+	    (bp = tcache_fetch(i)) != NULL)) {
+		PROF_MARK(PHASE_TCACHE);
+		return (bp);
 	}
-	if (heap_index == -1) {
+	PROF_MARK(PHASE_TCACHE);
+
+	mm_lock(&central_lock);
+	PROF_MARK(PHASE_LOCK);
+	if (i < NUM_HEAPS) {
+		heap_index = i;
+		extendsize = 5*WSIZE * (1 << i); //TODO: See if this is necessary??
+	} else {
 		printf("error \n");
+		heap_index = NUM_HEAPS - 1;
+		extendsize = asize;
+	}
+	/*
+	 * Search the free list for a fit, merging free blocks on a miss,
+	 * and if the heap would have to grow past a limit, reclaim memory
+	 * and search again.
+	 */
+	coalesce_step(coalesce_budget);
+	PROF_MARK(PHASE_COALESCE);
+	bp = merge_fit(asize);
+	if (bp == NULL && heap_pressure(extendsize))
+		bp = find_fit(asize);
+	if (bp == NULL && i < TCACHE_CLASSES && tcache_steal(i) > 0 &&
+	    (bp = find_fit(asize)) != NULL)
+		steal_stats.fits += extendsize;
+	if (ADAPTING) {
+		adapt_misses += bp == NULL && free_bytes >= asize;
+		if (++adapt_mallocs == ADAPT_WINDOW)
+			adapt_sample();
 	}
-	//if (beginning_heap[heap_index])
-	//	printf("a %p b %p c %p d %d\n", (void *)asize, (void *)GET_SIZE(HDRP(beginning_heap[heap_index])), (void *) extendsize, heap_index);
-	/* Search the free list for a fit. */
-	if ((bp = find_fit(asize)) != NULL) {
+	PROF_MARK(PHASE_FIT);
+	if (bp == NULL) {
+		/* No fit found.  Get more memory and place the block. */
+		bp = extend_heap(extendsize / WSIZE);
+		PROF_MARK(PHASE_EXTEND);
+	}
+	if (bp != NULL) {
 		place(bp, asize);
-		return bp;		
+		PROF_MARK(PHASE_PLACE);
 	}
-	
-//	printf("index %d size %p math %p\n", heap_index, (void *)(extendsize), (void *)(5*WSIZE * (1 << i)));
-
-	/* No fit found.  Get more memory and place the block. */
-	//extendsize = MAX(extendsize, CHUNKSIZE);
-	if ((bp = extend_heap(extendsize / WSIZE)) == NULL)  
-		return (NULL);
-	place(bp, asize);
+	if (bp != NULL && i < TCACHE_CLASSES) {
+		tcache_refill(i);
+		PROF_MARK(PHASE_TCACHE);
+	}
+	mm_unlock(&central_lock);
+	PROF_MARK(PHASE_LOCK);
 
 	return bp;
 } 
@@ -198,43 +836,214 @@ mm_malloc(size_t size)
 void
 mm_free(void *bp)
 {
-	
-	size_t size;
-	int i;
-	heap_index = -1;
+
 	/* Ignore spurious requests. */
 	if (bp == NULL)
 		return;
 
-	/* Free and coalesce the block. */
-	size = GET_SIZE(HDRP(bp));
-	PUT(HDRP(bp), PACK(size, 0));
-	PUT(FTRP(bp), PACK(size, 0));
+	/* Objects of spans are found through the page map, not a header. */
+	PROF_START();
+	if (pagemap_get(bp) != NULL) {
+		span_free(bp);
+		PROF_MARK(PHASE_SPAN);
+		return;
+	}
 
-	
-	for (i = 0; i < NUM_HEAPS; i++) {
-			
-		if ((int)(5*WSIZE * (1 << i)) > (int)size) {
-			heap_index = i - 1;
-			break;
-		}
+	heap_free(bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is either NULL or the address of a block returned by mm_malloc
+ *   or mm_memalign for a request of "size" bytes aligned to "alignment",
+ *   where mm_malloc counts as an alignment of WSIZE.
+ *
+ * Effects:
+ *   Free a block like mm_free, without looking "bp" up in the page map:
+ *   the request alone tells whether the page heap served it.
+ */
+void
+mm_free_sized(void *bp, size_t size, size_t alignment)
+{
+
+	if (bp == NULL)
+		return;
+	PROF_START();
+	if (span_serves(size, alignment))
+		span_free(bp);
+	else
+		heap_free(bp);
+}
+
+/*
+ * Requires:
+ *   "alignment" is a power of two.
+ *
+ * Effects:
+ *   Allocate a block with at least "size" bytes of payload that starts on
+ *   a multiple of "alignment", unless "size" is zero.  The page heap
+ *   serves it as an object of "size" rounded up to the alignment, see
+ *   span_serves.  Otherwise the boundary tag heap pads the block by enough
+ *   for an aligned payload to lie at least a minimum block past its
+ *   start, and the pieces before and after the payload are freed.
+ *   Returns the address of the block if the allocation was successful
+ *   and NULL otherwise, as it is for a size that the padding would wrap.
+ */
+void *
+mm_memalign(size_t alignment, size_t size)
+{
+	char *bp, *abp;
+	size_t asize, csize, lead;
+
+	if (size == 0 || (alignment & (alignment - 1)) != 0)
+		return (NULL);
+	if (alignment > SIZE_MAX - 4 * WSIZE ||
+	    size > SIZE_MAX - alignment - 4 * WSIZE)
+		return (NULL);
+	if (alignment <= WSIZE)
+		return (mm_malloc(size));
+	if (span_serves(size, alignment))
+		return (span_malloc((size + alignment - 1) & ~(alignment - 1)));
+
+	/* Pad past span_max, so that the boundary tag heap serves it. */
+	bp = mm_malloc(MAX(size + alignment + 4 * WSIZE, span_max + 1));
+	if (bp == NULL || ((uintptr_t)bp & (alignment - 1)) == 0)
+		abp = bp;
+	else {
+		abp = (char *)(((uintptr_t)bp + 5 * WSIZE + alignment - 1) &
+		    ~(alignment - 1));
+		lead = abp - bp;
+		/* Heap walks read the boundary tags under the lock. */
+		mm_lock(&central_lock);
+		csize = GET_SIZE(HDRP(bp));
+		PUT(HDRP(abp), PACK(csize - lead, 1));
+		PUT(FTRP(abp), PACK(csize - lead, 1));
+		PUT(HDRP(bp), PACK(lead, 1));
+		PUT(FTRP(bp), PACK(lead, 1));
+		mm_unlock(&central_lock);
+		heap_free(bp);
 	}
-	if (heap_index == -1) {
-		printf("error \n");
+	if (abp == NULL)
+		return (NULL);
+
+	/* Give back the tail if it can stand as a block of its own. */
+	asize = WSIZE * ((size + 2 * DSIZE + (WSIZE - 1)) / WSIZE);
+	csize = GET_SIZE(HDRP(abp));
+	if (csize - asize >= 5 * WSIZE) {
+		mm_lock(&central_lock);
+		PUT(HDRP(abp), PACK(asize, 1));
+		PUT(FTRP(abp), PACK(asize, 1));
+		bp = NEXT_BLKP(abp);
+		PUT(HDRP(bp), PACK(csize - asize, 1));
+		PUT(FTRP(bp), PACK(csize - asize, 1));
+		mm_unlock(&central_lock);
+		heap_free(bp);
 	}
-	
-	//bp = coalesce(bp);
+	return (abp);
+}
 
-	PUT(PREV_PTR(bp), 0);
-	PUT(NEXT_PTR(bp), beginning_heap[heap_index]);
-	
-	if (beginning_heap[heap_index]) {
-		PUT(PREV_PTR(beginning_heap[heap_index]), (uintptr_t) bp);
+/*
+ * Requires:
+ *   "hint" is either NULL or the address of an allocated block.
+ *
+ * Effects:
+ *   Allocate like mm_malloc, but prefer a block close to "hint", so that
+ *   linked structures can keep their nodes together.  A page heap request
+ *   takes a free object of the hint's own span if it is of the right
+ *   class.  Otherwise the heap is walked up to NEAR_BLOCKS blocks either
+ *   way from the hint's block and the closest free block that fits within
+ *   NEAR_RANGE bytes of the hint is taken.  Falls back to mm_malloc, which
+ *   also serves a NULL hint.
+ */
+void *
+mm_malloc_near(size_t size, void *hint)
+{
+	struct span *sp;
+	void *bp;
+	size_t asize;
+
+	if (size == 0 || hint == NULL)
+		return (mm_malloc(size));
+	if (size <= span_max)
+		return (span_near(size, hint));
+
+	if (size <= WSIZE)
+		asize = 5 * WSIZE;
+	else
+		asize = WSIZE * ((size + 2 * DSIZE + (WSIZE - 1)) / WSIZE);
+	mm_lock(&central_lock);
+	near_stats.requests++;
+	/* The heap walk starts from the block of a span object's span. */
+	if ((sp = pagemap_get(hint)) != NULL)
+		hint = sp->start;
+	if ((bp = near_fit(hint, asize)) != NULL) {
+		place(bp, asize);
+		near_stats.near++;
+	}
+	mm_unlock(&central_lock);
+	return (bp != NULL ? bp : mm_malloc(size));
+}
+
+/*
+ * Requires:
+ *   "tag" is between 0 and MM_TAGS - 1.
+ *
+ * Effects:
+ *   Allocate like mm_malloc and charge the block to "tag" until it is
+ *   freed.  The tag is kept in the high half of the block's header and
+ *   footer, so a tagged request is served from the boundary tag heap even
+ *   if the page heap is on.  Tag 0 is an untagged mm_malloc.
+ */
+void *
+mm_malloc_tagged(size_t size, int tag)
+{
+	void *bp;
+	size_t bsize;
+
+	if (tag == 0 || size == 0)
+		return (mm_malloc(size));
+	if ((bp = heap_malloc(size)) == NULL)
+		return (NULL);
+	bsize = GET_SIZE(HDRP(bp));
+	PUT(HDRP(bp), PACK_TAG(bsize, tag));
+	PUT(FTRP(bp), PACK_TAG(bsize, tag));
+	tag_account(tag, bsize, 1);
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "stats" has room for MM_TAGS entries.
+ *
+ * Effects:
+ *   Copy the bytes and blocks of every tag live now: the counts of every
+ *   thread cache, of exited threads and of threads with no cache, added
+ *   up.  Counts of threads still running may be a few operations stale.
+ */
+void
+mm_get_tag_stats(struct mm_tag_stats *stats)
+{
+	struct tcache *tc;
+	int t, i;
+
+	mm_lock(&tcache_lock);
+	memcpy(stats, tag_retired, sizeof(tag_retired));
+	for (i = 0; i < MM_TAGS; i++) {
+		stats[i].bytes += __atomic_load_n(&tag_shared[i].bytes,
+		    __ATOMIC_RELAXED);
+		stats[i].blocks += __atomic_load_n(&tag_shared[i].blocks,
+		    __ATOMIC_RELAXED);
 	}
-	if ((uintptr_t)bp == beginning_heap[heap_index]) {
-		printf("We've got a problem\n");
+	for (t = 0; t < TCACHE_THREADS; t++) {
+		if ((tc = tcaches[t]) == NULL ||
+		    tc->generation != heap_generation)
+			continue;
+		for (i = 0; i < MM_TAGS; i++) {
+			stats[i].bytes += STAT_READ(tc->tags[i].bytes);
+			stats[i].blocks += STAT_READ(tc->tags[i].blocks);
+		}
 	}
-	beginning_heap[heap_index] = (uintptr_t)bp;
+	mm_unlock(&tcache_lock);
 }
 
 /*
@@ -253,6 +1062,7 @@ mm_free(void *bp)
 void *
 mm_realloc(void *ptr, size_t size)
 {
+	struct span *sp;
 	size_t oldsize;
 	void *newptr;
 
@@ -266,17 +1076,27 @@ mm_realloc(void *ptr, size_t size)
 	if (ptr == NULL)
 		return (mm_malloc(size));
 
-	newptr = mm_malloc(size);
+	/* The new block keeps the old one's tag. */
+	if ((sp = pagemap_get(ptr)) == NULL && GET_TAG(HDRP(ptr)) != 0)
+		newptr = mm_malloc_tagged(size, GET_TAG(HDRP(ptr)));
+	else
+		newptr = mm_malloc(size);
 
 	/* If realloc() fails the original block is left untouched  */
 	if (newptr == NULL)
 		return (NULL);
 
 	/* Copy the old data. */
-	oldsize = GET_SIZE(HDRP(ptr));
+	if (sp != NULL)
+		oldsize = (sp->sizeclass + 1) * SPAN_ALIGN;
+	else
+		oldsize = GET_SIZE(HDRP(ptr));
 	if (size < oldsize)
 		oldsize = size;
+	PROF_START();
+	PROF_CLASS(request_class(oldsize));
 	memcpy(newptr, ptr, oldsize);
+	PROF_MARK(PHASE_COPY);
 
 	/* Free the old block. */
 	mm_free(ptr);
@@ -284,422 +1104,3170 @@ mm_realloc(void *ptr, size_t size)
 	return (newptr);
 }
 
-void 
-attatch_blocks(uintptr_t block_pred, uintptr_t block_succ) 
+/*
+ * Requires:
+ *   "policy" is one of the MM_FIT_* constants.
+ *
+ * Effects:
+ *   Select the placement policy used by subsequent calls to mm_malloc.
+ */
+void
+mm_set_fit_policy(int policy)
 {
-	if (block_succ && block_pred) {
-			PUT(PREV_PTR(block_succ), block_pred);
-			PUT(NEXT_PTR(block_pred), block_succ);
-		}
-		else if (block_succ && !block_pred) { // Means next block is beggining of list
-			PUT(PREV_PTR(block_succ), 0);
-			beginning_heap[heap_index] = block_succ;
-		}
-		else if (!block_succ && block_pred) {
-			PUT(NEXT_PTR(block_pred), 0);	
-		}
-		else {
-			beginning_heap[heap_index] = 0;
-		}
+
+	fit_policy = policy;
 }
+
 /*
- * The following routines are internal helper routines.
+ * Requires:
+ *   "depth" is not negative.
+ *
+ * Effects:
+ *   Set the number of candidates that the good fit policy examines in the
+ *   class of a request before it falls back to the next class.  A depth of
+ *   zero examines the whole class.
  */
+void
+mm_set_fit_depth(int depth)
+{
+
+	fit_depth = depth;
+}
 
 /*
  * Requires:
- *   "bp" is the address of a newly freed block.
- * 
+ *   "colors" is at least one.
  *
  * Effects:
- *   Perform boundary tag coalescing.  Returns the address of the coalesced
- *   block.
+ *   Set the number of cache colours that the start of each chunk carved
+ *   into equal blocks rotates through.  Colour c offsets the first block
+ *   of a chunk by c cache lines, so that the hot first lines of different
+ *   chunks do not all map to the same cache sets.  One colour disables
+ *   colouring.  Takes effect at the next mm_init.
  */
-static void *
-coalesce(void *bp) 
+void
+mm_set_cache_colors(int colors)
 {
 
-	uintptr_t next_block_succ = GET(NEXT_PTR(NEXT_BLKP(bp)));
-	uintptr_t next_block_pred = GET(PREV_PTR(NEXT_BLKP(bp)));
-		
-	uintptr_t prev_block_succ = GET(NEXT_PTR(PREV_BLKP(bp)));
-	uintptr_t prev_block_pred = GET(PREV_PTR(PREV_BLKP(bp)));
+	cache_colors = colors < 1 ? 1 : colors;
+}
 
-	size_t size = GET_SIZE(HDRP(bp));
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Cap the bytes held in all thread caches together.  Frees that would
+ *   exceed the cap go to the central lists.  A cap of zero disables the
+ *   thread caches.  Takes effect at the next mm_init.
+ */
+void
+mm_set_tcache_limit(size_t bytes)
+{
+
+	tcache_limit = bytes;
+}
+
+/*
+ * Requires:
+ *   "mode" is one of the MM_STORE_* constants and no other thread is in
+ *   the allocator.
+ *
+ * Effects:
+ *   Select how thread caches hand batches of blocks to each other.  The
+ *   batches in the store are freed to the central lists first.
+ */
+void
+mm_set_tcache_store(int mode)
+{
+
+	mm_lock(&central_lock);
+	store_drain();
+	store_mode = mode;
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Let a thread whose request would grow the heap first take the cached
+ *   blocks of the fitting classes from the thread cache holding the most
+ *   of them, if "on" is set.  On by default.
+ */
+void
+mm_set_tcache_steal(int on)
+{
+
+	tcache_stealing = on != 0;
+}
+
+/*
+ * Requires:
+ *   "stats" is not NULL.
+ *
+ * Effects:
+ *   Copy the stealing statistics gathered since the last mm_init into
+ *   "stats".
+ */
+void
+mm_get_steal_stats(struct mm_steal_stats *stats)
+{
+
+	mm_lock(&central_lock);
+	*stats = steal_stats;
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   No block is allocated.
+ *
+ * Effects:
+ *   Serve requests of up to "max" bytes from the page heap, rounded down
+ *   to the largest class it has.  A "max" of 0 turns the page heap off.
+ */
+void
+mm_set_page_heap(size_t max)
+{
+
+	span_max = max < SPAN_CLASSES * SPAN_ALIGN ? max :
+	    SPAN_CLASSES * SPAN_ALIGN;
+}
+
+/*
+ * Requires:
+ *   The heap is memfd backed, see mem_init.
+ *
+ * Effects:
+ *   Run a meshing pass of the page heap every "period" frees of span
+ *   objects, or never if "period" is 0.  Installs the fault handler that
+ *   holds back writes to spans being meshed, passing other faults on to
+ *   the previous SIGSEGV action.
+ */
+void
+mm_set_mesh(unsigned long period)
+{
+	struct sigaction act;
+
+	mm_lock(&central_lock);
+	if (period > 0 && !mesh_handler) {
+		memset(&act, 0, sizeof(act));
+		act.sa_sigaction = mesh_fault;
+		act.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&act.sa_mask);
+		sigaction(SIGSEGV, &act, &mesh_oldact);
+		mesh_handler = true;
+	}
+	mesh_period = period;
+	mesh_frees = 0;
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   mm_set_mesh has enabled meshing at least once.
+ *
+ * Effects:
+ *   Run a meshing pass now.  Returns the number of pages it gave back.
+ */
+unsigned long
+mm_mesh(void)
+{
+	unsigned long pages;
+
+	mm_lock(&central_lock);
+	pages = mesh_pass();
+	mm_unlock(&central_lock);
+	return (pages);
+}
+
+/*
+ * Requires:
+ *   "stats" is not NULL.
+ *
+ * Effects:
+ *   Copy the meshing statistics gathered since the last mm_init into
+ *   "stats".
+ */
+void
+mm_get_mesh_stats(struct mm_mesh_stats *stats)
+{
+
+	mm_lock(&central_lock);
+	*stats = mesh_stats;
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Turn the hugepage layer on or off from the next mm_init.  While it is
+ *   on, placement prefers the fullest hugepage regions and regions that
+ *   become wholly free are given back to memlib.
+ */
+void
+mm_set_hugepage(int on)
+{
+
+	huge_want = on != 0;
+}
+
+/*
+ * Requires:
+ *   "stats" is not NULL.
+ *
+ * Effects:
+ *   Copy the hugepage statistics gathered since the last mm_init into
+ *   "stats".
+ */
+void
+mm_get_huge_stats(struct mm_huge_stats *stats)
+{
+	size_t r, used;
+
+	mm_lock(&central_lock);
+	*stats = huge_stats;
+	stats->regions = stats->dense = 0;
+	for (r = 0; r < HUGE_REGIONS; r++) {
+		if (huge_base + (r << HUGE_SHIFT) > (uintptr_t)mem_heap_hi())
+			break;
+		used = huge_used(r);
+		stats->regions++;
+		stats->dense += used >= HUGE_PAGE / 8 * 7;
+	}
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   "stats" is not NULL.
+ *
+ * Effects:
+ *   Copy the statistics of mm_malloc_near since the last mm_init.
+ */
+void
+mm_get_near_stats(struct mm_near_stats *stats)
+{
+
+	mm_lock(&central_lock);
+	*stats = near_stats;
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   "mode" is one of the MM_COALESCE_* constants.
+ *
+ * Effects:
+ *   Select how free blocks are merged with their free neighbours.  "budget"
+ *   is the number of queued blocks that each mm_malloc and mm_free may
+ *   merge in MM_COALESCE_INCREMENTAL mode, 0 for the default.  Blocks
+ *   queued before a change of mode are still merged.
+ */
+void
+mm_set_coalesce(int mode, int budget)
+{
+
+	coalesce_mode = mode;
+	coalesce_budget = budget > 0 ? budget : COALESCE_BUDGET;
+}
+
+/*
+ * Requires:
+ *   "hard" is 0 or at least "soft".
+ *
+ * Effects:
+ *   Set the soft and hard limits on the heap size, in bytes, for
+ *   subsequent calls to mm_malloc.  0 disables a limit.
+ */
+void
+mm_set_heap_limits(size_t soft, size_t hard)
+{
+
+	mm_lock(&central_lock);
+	soft_limit = soft;
+	hard_limit = hard;
+	pressure_mark = 0;
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   "fn" does not hold a lock that its thread may take while calling
+ *   mm_malloc or mm_free.
+ *
+ * Effects:
+ *   Register "fn" to be called with "arg" when the heap reaches its soft
+ *   limit, before the allocator reclaims memory of its own.  The callback
+ *   may free blocks, and any blocks it allocates are not subject to the
+ *   soft limit.  Returns 0 if the callback was registered and -1 if there
+ *   is no room for it.
+ */
+int
+mm_add_pressure_callback(mm_pressure_fn fn, void *arg)
+{
+	int ret = -1;
+
+	mm_lock(&central_lock);
+	if (npressure_callbacks < PRESSURE_CALLBACKS) {
+		pressure_callbacks[npressure_callbacks].fn = fn;
+		pressure_callbacks[npressure_callbacks].arg = arg;
+		npressure_callbacks++;
+		ret = 0;
+	}
+	mm_unlock(&central_lock);
+	return (ret);
+}
+
+/*
+ * Requires:
+ *   "stats" is not NULL.
+ *
+ * Effects:
+ *   Copy the heap limit statistics gathered since the last mm_init into
+ *   "stats".
+ */
+void
+mm_get_limit_stats(struct mm_limit_stats *stats)
+{
+
+	mm_lock(&central_lock);
+	*stats = limit_stats;
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Print the thread cache statistics gathered since the last mm_init: per
+ *   class, the hit rate of mm_malloc, the capacity changes and the bytes
+ *   currently cached, summed over live and exited threads.  Then print
+ *   the coalescing counters, the traffic through the central store, the
+ *   steals between caches, the occupancy of each hugepage region if the
+ *   hugepage layer is on and, under MM_FIT_ADAPTIVE, the time spent in
+ *   each adaptive mode and the last switches between them.
+ */
+void
+mm_print_stats(void)
+{
+	struct tcache_bin sum[TCACHE_CLASSES], *bin;
+	struct mm_tag_stats tags[MM_TAGS];
+	unsigned long requests;
+	size_t total = 0;
+	int i, t, threads = 0;
+
+	mm_lock(&tcache_lock);
+	memcpy(sum, tcache_retired, sizeof(sum));
+	for (t = 0; t < TCACHE_THREADS; t++) {
+		if (tcaches[t] == NULL ||
+		    tcaches[t]->generation != heap_generation)
+			continue;
+		threads++;
+		for (i = 0; i < TCACHE_CLASSES; i++) {
+			bin = &tcaches[t]->bins[i];
+			sum[i].hits += STAT_READ(bin->hits);
+			sum[i].misses += STAT_READ(bin->misses);
+			sum[i].overflows += STAT_READ(bin->overflows);
+			sum[i].grows += STAT_READ(bin->grows);
+			sum[i].shrinks += STAT_READ(bin->shrinks);
+			sum[i].bytes += MAX(STAT_READ(bin->bytes),
+			    STAT_READ(bin->stolen)) - STAT_READ(bin->stolen);
+			sum[i].capacity += STAT_READ(bin->capacity);
+		}
+	}
+	mm_unlock(&tcache_lock);
+
+	printf("Thread caches: %d live, limit %zu bytes\n", threads,
+	    tcache_limit);
+	printf("%5s %8s %10s %10s %6s %9s %6s %7s %8s %9s\n", "class",
+	    "blocks", "hits", "misses", "hit%", "overflows", "grows",
+	    "shrinks", "capacity", "cached");
+	for (i = 0; i < TCACHE_CLASSES; i++) {
+		requests = sum[i].hits + sum[i].misses;
+		if (requests == 0 && sum[i].overflows == 0)
+			continue;
+		printf("%5d %8zu %10lu %10lu %5.1f%% %9lu %6lu %7lu %8d "
+		    "%9zu\n", i, (size_t)(5*WSIZE << i), sum[i].hits,
+		    sum[i].misses, requests ? 100.0 * sum[i].hits / requests :
+		    0.0, sum[i].overflows, sum[i].grows, sum[i].shrinks,
+		    sum[i].capacity, sum[i].bytes);
+		total += sum[i].bytes;
+	}
+	printf("%5s %8s %10s %10s %6s %9s %6s %7s %8s %9zu\n", "total", "",
+	    "", "", "", "", "", "", "", total);
+
+	mm_get_tag_stats(tags);
+	for (i = 1, t = 0; i < MM_TAGS; i++) {
+		if (tags[i].blocks == 0 && tags[i].bytes == 0)
+			continue;
+		printf("%s tag %d %ld/%ld", t++ == 0 ? "Tags (blocks/bytes):" :
+		    ",", i, tags[i].blocks, tags[i].bytes);
+	}
+	if (t > 0)
+		printf("\n");
+
+	mm_lock(&central_lock);
+	printf("Coalescing: mode %d, %lu blocks merged, queue %d (peak %d)\n",
+	    coalesce_mode, coalesce_merged, coalesce_len, coalesce_peak);
+	if (store_mode != MM_STORE_NONE) {
+		printf("Central store: %s,", store_mode == MM_STORE_MUTEX ?
+		    "mutex" : "lock-free");
+		for (i = 0; i < TCACHE_CLASSES; i++) {
+			if (tcache_store[i].pushes == 0)
+				continue;
+			printf(" class %d %lu/%lu/%lu", i,
+			    STAT_READ(tcache_store[i].pushes),
+			    STAT_READ(tcache_store[i].pops),
+			    STAT_READ(tcache_store[i].full));
+		}
+		printf(" (batches pushed/popped/refused)\n");
+	}
+	if (steal_stats.tries > 0)
+		printf("Stealing: %lu tries, %lu steals, %lu blocks, %zu bytes"
+		    " taken, %zu bytes of extensions skipped\n",
+		    steal_stats.tries, steal_stats.steals, steal_stats.blocks,
+		    steal_stats.bytes, steal_stats.fits);
+	if (near_stats.requests > 0)
+		printf("Near: %lu requests, %lu served within reach of the "
+		    "hint\n", near_stats.requests, near_stats.near);
+	if (span_max > 0)
+		print_spans();
+	if (mesh_stats.passes > 0)
+		printf("Meshing: %lu passes, %lu spans meshed, %lu pages "
+		    "released, %.1f us per pass (max %.1f)\n",
+		    mesh_stats.passes, mesh_stats.meshed, mesh_stats.pages,
+		    mesh_stats.nsecs / 1e3 / mesh_stats.passes,
+		    mesh_stats.max_nsecs / 1e3);
+	if (huge_aware) {
+		printf("Hugepages: %lu returned, %lu reused; KB used per "
+		    "region:", huge_stats.returned, huge_stats.reused);
+		for (i = 0; i < HUGE_REGIONS && huge_base +
+		    ((size_t)i << HUGE_SHIFT) <= (uintptr_t)mem_heap_hi(); i++)
+			printf(" %zu%s", huge_used(i) / 1024,
+			    huge_released[i] ? "r" : "");
+		printf("\n");
+	}
+	if (ADAPTING) {
+		printf("Adaptive placement: mode %s, %lu windows (",
+		    adapt_modes[adapt_cur].name, adapt_windows);
+		for (i = 0; i < ADAPT_MODES; i++)
+			printf("%s%s %lu", i > 0 ? ", " : "",
+			    adapt_modes[i].name, adapt_time[i]);
+		printf("), %lu switches\n", adapt_switches);
+		t = adapt_switches > ADAPT_LOG ? adapt_switches - ADAPT_LOG : 0;
+		for (; t < (int)adapt_switches; t++) {
+			struct adapt_switch *log = &adapt_log[t % ADAPT_LOG];
+
+			printf("  window %6lu: %s -> %s (frag %.2f, cost "
+			    "%.1f, miss %.3f)\n", log->window,
+			    adapt_modes[log->from].name,
+			    adapt_modes[log->to].name, log->frag, log->cost,
+			    log->miss);
+		}
+	}
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Clear the phase profile of every thread.  Operations under way may
+ *   still charge a phase begun before the reset.
+ */
+void
+mm_profile_reset(void)
+{
+#if defined(MM_PROFILE)
+	struct prof_thread *pt;
+	int t;
+
+	mm_lock(&prof_lock);
+	memset(prof_retired.ops, 0, sizeof(prof_retired.ops));
+	memset(prof_retired.cycles, 0, sizeof(prof_retired.cycles));
+	prof_retired.readings = 0;
+	memset(prof_shared.ops, 0, sizeof(prof_shared.ops));
+	memset(prof_shared.cycles, 0, sizeof(prof_shared.cycles));
+	prof_shared.readings = 0;
+	for (t = 0; t < PROF_THREADS; t++) {
+		if ((pt = prof_threads[t]) == NULL)
+			continue;
+		memset(pt->ops, 0, sizeof(pt->ops));
+		memset(pt->cycles, 0, sizeof(pt->cycles));
+		pt->readings = 0;
+	}
+	mm_unlock(&prof_lock);
+#endif
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Print the cycles of every phase, in total and per operation, and the
+ *   cycles per operation of every phase by size class.  The cost of the
+ *   counter readings is measured here and printed as the overhead of the
+ *   profile.  Says so if the profiler is not compiled in.
+ */
+void
+mm_profile_report(void)
+{
+#if defined(MM_PROFILE)
+	static const char *names[PHASES] = { "class", "tcache", "lock", "fit",
+	    "place", "extend", "coalesce", "span", "copy" };
+	struct prof_thread sum;
+	struct prof_thread cal;
+	uint64_t phase[PHASES], total = 0, t0, last, now;
+	unsigned long ops = 0;
+	double each;
+	int c, ph, t;
+
+	memset(&sum, 0, sizeof(sum));
+	mm_lock(&prof_lock);
+	prof_add(&sum, &prof_retired);
+	prof_add(&sum, &prof_shared);
+	for (t = 0; t < PROF_THREADS; t++)
+		if (prof_threads[t] != NULL)
+			prof_add(&sum, prof_threads[t]);
+	mm_unlock(&prof_lock);
+
+	for (ph = 0; ph < PHASES; ph++) {
+		phase[ph] = 0;
+		for (c = 0; c < NUM_HEAPS; c++)
+			phase[ph] += sum.cycles[ph][c];
+		total += phase[ph];
+	}
+	for (c = 0; c < NUM_HEAPS; c++)
+		ops += sum.ops[c];
+	if (ops == 0) {
+		printf("No operations profiled\n");
+		return;
+	}
+
+	printf("%-9s %14s %7s %10s\n", "phase", "cycles", "share",
+	    "cycles/op");
+	for (ph = 0; ph < PHASES; ph++)
+		printf("%-9s %14llu %6.1f%% %10.1f\n", names[ph],
+		    (unsigned long long)phase[ph], 100.0 * phase[ph] / total,
+		    (double)phase[ph] / ops);
+	printf("%-9s %14llu %7s %10.1f\n", "total",
+	    (unsigned long long)total, "", (double)total / ops);
+
+	printf("%5s %9s", "cls", "ops");
+	for (ph = 0; ph < PHASES; ph++)
+		printf(" %7.7s", names[ph]);
+	printf("\n");
+	for (c = 0; c < NUM_HEAPS; c++) {
+		if (sum.ops[c] == 0)
+			continue;
+		printf("%5d %9lu", c, sum.ops[c]);
+		for (ph = 0; ph < PHASES; ph++)
+			printf(" %7.1f", (double)sum.cycles[ph][c] / sum.ops[c]);
+		printf("\n");
+	}
+
+	/* Price a reading as prof_mark takes it, counter and charge. */
+	memset(&cal, 0, sizeof(cal));
+	t0 = last = prof_now();
+	for (t = 0; t < PROF_CALIBRATE; t++) {
+		now = prof_now();
+		STAT_ADD(cal.cycles[t % PHASES][0], now - last);
+		STAT_INC(cal.readings);
+		last = now;
+	}
+	each = (double)(last - t0) / PROF_CALIBRATE;
+	printf("Profiler overhead: %lu readings at about %.1f cycles each, "
+	    "%.1f%% of the profiled cycles\n", sum.readings, each,
+	    100.0 * sum.readings * each / total);
+#else
+	printf("The phase profiler is not compiled in (build with "
+	    "-DMM_PROFILE).\n");
+#endif
+}
+
+#if defined(MM_PROFILE)
+/*
+ * Requires:
+ *   "pt" is this thread's profile, not yet attached.
+ *
+ * Effects:
+ *   Register "pt" in prof_threads, or mark it as counting in prof_shared
+ *   if there is no room, and arrange for prof_exit to run at thread exit.
+ */
+static void
+prof_attach(struct prof_thread *pt)
+{
+	int t;
+
+	pthread_once(&prof_once, prof_init);
+	mm_lock(&prof_lock);
+	pt->slot = -2;
+	for (t = 0; t < PROF_THREADS; t++) {
+		if (prof_threads[t] == NULL) {
+			prof_threads[t] = pt;
+			pt->slot = t;
+			break;
+		}
+	}
+	mm_unlock(&prof_lock);
+	pthread_setspecific(prof_key, pt);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Create the key whose destructor folds a thread's profile at exit.
+ */
+static void
+prof_init(void)
+{
+
+	pthread_key_create(&prof_key, prof_exit);
+}
+
+/*
+ * Requires:
+ *   "arg" is the profile of an exiting thread.
+ *
+ * Effects:
+ *   Fold the profile into that of the exited threads and unregister it.
+ */
+static void
+prof_exit(void *arg)
+{
+	struct prof_thread *pt = arg;
+
+	mm_lock(&prof_lock);
+	if (pt->slot >= 0) {
+		prof_add(&prof_retired, pt);
+		prof_threads[pt->slot] = NULL;
+	}
+	mm_unlock(&prof_lock);
+}
+
+/*
+ * Requires:
+ *   prof_lock is held.
+ *
+ * Effects:
+ *   Add the counts of "pt" to those of "sum".
+ */
+static void
+prof_add(struct prof_thread *sum, struct prof_thread *pt)
+{
+	int c, ph;
+
+	sum->readings += STAT_READ(pt->readings);
+	for (c = 0; c < NUM_HEAPS; c++) {
+		sum->ops[c] += STAT_READ(pt->ops[c]);
+		for (ph = 0; ph < PHASES; ph++)
+			sum->cycles[ph][c] += STAT_READ(pt->cycles[ph][c]);
+	}
+}
+#endif
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Check the consistency of the free lists and the size index.  Returns
+ *   the number of problems found, each of which is also printed.  Blocks
+ *   held in thread caches are allocated as far as the check is concerned.
+ */
+int
+mm_checkheap(int verbose)
+{
+	int errors;
+
+	mm_lock(&central_lock);
+	errors = checkheap(verbose != 0);
+	mm_unlock(&central_lock);
+	return (errors);
+}
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   "bp" is the address of a newly freed block.
+ * 
+ *
+ * Effects:
+ *   Perform boundary tag coalescing.  Returns the address of the coalesced
+ *   block.
+ */
+static void *
+coalesce(void *bp) 
+{
+	size_t size = GET_SIZE(HDRP(bp));
+
+	bool prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+	bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+
+	if ((PREV_BLKP(bp)) == bp) { // Happens if we're on the first ellement, we don't want to allocate before our heap space.
+		prev_alloc = 1;
+	}
+	
+	if (prev_alloc && next_alloc) {                 /* Case 1 */
+		return (bp);
+	} else if (prev_alloc && !next_alloc) {         /* Case 2 */
+		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+		if (last_bp == NEXT_BLKP(bp)) {
+			last_bp = bp;
+		}
+		remove_free_block(NEXT_BLKP(bp));
+		PUT(HDRP(bp), PACK(size, 0));
+		PUT(FTRP(bp), PACK(size, 0));
+	} else if (!prev_alloc && next_alloc) {         /* Case 3 */
+		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+		if (bp == last_bp) {
+			last_bp = PREV_BLKP(bp);
+		}
+		remove_free_block(PREV_BLKP(bp));
+		bp = PREV_BLKP(bp);
+		PUT(HDRP(bp), PACK(size, 0));
+		PUT(FTRP(bp), PACK(size, 0));
+	} else {                                        /* Case 4 */
+		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
+		    GET_SIZE(FTRP(NEXT_BLKP(bp)));
+		if (bp == last_bp || last_bp == NEXT_BLKP(bp)) {
+			last_bp = PREV_BLKP(bp);
+		}
+		remove_free_block(NEXT_BLKP(bp));
+		remove_free_block(PREV_BLKP(bp));
+		bp = PREV_BLKP(bp);
+		PUT(HDRP(bp), PACK(size, 0));
+		PUT(FTRP(bp), PACK(size, 0));
+	}
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is an allocated block of the boundary tag heap.
+ *
+ * Effects:
+ *   Drop the block's tag, if any, from its count.  Free the block to this
+ *   thread's cache if it is small and the cache has room, and to the list
+ *   of its class otherwise.
+ */
+static void
+heap_free(void *bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	int i = free_class(size), tag = GET_TAG(HDRP(bp));
+
+	if (tag != 0) {
+		tag_account(tag, size, -1);
+		PUT(HDRP(bp), PACK(size, 1));
+		PUT(FTRP(bp), PACK(size, 1));
+	}
+	PROF_CLASS(i);
+	PROF_MARK(PHASE_CLASS);
+	if (i < TCACHE_CLASSES && tcache_push(bp, i)) {
+		PROF_MARK(PHASE_TCACHE);
+		return;
+	}
+	PROF_MARK(PHASE_TCACHE);
+	mm_lock(&central_lock);
+	PROF_MARK(PHASE_LOCK);
+	coalesce_step(coalesce_budget);
+	free_block(bp);
+	PROF_MARK(PHASE_COALESCE);
+	mm_unlock(&central_lock);
+	PROF_MARK(PHASE_LOCK);
+}
+
+/*
+ * Requires:
+ *   "tag" is between 1 and MM_TAGS - 1.
+ *
+ * Effects:
+ *   Add "sign" blocks of "size" bytes to the count of "tag" in this
+ *   thread's cache, or in the shared counts if the thread has no cache
+ *   that mm_get_tag_stats can find.
+ */
+static void
+tag_account(int tag, size_t size, int sign)
+{
+	struct tcache *tc = tcache_get();
+	struct mm_tag_stats *ts;
+
+	if (tc != NULL && tc->slot >= 0) {
+		ts = &tc->tags[tag];
+		__atomic_store_n(&ts->bytes, ts->bytes + sign * (long)size,
+		    __ATOMIC_RELAXED);
+		__atomic_store_n(&ts->blocks, ts->blocks + sign,
+		    __ATOMIC_RELAXED);
+	} else {
+		ts = &tag_shared[tag];
+		__atomic_fetch_add(&ts->bytes, sign * (long)size,
+		    __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ts->blocks, sign, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Requires:
+ *   The central lock is held and "hint" is an allocated block of the heap.
+ *
+ * Effects:
+ *   Walk up to NEAR_BLOCKS blocks after and before "hint", no farther
+ *   than NEAR_RANGE bytes, and return the closest free block of at least
+ *   "asize" bytes, or NULL.  Blocks in thread caches are marked allocated
+ *   and are passed over.
+ */
+static void *
+near_fit(char *hint, size_t asize)
+{
+	char *bp, *after = NULL;
+	int n;
+
+	for (bp = hint, n = 0; n < NEAR_BLOCKS; n++) {
+		bp = NEXT_BLKP(bp);
+		if (GET_SIZE(HDRP(bp)) == 0 || bp - hint > NEAR_RANGE)
+			break;
+		if (!GET_ALLOC(HDRP(bp)) && GET_SIZE(HDRP(bp)) >= asize) {
+			after = bp;
+			break;
+		}
+	}
+	for (bp = hint, n = 0; n < NEAR_BLOCKS && bp > heap_listp; n++) {
+		bp = PREV_BLKP(bp);
+		if (hint - bp > NEAR_RANGE ||
+		    (after != NULL && hint - bp > after - hint))
+			break;
+		if (!GET_ALLOC(HDRP(bp)) && GET_SIZE(HDRP(bp)) >= asize)
+			return (bp);
+	}
+	return (after);
+}
+
+/*
+ * Requires:
+ *   The central lock is held and "bp" is an allocated block that is not in
+ *   a thread cache.
+ *
+ * Effects:
+ *   Free the block and put it on the list of its class, merging it with
+ *   its free neighbours first or queueing it for merging, as the
+ *   coalescing mode says.
+ */
+static void
+free_block(void *bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+
+	PUT(HDRP(bp), PACK(size, 0));
+	PUT(FTRP(bp), PACK(size, 0));
+	if (coalesce_mode == MM_COALESCE_IMMEDIATE ||
+	    (coalesce_mode == MM_COALESCE_INCREMENTAL &&
+	    coalesce_len == COALESCE_QUEUE))
+		bp = coalesce(bp);
+	insert_free_block(bp);
+	if (coalesce_mode == MM_COALESCE_INCREMENTAL &&
+	    coalesce_len < COALESCE_QUEUE)
+		coalesce_enqueue(bp);
+}
+
+/*
+ * Requires:
+ *   The central lock is held and "bp" is a free block that is not queued.
+ *
+ * Effects:
+ *   Append "bp" to the coalescing queue and record its position in its
+ *   header and footer.
+ */
+static void
+coalesce_enqueue(void *bp)
+{
+	uintptr_t word;
+
+	coalesce_queue[coalesce_len++] = bp;
+	word = GET(HDRP(bp)) | ((uintptr_t)coalesce_len << QUEUE_SHIFT);
+	PUT(HDRP(bp), word);
+	PUT(FTRP(bp), word);
+	if (coalesce_len > coalesce_peak)
+		coalesce_peak = coalesce_len;
+}
+
+/*
+ * Requires:
+ *   The central lock is held and "bp" is a queued block.
+ *
+ * Effects:
+ *   Drop "bp" from the coalescing queue.  The last block of the queue is
+ *   moved into the vacated position.
+ */
+static void
+coalesce_dequeue(void *bp)
+{
+	uintptr_t pos = GET_QUEUED(HDRP(bp)) - 1;
+	uintptr_t word = GET(HDRP(bp)) & (((uintptr_t)1 << QUEUE_SHIFT) - 1);
+	void *last;
+
+	PUT(HDRP(bp), word);
+	PUT(FTRP(bp), word);
+	if (pos != (uintptr_t)--coalesce_len) {
+		last = coalesce_queue[coalesce_len];
+		coalesce_queue[pos] = last;
+		word = (GET(HDRP(last)) & (((uintptr_t)1 << QUEUE_SHIFT) - 1)) |
+		    ((pos + 1) << QUEUE_SHIFT);
+		PUT(HDRP(last), word);
+		PUT(FTRP(last), word);
+	}
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Search the free lists for a fit and, on a miss, merge free blocks as
+ *   the coalescing mode allows and search again.  Returns the block or
+ *   NULL.
+ */
+static void *
+merge_fit(size_t asize)
+{
+	void *bp;
+
+	if ((bp = find_fit(asize)) != NULL)
+		return (bp);
+	PROF_MARK(PHASE_FIT);
+	if (coalesce_mode == MM_COALESCE_INCREMENTAL && coalesce_len > 0) {
+		coalesce_step(coalesce_budget * COALESCE_MISS);
+		PROF_MARK(PHASE_COALESCE);
+		bp = find_fit(asize);
+	} else if (coalesce_mode == MM_COALESCE_DEFERRED &&
+	    coalesce_heap() > 0) {
+		PROF_MARK(PHASE_COALESCE);
+		bp = find_fit(asize);
+	}
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Merge up to "n" queued blocks with their free neighbours, newest
+ *   first, or a multiple of "n" that the adaptive mode sets.  Does nothing
+ *   unless the mode is MM_COALESCE_INCREMENTAL.
+ */
+static void
+coalesce_step(int n)
+{
+	void *bp;
+	size_t size;
+
+	if (ADAPTING)
+		n *= adapt_modes[adapt_cur].eager;
+	while (n-- > 0 && coalesce_len > 0) {
+		bp = coalesce_queue[coalesce_len - 1];
+		size = GET_SIZE(HDRP(bp));
+		remove_free_block(bp);
+		bp = coalesce(bp);
+		if (GET_SIZE(HDRP(bp)) != size)
+			coalesce_merged++;
+		insert_free_block(bp);
+	}
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Merge every run of adjacent free blocks into one block in a single
+ *   pass over the heap, emptying the coalescing queue on the way.  Blocks
+ *   held in thread caches are allocated and stay where they are.  Returns
+ *   the number of blocks merged away.
+ */
+static unsigned long
+coalesce_heap(void)
+{
+	char *bp, *next;
+	size_t size;
+	unsigned long merged = 0;
+
+	for (bp = heap_listp + 3 * WSIZE; GET_SIZE(HDRP(bp)) > 0;
+	    bp = NEXT_BLKP(bp)) {
+		if (GET_ALLOC(HDRP(bp)) || GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
+			if (!GET_ALLOC(HDRP(bp)) && GET_QUEUED(HDRP(bp)))
+				coalesce_dequeue(bp);
+			continue;
+		}
+		remove_free_block(bp);
+		size = GET_SIZE(HDRP(bp));
+		while (next = bp + size, !GET_ALLOC(HDRP(next))) {
+			remove_free_block(next);
+			size += GET_SIZE(HDRP(next));
+			merged++;
+		}
+		PUT(HDRP(bp), PACK(size, 0));
+		PUT(FTRP(bp), PACK(size, 0));
+		insert_free_block(bp);
+	}
+	coalesce_merged += merged;
+	last_bp = heap_listp;
+	return (merged);
+}
+
+/*
+ * Requires:
+ *   The central lock is held and a window of ADAPT_WINDOW mallocs has
+ *   ended.
+ *
+ * Effects:
+ *   Sample the window, start the next one and switch the adaptive mode if
+ *   ADAPT_HOLD samples in a row asked for the same neighbouring mode, or
+ *   if a tighter mode failed its trial.  Each switch is recorded in the
+ *   log that mm_print_stats prints.
+ */
+static void
+adapt_sample(void)
+{
+	struct adapt_switch *log;
+	double frag, cost, miss;
+	int want = adapt_cur;
+
+	frag = free_bytes > 0 ?
+	    1.0 - (double)largest_free() / free_bytes : 0.0;
+	cost = (double)adapt_probes / adapt_mallocs;
+	miss = (double)adapt_misses / adapt_mallocs;
+	adapt_mallocs = adapt_misses = adapt_probes = 0;
+	adapt_windows++;
+	adapt_time[adapt_cur]++;
+
+	adapt_dwell++;
+
+	/*
+	 * A tighter mode that has not at least halved the miss rate it was
+	 * entered at by the end of its trial is given up at once, and the
+	 * next climb waits twice as long as the last one.
+	 */
+	if (adapt_entry > 0 && adapt_dwell == ADAPT_TRIAL &&
+	    miss > ADAPT_MISS_LOW && miss > adapt_entry / 2) {
+		want = adapt_cur - 1;
+		adapt_quiet = adapt_windows + adapt_backoff;
+		adapt_backoff *= 2;
+	} else {
+		if ((miss > ADAPT_MISS_HIGH || (frag > ADAPT_FRAG_HIGH &&
+		    miss > ADAPT_MISS_LOW)) && adapt_windows >= adapt_quiet) {
+			if (adapt_cur < ADAPT_MODES - 1)
+				want = adapt_cur + 1;
+		} else if (miss < ADAPT_MISS_LOW && cost > ADAPT_COST_HIGH) {
+			if (adapt_cur > 0)
+				want = adapt_cur - 1;
+		}
+		if (want == adapt_cur || want != adapt_want) {
+			adapt_want = want;
+			adapt_streak = want != adapt_cur;
+			return;
+		}
+		if (++adapt_streak < ADAPT_HOLD)
+			return;
+	}
+
+	log = &adapt_log[adapt_switches++ % ADAPT_LOG];
+	log->window = adapt_windows;
+	log->from = adapt_cur;
+	log->to = want;
+	log->frag = frag;
+	log->cost = cost;
+	log->miss = miss;
+	adapt_entry = want > adapt_cur ? miss : 0;
+	adapt_cur = want;
+	adapt_streak = 0;
+	adapt_dwell = 0;
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Returns the size of the largest block on the central lists.  Only the
+ *   highest non-empty class has to be searched.
+ */
+static size_t
+largest_free(void)
+{
+	void *bp;
+	size_t size, max = 0;
+	int i;
+
+	for (i = NUM_HEAPS - 1; i >= 0 && !beginning_heap[i]; i--)
+		;
+	if (i < 0)
+		return (0);
+	for (bp = (void *)beginning_heap[i]; bp;
+	    bp = (void *)GET(NEXT_PTR(bp))) {
+		if ((size = GET_SIZE(HDRP(bp))) > max)
+			max = size;
+	}
+	return (max);
+}
+
+/*
+ * Requires:
+ *   "alignment" is a power of two.
+ *
+ * Effects:
+ *   Returns whether the page heap serves a request of "size" bytes
+ *   aligned to "alignment", where mm_malloc asks for WSIZE.  Spans start
+ *   on a page, so objects whose size is a multiple of an alignment of up
+ *   to a page are aligned to it.
+ */
+static bool
+span_serves(size_t size, size_t alignment)
+{
+
+	if (alignment <= WSIZE || size > span_max)
+		return (size <= span_max);
+	return (alignment <= SPAN_PAGE &&
+	    ((size + alignment - 1) & ~(alignment - 1)) <= span_max);
+}
+
+/*
+ * Requires:
+ *   "size" is at least 1 and at most span_max.
+ *
+ * Effects:
+ *   Allocate an object of the page heap class that "size" falls into,
+ *   carving a new span if the class has no free object.  Returns the
+ *   object's address, or NULL if no span could be carved.
+ */
+static void *
+span_malloc(size_t size)
+{
+	struct span *sp;
+	void *bp;
+	int c = (int)((size + SPAN_ALIGN - 1) / SPAN_ALIGN) - 1;
+
+	mm_lock(&central_lock);
+	if ((sp = span_classes[c].partial) == NULL &&
+	    (sp = span_new(c)) == NULL) {
+		mm_unlock(&central_lock);
+		return (NULL);
+	}
+	bp = span_take(sp);
+	mm_unlock(&central_lock);
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   The central lock is held and "sp" is a partial span.
+ *
+ * Effects:
+ *   Hand out the span's lowest free object, moving the span to the full
+ *   list of its class if that was its last.  Returns the object.
+ */
+static void *
+span_take(struct span *sp)
+{
+	int w, slot, c = sp->sizeclass;
+
+	/* The lowest clear bit is below capacity, as the span is partial. */
+	for (w = 0; sp->used[w] == ~0UL; w++)
+		;
+	slot = w * SPAN_BITS + __builtin_ctzl(~sp->used[w]);
+	sp->used[w] |= 1UL << (slot % SPAN_BITS);
+	if (++sp->inuse == sp->capacity) {
+		span_unlink(&span_classes[c].partial, sp);
+		span_link(&span_classes[c].full, sp);
+		sp->state = SPAN_FULL;
+	}
+	return (sp->start + (size_t)slot * (c + 1) * SPAN_ALIGN);
+}
+
+/*
+ * Requires:
+ *   "size" is at least 1 and at most span_max.
+ *
+ * Effects:
+ *   Allocate an object for "size" from the span holding "hint" if it is
+ *   of the same class and has a free object, and like span_malloc
+ *   otherwise.
+ */
+static void *
+span_near(size_t size, void *hint)
+{
+	struct span *sp;
+	void *bp = NULL;
+	int c = (int)((size + SPAN_ALIGN - 1) / SPAN_ALIGN) - 1;
+
+	mm_lock(&central_lock);
+	near_stats.requests++;
+	if ((sp = pagemap_get(hint)) != NULL && sp->sizeclass == c &&
+	    sp->state == SPAN_PARTIAL) {
+		bp = span_take(sp);
+		near_stats.near++;
+	}
+	mm_unlock(&central_lock);
+	return (bp != NULL ? bp : span_malloc(size));
+}
+
+/*
+ * Requires:
+ *   "bp" is an allocated object of a span.
+ *
+ * Effects:
+ *   Free the object.  A span left empty goes back to the heap unless it
+ *   is the only partial span of its class.  The span is looked up under
+ *   the lock, as a meshing pass may have moved the object's page to
+ *   another descriptor.
+ */
+static void
+span_free(void *bp)
+{
+	struct span *sp;
+	char *base;
+	int a, c, slot;
+
+	mm_lock(&central_lock);
+	sp = pagemap_get(bp);
+	c = sp->sizeclass;
+	base = sp->start;
+	for (a = 0; (char *)bp < base ||
+	    (char *)bp >= base + sp->npages * SPAN_PAGE; a++)
+		base = sp->alias[a];
+	slot = (int)(((char *)bp - base) / ((c + 1) * SPAN_ALIGN));
+	sp->used[slot / SPAN_BITS] &= ~(1UL << (slot % SPAN_BITS));
+	if (sp->state == SPAN_FULL) {
+		span_unlink(&span_classes[c].full, sp);
+		span_link(&span_classes[c].partial, sp);
+		sp->state = SPAN_PARTIAL;
+	}
+	if (--sp->inuse == 0 && (sp->prev != NULL || sp->next != NULL)) {
+		span_unlink(&span_classes[c].partial, sp);
+		span_release(sp);
+	}
+	if (mesh_period > 0 && ++mesh_frees >= mesh_period)
+		mesh_pass();
+	mm_unlock(&central_lock);
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Carve a span for class "c", big enough for SPAN_OBJECTS objects, map
+ *   its pages and put it on the partial list of the class.  Returns the
+ *   span, or NULL if the heap or the descriptors ran out.
+ */
+static struct span *
+span_new(int c)
+{
+	struct span *sp, **prev;
+	size_t npages, osize = (c + 1) * SPAN_ALIGN;
+	char *start;
+
+	/* Reuse the block of a released alias of the same length. */
+	npages = (osize * SPAN_OBJECTS + SPAN_PAGE - 1) / SPAN_PAGE;
+	for (prev = &span_clean; (sp = *prev) != NULL; prev = &sp->next)
+		if (sp->npages == npages)
+			break;
+	if (sp != NULL) {
+		*prev = sp->next;
+		start = sp->start;
+	} else {
+		if ((sp = span_desc()) == NULL)
+			return (NULL);
+		if ((start = span_carve(npages)) == NULL) {
+			sp->next = span_spare;
+			span_spare = sp;
+			return (NULL);
+		}
+	}
+	sp->start = start;
+	sp->npages = npages;
+	sp->sizeclass = c;
+	sp->state = SPAN_PARTIAL;
+	sp->inuse = 0;
+	sp->capacity = (int)(npages * SPAN_PAGE / osize);
+	sp->naliases = 0;
+	memset(sp->used, 0, sizeof(sp->used));
+	if (pagemap_set(start, npages, sp) < 0) {
+		pagemap_set(start, npages, NULL);
+		free_block(start);
+		sp->next = span_spare;
+		span_spare = sp;
+		return (NULL);
+	}
+	span_link(&span_classes[c].partial, sp);
+	span_classes[c].spans++;
+	return (sp);
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Take a descriptor off the spare list, mapping a slab of them if it is
+ *   empty.  Returns the descriptor, or NULL if no slab could be mapped.
+ */
+static struct span *
+span_desc(void)
+{
+	struct span *sp, *slab;
+	size_t i;
+
+	if (span_spare == NULL) {
+		slab = mmap(NULL, SPAN_SLAB, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED)
+			return (NULL);
+		for (i = 0; i < SPAN_SLAB / sizeof(*slab); i++) {
+			slab[i].next = span_spare;
+			span_spare = &slab[i];
+		}
+	}
+	sp = span_spare;
+	span_spare = sp->next;
+	return (sp);
+}
+
+/*
+ * Requires:
+ *   The central lock is held and "sp" is an empty span on no list.
+ *
+ * Effects:
+ *   Unmap the span's pages and give its block back to the heap.  Its
+ *   aliases get their own, still released, pages mapped back and their
+ *   blocks go on the clean list, or back to the heap if no descriptor is
+ *   left to hold them.
+ */
+static void
+span_release(struct span *sp)
+{
+	struct span *clean;
+	size_t len = sp->npages * SPAN_PAGE;
+	char *alias;
+
+	while (sp->naliases > 0) {
+		alias = sp->alias[--sp->naliases];
+		mem_unmap_alias(alias, len);
+		pagemap_set(alias, sp->npages, NULL);
+		if ((clean = span_desc()) == NULL) {
+			free_block(alias);
+			continue;
+		}
+		clean->start = alias;
+		clean->npages = sp->npages;
+		clean->next = span_clean;
+		span_clean = clean;
+	}
+	pagemap_set(sp->start, sp->npages, NULL);
+	free_block(sp->start);
+	sp->next = span_spare;
+	span_spare = sp;
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Give the blocks on the clean list back to the heap, so that they can
+ *   be merged with their neighbours and trimmed.
+ */
+static void
+span_flush_clean(void)
+{
+	struct span *sp;
+
+	while ((sp = span_clean) != NULL) {
+		span_clean = sp->next;
+		free_block(sp->start);
+		sp->next = span_spare;
+		span_spare = sp;
+	}
+}
+
+/*
+ * Requires:
+ *   "sp" is on no list.
+ *
+ * Effects:
+ *   Push "sp" onto "list".
+ */
+static void
+span_link(struct span **list, struct span *sp)
+{
+
+	sp->prev = NULL;
+	sp->next = *list;
+	if (*list != NULL)
+		(*list)->prev = sp;
+	*list = sp;
+}
+
+/*
+ * Requires:
+ *   "sp" is on "list".
+ *
+ * Effects:
+ *   Unlink "sp" from "list".
+ */
+static void
+span_unlink(struct span **list, struct span *sp)
+{
+
+	if (sp->prev != NULL)
+		sp->prev->next = sp->next;
+	else
+		*list = sp->next;
+	if (sp->next != NULL)
+		sp->next->prev = sp->prev;
+	sp->prev = sp->next = NULL;
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Allocate a block of the heap whose payload is "npages" whole pages
+ *   starting on a page boundary.  The block's header and footer lie on
+ *   the pages around it, and the free space before and after it goes
+ *   back to the free lists.  Returns the payload's address or NULL.
+ */
+static void *
+span_carve(size_t npages)
+{
+	size_t csize, lead, tail, ssize = npages * SPAN_PAGE + DSIZE;
+	size_t need = ssize + SPAN_PAGE + 5 * WSIZE;
+	char *bp, *p;
+
+	if ((bp = merge_fit(need)) == NULL &&
+	    (bp = extend_heap(need / WSIZE)) == NULL)
+		return (NULL);
+	csize = GET_SIZE(HDRP(bp));
+	remove_free_block(bp);
+
+	/* Leave either no gap or one that can be a block of its own. */
+	p = (char *)(((uintptr_t)bp + SPAN_PAGE - 1) & ~(SPAN_PAGE - 1));
+	if (p != bp && (size_t)(p - bp) < 5 * WSIZE)
+		p += SPAN_PAGE;
+	lead = p - bp;
+	tail = csize - lead - ssize;
+	if (tail < 5 * WSIZE) {
+		ssize += tail;
+		tail = 0;
+	}
+
+	/* Mark the span allocated before its neighbours can coalesce. */
+	if (huge_aware)
+		huge_use(p - 4 * WSIZE, ssize + 4 * WSIZE);
+	PUT(HDRP(p), PACK(ssize, 1));
+	PUT(FTRP(p), PACK(ssize, 1));
+	if (tail > 0) {
+		PUT(HDRP(NEXT_BLKP(p)), PACK(tail, 1));
+		PUT(FTRP(NEXT_BLKP(p)), PACK(tail, 1));
+		free_block(NEXT_BLKP(p));
+	}
+	if (lead > 0) {
+		PUT(HDRP(bp), PACK(lead, 1));
+		PUT(FTRP(bp), PACK(lead, 1));
+		free_block(bp);
+	}
+	return (p);
+}
+
+/*
+ * Requires:
+ *   The heap is being reset by mm_init.
+ *
+ * Effects:
+ *   Forget every span: unmap its pages and its aliases' and recycle its
+ *   descriptor.  mem_reset_brk has already mapped every page back.
+ */
+static void
+span_reset(void)
+{
+	struct span *sp, **list;
+	int c, l;
+
+	for (c = 0; c < SPAN_CLASSES; c++) {
+		for (l = 0; l < 2; l++) {
+			list = l == 0 ? &span_classes[c].partial :
+			    &span_classes[c].full;
+			while ((sp = *list) != NULL) {
+				span_unlink(list, sp);
+				pagemap_set(sp->start, sp->npages, NULL);
+				while (sp->naliases > 0)
+					pagemap_set(sp->alias[--sp->naliases],
+					    sp->npages, NULL);
+				sp->next = span_spare;
+				span_spare = sp;
+			}
+		}
+		span_classes[c].spans = 0;
+	}
+	while ((sp = span_clean) != NULL) {
+		span_clean = sp->next;
+		sp->next = span_spare;
+		span_spare = sp;
+	}
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Mesh the partial spans of every class and account for the pass in
+ *   the meshing statistics.  Returns the number of pages given back.
+ */
+static unsigned long
+mesh_pass(void)
+{
+	struct timespec t0, t1;
+	unsigned long ns, pages = 0;
+	int c;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	__atomic_store_n(&mesh_epoch, mesh_epoch + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&mesh_busy, 1, __ATOMIC_RELEASE);
+	for (c = 0; c < SPAN_CLASSES; c++) {
+		if (span_classes[c].partial != NULL &&
+		    span_classes[c].partial->next != NULL)
+			pages += mesh_class(c);
+	}
+	__atomic_store_n(&mesh_busy, 0, __ATOMIC_RELEASE);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000UL + t1.tv_nsec - t0.tv_nsec;
+	mesh_frees = 0;
+	mesh_stats.passes++;
+	mesh_stats.pages += pages;
+	mesh_stats.nsecs += ns;
+	if (ns > mesh_stats.max_nsecs)
+		mesh_stats.max_nsecs = ns;
+	return (pages);
+}
+
+/*
+ * Requires:
+ *   The central lock is held and a pass is running.
+ *
+ * Effects:
+ *   Split the first MESH_CANDIDATES partial spans of class "c" in two
+ *   halves and try each span of the first against MESH_TRIES spans of
+ *   the second, meshing the pairs whose slots in use do not overlap.  Of
+ *   a pair, the span with fewer objects is copied, unless it has aliases
+ *   of its own.  Returns the number of pages given back.
+ */
+static unsigned long
+mesh_class(int c)
+{
+	static struct span *cand[MESH_CANDIDATES];
+	struct span *sp, *dst, *src;
+	unsigned long pages = 0, overlap;
+	int i, j, w, t, n = 0, half;
+
+	for (sp = span_classes[c].partial; sp != NULL && n < MESH_CANDIDATES;
+	    sp = sp->next)
+		cand[n++] = sp;
+	half = n / 2;
+	for (t = 0; t < MESH_TRIES && t < n - half; t++) {
+		for (i = 0; i < half; i++) {
+			j = half + (i + t) % (n - half);
+			if (cand[i] == NULL || cand[j] == NULL)
+				continue;
+			dst = cand[i];
+			src = cand[j];
+			if (src->naliases > 0 || (dst->naliases == 0 &&
+			    dst->inuse < src->inuse)) {
+				dst = cand[j];
+				src = cand[i];
+			}
+			if (src->naliases > 0 || dst->naliases == MESH_ALIASES)
+				continue;
+			for (w = 0, overlap = 0; w < SPAN_WORDS; w++)
+				overlap |= dst->used[w] & src->used[w];
+			if (overlap != 0)
+				continue;
+			if (!mesh_spans(dst, src))
+				return (pages);
+			pages += src->npages;
+			cand[src == cand[i] ? i : j] = NULL;
+			if (dst->state == SPAN_FULL)
+				cand[dst == cand[i] ? i : j] = NULL;
+		}
+	}
+	return (pages);
+}
+
+/*
+ * Requires:
+ *   The central lock is held, "dst" and "src" are partial spans of one
+ *   class with disjoint slots in use and "src" has no aliases.
+ *
+ * Effects:
+ *   Copy the objects of "src" into the same slots of "dst", map the pages
+ *   of "src" onto those of "dst" and make them an alias of "dst".  The
+ *   pages of "src" are read-only during the copy.  Returns false, leaving
+ *   both spans as they were, if memlib cannot remap the heap.
+ */
+static bool
+mesh_spans(struct span *dst, struct span *src)
+{
+	size_t osize = (dst->sizeclass + 1) * SPAN_ALIGN;
+	size_t len = src->npages * SPAN_PAGE;
+	unsigned long bits;
+	int w, slot;
+
+	if (mesh_lo == NULL || src->start < mesh_lo)
+		__atomic_store_n(&mesh_lo, src->start, __ATOMIC_RELAXED);
+	if (src->start + len > mesh_hi)
+		__atomic_store_n(&mesh_hi, src->start + len, __ATOMIC_RELAXED);
+	if (mprotect(src->start, len, PROT_READ) < 0)
+		return (false);
+	for (w = 0; w < SPAN_WORDS; w++) {
+		for (bits = src->used[w]; bits != 0; bits &= bits - 1) {
+			slot = w * SPAN_BITS + __builtin_ctzl(bits);
+			memcpy(dst->start + slot * osize,
+			    src->start + slot * osize, osize);
+		}
+	}
+	if (mem_remap(src->start, dst->start, len) < 0) {
+		mprotect(src->start, len, PROT_READ | PROT_WRITE);
+		return (false);
+	}
+
+	for (w = 0; w < SPAN_WORDS; w++)
+		dst->used[w] |= src->used[w];
+	dst->inuse += src->inuse;
+	dst->alias[dst->naliases++] = src->start;
+	pagemap_set(src->start, src->npages, dst);
+	span_unlink(&span_classes[src->sizeclass].partial, src);
+	src->next = span_spare;
+	span_spare = src;
+	if (dst->inuse == dst->capacity) {
+		span_unlink(&span_classes[dst->sizeclass].partial, dst);
+		span_link(&span_classes[dst->sizeclass].full, dst);
+		dst->state = SPAN_FULL;
+	}
+	mesh_stats.meshed++;
+	return (true);
+}
+
+/*
+ * Requires:
+ *   Installed as the SIGSEGV action by mm_set_mesh.
+ *
+ * Effects:
+ *   A write to a span that a pass has made read-only waits for the pass
+ *   to end and is then retried, reaching the span's new pages.  A fault
+ *   within the meshed spans counts as such while a pass runs, and once
+ *   more after it, for a write that faulted just before the pass ended;
+ *   the same fault again with no pass in between is a real one.  Real
+ *   faults go to the previous action, which is called in place so that
+ *   mesh_fault stays installed, or to the default action if there was
+ *   none.
+ */
+static void
+mesh_fault(int sig, siginfo_t *info, void *ctx)
+{
+	char *addr = info->si_addr;
+	unsigned long epoch = __atomic_load_n(&mesh_epoch, __ATOMIC_RELAXED);
+
+	if (addr >= __atomic_load_n(&mesh_lo, __ATOMIC_RELAXED) &&
+	    addr < __atomic_load_n(&mesh_hi, __ATOMIC_RELAXED) &&
+	    (__atomic_load_n(&mesh_busy, __ATOMIC_ACQUIRE) ||
+	    addr != mesh_retry || epoch != mesh_retry_epoch)) {
+		mesh_retry = addr;
+		mesh_retry_epoch = epoch;
+		while (__atomic_load_n(&mesh_busy, __ATOMIC_ACQUIRE))
+			sched_yield();
+		return;
+	}
+	if (mesh_oldact.sa_flags & SA_SIGINFO)
+		mesh_oldact.sa_sigaction(sig, info, ctx);
+	else if (mesh_oldact.sa_handler != SIG_DFL &&
+	    mesh_oldact.sa_handler != SIG_IGN)
+		mesh_oldact.sa_handler(sig);
+	else {
+		/* Returning faults again, now under the default action. */
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Add the "size" bytes of the block "bp", header included, to the free
+ *   bytes of the regions they fall in if "add" is set, or subtract them.
+ */
+static void
+huge_account(void *bp, size_t size, bool add)
+{
+	uintptr_t lo = (uintptr_t)HDRP(bp), hi = lo + size, end;
+	size_t r;
+
+	for (; lo < hi; lo = end) {
+		r = (lo - huge_base) >> HUGE_SHIFT;
+		if (r >= HUGE_REGIONS)
+			return;
+		end = huge_base + ((r + 1) << HUGE_SHIFT);
+		if (end > hi)
+			end = hi;
+		if (add)
+			huge_free[r] += end - lo;
+		else
+			huge_free[r] -= end - lo;
+	}
+}
+
+/*
+ * Requires:
+ *   The central lock is held, the hugepage layer is on and "bp" is a free
+ *   block of at least HUGE_PAGE bytes.
+ *
+ * Effects:
+ *   Give back to memlib every region that lies between the slot and the
+ *   links of "bp" and is not released yet.
+ */
+static void
+huge_release(void *bp)
+{
+	uintptr_t lo = (uintptr_t)bp + WSIZE;
+	uintptr_t hi = (uintptr_t)PREV_PTR(bp);
+	size_t r;
+
+	r = (lo - huge_base + HUGE_PAGE - 1) >> HUGE_SHIFT;
+	for (; r < HUGE_REGIONS && huge_base + ((r + 1) << HUGE_SHIFT) <= hi;
+	    r++) {
+		if (huge_released[r])
+			continue;
+		mem_discard((void *)(huge_base + (r << HUGE_SHIFT)),
+		    HUGE_PAGE);
+		huge_released[r] = true;
+		huge_stats.returned++;
+	}
+}
+
+/*
+ * Requires:
+ *   The central lock is held and the hugepage layer is on.
+ *
+ * Effects:
+ *   The "len" bytes at "lo" are about to be written; clear the released
+ *   mark of every region they overlap.
+ */
+static void
+huge_use(void *lo, size_t len)
+{
+	size_t r = ((uintptr_t)lo - huge_base) >> HUGE_SHIFT;
+	size_t last = ((uintptr_t)lo + len - 1 - huge_base) >> HUGE_SHIFT;
+
+	for (; r <= last && r < HUGE_REGIONS; r++) {
+		if (huge_released[r]) {
+			huge_released[r] = false;
+			huge_stats.reused++;
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Returns the bytes of region "r" that lie inside the heap and are not
+ *   free, that is, allocated or held in thread caches or spans.
+ */
+static size_t
+huge_used(size_t r)
+{
+	uintptr_t lo = huge_base + (r << HUGE_SHIFT), hi = lo + HUGE_PAGE;
+
+	if (lo < (uintptr_t)mem_heap_lo())
+		lo = (uintptr_t)mem_heap_lo();
+	if (hi > (uintptr_t)mem_heap_hi() + 1)
+		hi = (uintptr_t)mem_heap_hi() + 1;
+	return (hi > lo + huge_free[r] ? hi - lo - huge_free[r] : 0);
+}
+
+/* 
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Extend the heap with a free block and return that block's address.
+ */
+static void *
+extend_heap(size_t words) 
+{
+	void *bp;
+	size_t size;
+	
+	/* Allocate an even number of words to maintain alignment. */
+	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+	if ((bp = heap_sbrk(size)) == (void *)-1)  
+		return (NULL);
+
+	/* Initialize free block header/footer and the epilogue header. */
+	PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
+	PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
+	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
+	
+	/* Coalesce if the previous block was free. */
+	if (coalesce_mode != MM_COALESCE_NONE)
+		bp = coalesce(bp);
+	insert_free_block(bp);
+	
+	return bp;	
+	
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Extend the heap by "size" bytes like mem_sbrk, unless that would take
+ *   it past the hard limit.  Returns the start of the new area or
+ *   (void *)-1.
+ */
+static void *
+heap_sbrk(size_t size)
+{
+
+	if (hard_limit != 0 && mem_heapsize() + size > hard_limit) {
+		limit_stats.hard++;
+		return ((void *)-1);
+	}
+	return (mem_sbrk(size));
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Called when no free block fits and the heap is about to grow by
+ *   "size" bytes.  If that would take it past the soft limit, or the hard
+ *   limit if there is no soft one, flush this thread's cache, call the
+ *   pressure callbacks and reclaim memory.  Once the heap has grown past
+ *   the soft limit anyway, it must grow by another 1/PRESSURE_STEP of the
+ *   limit before the next reclamation.  The central lock is dropped
+ *   while the cache is flushed and the callbacks run.  Returns true if
+ *   memory was reclaimed, so that the caller should search again.
+ */
+static bool
+heap_pressure(size_t size)
+{
+	struct tcache *tc = &tcache;
+	size_t heapsize = mem_heapsize();
+	size_t limit = soft_limit != 0 ? soft_limit : hard_limit;
+	int i;
+
+	if (limit == 0 || reclaiming)
+		return (false);
+	if (heapsize + size <= limit) {
+		pressure_mark = 0;
+		return (false);
+	}
+	if (heapsize < pressure_mark)
+		return (false);
+	reclaiming = true;
+	if (soft_limit != 0)
+		limit_stats.soft++;
+	mm_unlock(&central_lock);
+
+	if (tc->generation == heap_generation) {
+		for (i = 0; i < TCACHE_CLASSES; i++)
+			tcache_flush(&tc->bins[i], 0, false);
+	}
+	for (i = 0; i < npressure_callbacks; i++)
+		pressure_callbacks[i].fn(heapsize, pressure_callbacks[i].arg);
+
+	mm_lock(&central_lock);
+	heap_reclaim();
+	pressure_mark = MAX(mem_heapsize(), limit) + limit / PRESSURE_STEP;
+	reclaiming = false;
+	return (true);
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Free the clean blocks of released aliases and the batches of the
+ *   central store, merge every run of
+ *   adjacent free blocks into one block, see coalesce_heap, and give a
+ *   free block at the end of the heap back to memlib.
+ */
+static void
+heap_reclaim(void)
+{
+	char *bp, *last = NULL;
+	size_t size;
+
+	span_flush_clean();
+	store_drain();
+	limit_stats.merged += coalesce_heap();
+	for (bp = heap_listp + 3 * WSIZE; GET_SIZE(HDRP(bp)) > 0;
+	    bp = NEXT_BLKP(bp))
+		last = bp;
+
+	/* Give back a free last block; its header becomes the epilogue. */
+	if (last != NULL && !GET_ALLOC(HDRP(last))) {
+		size = GET_SIZE(HDRP(last));
+		remove_free_block(last);
+		if (mem_sbrk(-(intptr_t)size) != (void *)-1) {
+			if (huge_aware)
+				huge_use(HDRP(last), size);
+			PUT(HDRP(last), PACK(0, 1));
+			limit_stats.trimmed += size;
+		} else
+			insert_free_block(last);
+	}
+	last_bp = heap_listp;
+}
+
+/* 
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Empty every free list and prime each class that fits in a chunk of
+ *   "words" words with a chunk carved into equal blocks of the class's
+ *   minimum size.  Each chunk starts at the next cache colour.  Returns the
+ *   address of the last chunk's epilogue or NULL if the heap could not be
+ *   extended.
+ */
+static void *
+init_heap(size_t words) 
+{
+	void *bp = NULL;
+	size_t size, block_size, pad, tail;
+	int i, j, n;
+	
+	/* Allocate an even number of words to maintain alignment. */
+	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+	for (i = 0; i < NUM_HEAPS; i++) {
+		beginning_heap[i] = 0;
+		size_index[i].count = 0;
+		size_index[i].spilled = 0;
+	}
+	free_bytes = 0;
+	for (i = 0; i < NUM_HEAPS; i++) {
+		block_size = (5 * (1 << i)) * WSIZE;
+		pad = color_pad();
+		if (pad + block_size > size)
+			break;
+		if ((bp = heap_sbrk(size)) == (void *)-1)  
+			return (NULL);
+
+		/* Skip the colour offset with an allocated filler block. */
+		if (pad > 0) {
+			PUT(HDRP(bp), PACK(pad, 1));
+			PUT(FTRP(bp), PACK(pad, 1));
+			bp = NEXT_BLKP(bp);
+		}
+
+		/*
+		 * Carve the rest into equal blocks.  A tail too small to be a
+		 * block of its own is given to the last one.
+		 */
+		n = (int)((size - pad) / block_size);
+		tail = size - pad - n * block_size;
+		for (j = 0; j < n; j++) {
+			if (j == n - 1 && tail < 5*WSIZE) {
+				block_size += tail;
+				tail = 0;
+			}
+			PUT(HDRP(bp), PACK(block_size, 0));    
+			PUT(FTRP(bp), PACK(block_size, 0));    /* Set new size */
+			insert_free_block(bp);
+			bp = NEXT_BLKP(bp);
+		}
+		if (tail > 0) {
+			PUT(HDRP(bp), PACK(tail, 0));
+			PUT(FTRP(bp), PACK(tail, 0));
+			insert_free_block(bp);
+			bp = NEXT_BLKP(bp);
+		}
+		PUT(HDRP(bp), PACK(0, 1));            /* New epilogue header */
+	}
+
+	return bp;	
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the colour offset, in bytes, for the next chunk and advances
+ *   the colour.
+ */
+static size_t
+color_pad(void)
+{
+	size_t pad = (size_t)next_color * CACHE_LINE;
+
+	if (++next_color >= cache_colors)
+		next_color = 0;
+	return (pad);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Find a fit for a block with "asize" bytes.  Returns that block's address
+ *   or NULL if no suitable block was found. 
+ */
+void *
+find_fit(size_t asize)
+{
+
+	int D = -1;
+	
+	if (8==D) {
+		first_fit(asize);
+		next_fit(asize);
+		best_fit(asize);
+		explicit_first_fit(asize);
+	}
+	//return first_fit(asize);
+	//return next_fit(asize);
+	//return best_fit(asize);
+	//return explicit_first_fit(asize);
+	//return explicit_best_fit(asize);
+	if (huge_aware)
+		return segregated_huge_fit(asize);
+	switch (ADAPTING ? adapt_modes[adapt_cur].policy : fit_policy) {
+	case MM_FIT_SEGREGATED_BEST:
+		return segregated_best_fit(asize);
+	case MM_FIT_SEGREGATED_GOOD:
+		return segregated_good_fit(asize);
+	default:
+		return segregated_first_fit(asize);
+	}
+}
+
+
+void* 
+first_fit(size_t asize)
+{
+	void *bp;
+	/* Search for the first fit. */
+	for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = (NEXT_BLKP(bp))) {
+		if (!GET_ALLOC(HDRP(bp)) && asize <= GET_SIZE(HDRP(bp)))
+			return (bp);
+	}
+	/* No fit was found. */
+	return (NULL);
+}
+
+void* 
+explicit_first_fit(size_t asize)
+{
+	void *bp;
+
+	/* Search for the first fit. */
+	for (bp = (void*)beginning_heap[heap_index]; bp; bp = (void*)GET(NEXT_PTR(bp))) {
+		
+		if (bp==(void*)GET(NEXT_PTR(bp))) {
+			printf("error: infinate loop\n");
+		}
+		asize=asize;
+		if (!GET_ALLOC(HDRP(bp)) ) {
+		//	printf("a %p b %p\n", (void*)asize, (void*)GET_SIZE(HDRP(bp)));
+			if (asize <= GET_SIZE(HDRP(bp))) {
+				return (bp);
+			}
+			else {
+				printf("asize %p getsize %p\n",(void*)asize, (void*)GET_SIZE(HDRP(bp)));
+			}
+		}
+		else {
+			printf("1\n");	
+		}
+	}
+
+	/* No fit was found. */
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Take the head of the lowest non-empty class all of whose blocks can
+ *   hold "asize" bytes.  The class is worked out from "asize" rather than
+ *   read from heap_index, which another caller may have set since, for
+ *   instance a pressure callback that allocates.  A request too large for
+ *   every class takes the first block of the last class that fits.
+ *   Returns the block's address or NULL if no suitable block was found.
+ */
+void* 
+segregated_first_fit(size_t asize)
+{
+	void *bp;
+	int i;
+
+	if ((i = request_class(asize)) >= NUM_HEAPS) {
+		for (bp = (void *)beginning_heap[NUM_HEAPS - 1]; bp;
+		    bp = (void *)GET(NEXT_PTR(bp))) {
+			adapt_probes++;
+			if (GET_SIZE(HDRP(bp)) >= asize) {
+				heap_index = NUM_HEAPS - 1;
+				return (bp);
+			}
+		}
+		return (NULL);
+	}
+	/* Search for the first fit. */
+	for (; i < NUM_HEAPS; i++) {
+		adapt_probes++;
+		if (beginning_heap[i]) {
+			heap_index = i;
+			//printf("thisretuned\n");
+			return ((void *)beginning_heap[i]);
+		}
+		else {
+		
+//			printf("i: %d\n", i);
+		}
+
+	}
+	//printf("this\n");
+	/* No fit was found. */
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Find the tightest fit for a block with "asize" bytes in the lowest class
+ *   that has one, starting with the class that "asize" itself falls into.
+ *   Returns that block's address or NULL if no suitable block was found.
+ */
+void *
+segregated_best_fit(size_t asize)
+{
+	struct size_index *idx;
+	void *bp, *best;
+	int i, slot;
+
+	for (i = free_class(asize); i < NUM_HEAPS; i++) {
+		if (!beginning_heap[i])
+			continue;
+		idx = &size_index[i];
+		best = NULL;
+		adapt_probes += idx->count + idx->spilled;
+		if ((slot = size_index_best(idx, asize)) >= 0)
+			best = idx->blocks[slot];
+
+		/* Blocks that did not fit in the index are only on the list. */
+		if (idx->spilled > 0) {
+			for (bp = (void *)beginning_heap[i]; bp;
+			    bp = (void *)GET(NEXT_PTR(bp))) {
+				if (SLOT(bp) == SLOT_NONE &&
+				    GET_SIZE(HDRP(bp)) >= asize && (best == NULL ||
+				    GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(best))))
+					best = bp;
+			}
+		}
+		if (best != NULL) {
+			heap_index = i;
+			return (best);
+		}
+	}
+	/* No fit was found. */
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Examine up to "fit_depth" blocks, or the depth of the adaptive mode,
+ *   of the class that "asize" falls into
+ *   and take the first exact or near-exact fit, that is, one whose remainder
+ *   would be too small to split off.  Otherwise take the tightest fit seen
+ *   among the examined blocks, and if none of them fits, fall back to the
+ *   head of the next non-empty class.  Returns the block's address or NULL
+ *   if no suitable block was found.
+ */
+void *
+segregated_good_fit(size_t asize)
+{
+	void *bp, *best = NULL;
+	size_t bsize;
+	int depth = ADAPTING ? adapt_modes[adapt_cur].depth : fit_depth;
+	int i, n;
+
+	i = free_class(asize);
+	for (bp = (void *)beginning_heap[i], n = 0;
+	    bp && (depth == 0 || n < depth);
+	    bp = (void *)GET(NEXT_PTR(bp)), n++) {
+		adapt_probes++;
+		bsize = GET_SIZE(HDRP(bp));
+		if (bsize < asize)
+			continue;
+		if (bsize - asize < 5*WSIZE) {
+			heap_index = i;
+			return (bp);
+		}
+		if (best == NULL || bsize < GET_SIZE(HDRP(best)))
+			best = bp;
+	}
+	if (best != NULL) {
+		heap_index = i;
+		return (best);
+	}
+	for (n = i + 1; n < NUM_HEAPS; n++) {
+		adapt_probes++;
+		if (beginning_heap[n]) {
+			heap_index = n;
+			return ((void *)beginning_heap[n]);
+		}
+	}
+	/* No fit was found. */
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   The hugepage layer is on.
+ *
+ * Effects:
+ *   Examine up to HUGE_DEPTH blocks of each class from the one that
+ *   "asize" falls into, and in the first class that has a fit take the
+ *   fitting block whose hugepage region is fullest, the tighter fit
+ *   breaking ties.  Returns the block's address or NULL if no suitable
+ *   block was found.
+ */
+void *
+segregated_huge_fit(size_t asize)
+{
+	void *bp, *best = NULL;
+	size_t bsize, used, best_used = 0;
+	int i, n;
+
+	for (i = free_class(asize); i < NUM_HEAPS; i++) {
+		for (bp = (void *)beginning_heap[i], n = 0;
+		    bp && n < HUGE_DEPTH;
+		    bp = (void *)GET(NEXT_PTR(bp)), n++) {
+			adapt_probes++;
+			bsize = GET_SIZE(HDRP(bp));
+			if (bsize < asize)
+				continue;
+			used = huge_used(((uintptr_t)HDRP(bp) - huge_base) >>
+			    HUGE_SHIFT);
+			if (best == NULL || used > best_used ||
+			    (used == best_used &&
+			    bsize < GET_SIZE(HDRP(best)))) {
+				best = bp;
+				best_used = used;
+			}
+		}
+		if (best != NULL) {
+			heap_index = i;
+			return (best);
+		}
+	}
+	/* No fit was found. */
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "idx" is the size index of a class.
+ *
+ * Effects:
+ *   Returns the slot of the smallest indexed block of at least "asize"
+ *   bytes, or -1 if there is none.  The slack "size - asize" is computed in
+ *   unsigned 32-bit arithmetic, so blocks that are too small wrap around to
+ *   huge values and a plain minimum over all slots finds the best fit
+ *   without a branch per block.  Uses AVX2 or SSE4.1 when the compiler
+ *   targets them and a loop the compiler can vectorize otherwise.
+ */
+static int
+size_index_best(const struct size_index *idx, size_t asize)
+{
+	const uint32_t *sizes = idx->sizes;
+	uint32_t want = (uint32_t)asize;
+	uint32_t best = UINT32_MAX;
+	int i = 0, n = idx->count;
+
+	if (asize > INT32_MAX)
+		return (-1);
+#if defined(__AVX2__)
+	if (n >= 8) {
+		__m256i vwant = _mm256_set1_epi32((int)want);
+		__m256i vbest = _mm256_set1_epi32(-1);
+		uint32_t lanes[8];
+		int j;
+
+		for (; i + 8 <= n; i += 8) {
+			__m256i v = _mm256_load_si256((const __m256i *)&sizes[i]);
+			vbest = _mm256_min_epu32(vbest, _mm256_sub_epi32(v, vwant));
+		}
+		_mm256_storeu_si256((__m256i *)lanes, vbest);
+		for (j = 0; j < 8; j++)
+			best = lanes[j] < best ? lanes[j] : best;
+	}
+#elif defined(__SSE4_1__)
+	if (n >= 4) {
+		__m128i vwant = _mm_set1_epi32((int)want);
+		__m128i vbest = _mm_set1_epi32(-1);
+		uint32_t lanes[4];
+		int j;
+
+		for (; i + 4 <= n; i += 4) {
+			__m128i v = _mm_load_si128((const __m128i *)&sizes[i]);
+			vbest = _mm_min_epu32(vbest, _mm_sub_epi32(v, vwant));
+		}
+		_mm_storeu_si128((__m128i *)lanes, vbest);
+		for (j = 0; j < 4; j++)
+			best = lanes[j] < best ? lanes[j] : best;
+	}
+#endif
+	for (; i < n; i++) {
+		uint32_t slack = sizes[i] - want;
+		best = slack < best ? slack : best;
+	}
+	if (best > INT32_MAX)
+		return (-1);
+
+	/* Locate the first slot with the minimal slack. */
+	for (i = 0; i < n; i++) {
+		if (sizes[i] - want == best)
+			return (i);
+	}
+	return (-1);
+}
+
+void *
+next_fit(size_t asize)
+{
+	void *bp;
+	void *bp2;
+
+	/* Search for the first fit. */
+	for (bp = NEXT_BLKP(last_bp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+		if (!GET_ALLOC(HDRP(bp)) && asize <= GET_SIZE(HDRP(bp))) {
+			last_bp = bp;
+			return (bp);
+		}
+	}
+	for (bp2 = heap_listp; bp2 < last_bp; bp2 = NEXT_BLKP(bp2)) {
+
+		if (!GET_ALLOC(HDRP(bp2)) && asize <= GET_SIZE(HDRP(bp2))) {
+			last_bp = bp2; 
+			return (bp2);
+		}
+	}
+	/* No fit was found. */
+	last_bp = heap_listp;
+
+	return (NULL);
+}
+
+void* best_fit(size_t asize)
+{
+	void *bp;
+	void *minimum_pointer = NULL;
+	
+	/* Search for the best fit. */
+	for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+		if (!GET_ALLOC(HDRP(bp))) {
+			if (asize == GET_SIZE(HDRP(bp))) {
+				return (bp);
+			}
+			else if (GET_SIZE(HDRP(bp)) > asize && (!minimum_pointer || (GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(minimum_pointer))))) {
+				minimum_pointer = bp;
+			}
+		}
+	}
 
-	bool prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-	bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+	return (minimum_pointer);
+}
 
-	if ((PREV_BLKP(bp)) == bp) { // Happens if we're on the first ellement, we don't want to allocate before our heap space.
-		prev_alloc = 1;
-	}
-	
-	if (prev_alloc && next_alloc) {                 /* Case 1 */
-	//	printf("1\n");
-		return (bp);
-	} else if (prev_alloc && !next_alloc) {         /* Case 2 */
-		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-		if (last_bp == NEXT_BLKP(bp)) {
-			last_bp = bp;
-		}
-		
-		
-		attatch_blocks(next_block_pred, next_block_succ);
-		
-		PUT(HDRP(bp), PACK(size, 0));
-		PUT(FTRP(bp), PACK(size, 0));
-		//printf("2\n");
-	} else if (!prev_alloc && next_alloc) {         /* Case 3 */
-		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
 
-		if (bp == last_bp) {
-			last_bp = PREV_BLKP(bp);
-		}
-				
-		attatch_blocks(prev_block_pred, prev_block_succ);
-		
-		bp = PREV_BLKP(bp);
-		PUT(HDRP(bp), PACK(size, 0));
-		PUT(FTRP(bp), PACK(size, 0));
-		//printf("3\n");
-	} else {                                        /* Case 4 */
-		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
-		    GET_SIZE(FTRP(NEXT_BLKP(bp)));
+void* 
+explicit_best_fit(size_t asize)
+{
+	void *bp;
+	void *minimum_pointer = NULL;
 
-		if (bp == last_bp) {
-			last_bp = PREV_BLKP(bp);
-		}
-		else if (last_bp == NEXT_BLKP(bp)) {
-			last_bp = PREV_BLKP(bp);
-		}
-						
-		attatch_blocks(next_block_pred, next_block_succ);
-		
-		// Need to reset them because might have been changed in attach blocks
-		prev_block_succ = GET(NEXT_PTR(PREV_BLKP(bp)));
-		prev_block_pred = GET(PREV_PTR(PREV_BLKP(bp)));
-		
-		attatch_blocks(prev_block_pred, prev_block_succ);
-								
-		bp = PREV_BLKP(bp);
-		PUT(HDRP(bp), PACK(size, 0));
-		PUT(FTRP(bp), PACK(size, 0));
-		//printf("4\n");
+	/* Search for the best fit. */
+	for (bp = (void*)beginning_heap[heap_index]; bp; bp = (void*)GET(NEXT_PTR(bp))) {
 		
+		if (!GET_ALLOC(HDRP(bp))) {
+			if (asize == GET_SIZE(HDRP(bp))) {
+				return (bp);
+			}
+			else if (GET_SIZE(HDRP(bp)) > asize && (!minimum_pointer || (GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(minimum_pointer))))) {
+				minimum_pointer = bp;
+			}
+		}
 	}
-	return (bp);
+	/* No fit was found. */
+	return (minimum_pointer);
 }
 
 /* 
+ * Requires:
+ *   "bp" is the address of a free block that is at least "asize" bytes.
+ *
+ * Effects:
+ *   Place a block of "asize" bytes at the start of the free block "bp" and
+ *   split that block if the remainder would be at least the minimum block
+ *   size. 
+ */
+static void
+place(void *bp, size_t asize)
+{
+	size_t csize = GET_SIZE(HDRP(bp));   
+
+	remove_free_block(bp);
+	if (huge_aware)
+		huge_use(HDRP(bp), (csize - asize) >= (5*WSIZE) ?
+		    asize + DSIZE : csize);
+	if ((csize - asize) >= (5*WSIZE)) { 
+		PUT(HDRP(bp), PACK(asize, 1));
+		PUT(FTRP(bp), PACK(asize, 1));
+		
+		void* next_blk = NEXT_BLKP(bp);
+
+		/* Return the remainder to the list of its own class. */
+		PUT(HDRP(next_blk), PACK(csize - asize, 0));
+		PUT(FTRP(next_blk), PACK(csize - asize, 0));
+		insert_free_block(next_blk);
+	} else {
+		PUT(HDRP(bp), PACK(csize, 1));
+		PUT(FTRP(bp), PACK(csize, 1));				
+	}
+}
+
+/*
  * Requires:
  *   None.
  *
  * Effects:
- *   Extend the heap with a free block and return that block's address.
+ *   Returns the class whose list holds free blocks of "size" bytes, that is,
+ *   the largest class whose minimum block size does not exceed "size".
  */
-static void *
-extend_heap(size_t words) 
+static int
+free_class(size_t size)
 {
-	void *bp;
-	size_t size;
-	
-	/* Allocate an even number of words to maintain alignment. */
-	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-	if ((bp = mem_sbrk(size)) == (void *)-1)  
-		return (NULL);
+	int i;
 
-	/* Initialize free block header/footer and the epilogue header. */
-	PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
-	PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
-	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
-	
-	/* Coalesce if the previous block was free. */
-	if (0) {
-		bp = coalesce(bp) ;
+	for (i = 0; i < NUM_HEAPS - 1; i++) {
+		if ((5*WSIZE << (i + 1)) > size)
+			break;
 	}
+	return (i);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a free block that is on no list.
+ *
+ * Effects:
+ *   Push "bp" onto the list of its class and record it in the size index of
+ *   that class.
+ */
+static void
+insert_free_block(void *bp)
+{
+	struct size_index *idx;
+	size_t size = GET_SIZE(HDRP(bp));
+	int i = free_class(size);
+
+	free_bytes += size;
+	huge_account(bp, size, true);
+	if (huge_aware && size >= HUGE_PAGE)
+		huge_release(bp);
 	PUT(PREV_PTR(bp), 0);
-	PUT(NEXT_PTR(bp), beginning_heap[heap_index]);
-	if (beginning_heap[heap_index]) {
-		PUT(PREV_PTR(beginning_heap[heap_index]), (uintptr_t)bp);
+	PUT(NEXT_PTR(bp), beginning_heap[i]);
+	if (beginning_heap[i])
+		PUT(PREV_PTR(beginning_heap[i]), (uintptr_t)bp);
+	beginning_heap[i] = (uintptr_t)bp;
+
+	idx = &size_index[i];
+	if (idx->count < SIZE_INDEX_CAP) {
+		idx->sizes[idx->count] = (uint32_t)size;
+		idx->blocks[idx->count] = bp;
+		PUT(bp, idx->count++);
+	} else {
+		PUT(bp, SLOT_NONE);
+		idx->spilled++;
 	}
-				
-	beginning_heap[heap_index] = (uintptr_t)bp;
-	
-	return bp;	
-	
 }
 
+/*
+ * Requires:
+ *   "bp" is the address of a free block that is on the list of its class.
+ *
+ * Effects:
+ *   Unlink "bp" from the list of its class and drop it from the size index
+ *   and the coalescing queue.  The last slot of the index is moved into
+ *   the vacated one.
+ */
+static void
+remove_free_block(void *bp)
+{
+	struct size_index *idx;
+	uintptr_t prev = GET(PREV_PTR(bp));
+	uintptr_t next = GET(NEXT_PTR(bp));
+	uintptr_t slot = SLOT(bp);
+	int i = free_class(GET_SIZE(HDRP(bp)));
+
+	free_bytes -= GET_SIZE(HDRP(bp));
+	huge_account(bp, GET_SIZE(HDRP(bp)), false);
+	if (GET_QUEUED(HDRP(bp)))
+		coalesce_dequeue(bp);
+	if (prev)
+		PUT(NEXT_PTR(prev), next);
+	else
+		beginning_heap[i] = next;
+	if (next)
+		PUT(PREV_PTR(next), prev);
+
+	idx = &size_index[i];
+	if (slot == SLOT_NONE) {
+		idx->spilled--;
+		return;
+	}
+	idx->count--;
+	if (slot != (uintptr_t)idx->count) {
+		idx->sizes[slot] = idx->sizes[idx->count];
+		idx->blocks[slot] = idx->blocks[idx->count];
+		PUT(idx->blocks[slot], slot);
+	}
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the smallest class all of whose blocks can hold "asize" bytes,
+ *   or NUM_HEAPS if there is none.
+ */
+static int
+request_class(size_t asize)
+{
+	int i;
+
+	for (i = 0; i < NUM_HEAPS; i++) {
+		if ((5*WSIZE << i) > asize)
+			break;
+	}
+	return (i);
+}
+
+/*
+ * The following routines manage the per-thread caches that sit in front
+ * of the central lists.
+ */
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the calling thread's cache, emptying it first if it refers to
+ *   a heap from before the last mm_init, or NULL if caching is disabled.
+ *   A thread registers its cache on first use, so that its statistics can
+ *   be reported and its blocks flushed when it exits.
+ */
+static struct tcache *
+tcache_get(void)
+{
+	struct tcache *tc = &tcache;
+	int i;
+
+	if (tc->generation == heap_generation)
+		return (tc);
+	if (tcache_limit == 0)
+		return (NULL);
+
+	/* The blocks of a stale cache went away with the old heap. */
+	pthread_once(&tcache_once, tcache_init);
+	mm_lock(&tcache_lock);
+	if (tc->generation == 0) {
+		tc->slot = -1;
+		for (i = 0; i < TCACHE_THREADS; i++) {
+			if (tcaches[i] == NULL) {
+				tcaches[i] = tc;
+				tc->slot = i;
+				break;
+			}
+		}
+		pthread_setspecific(tcache_key, tc);
+	}
+	memset(tc->bins, 0, sizeof(tc->bins));
+	memset(tc->tags, 0, sizeof(tc->tags));
+	for (i = 0; i < TCACHE_CLASSES; i++)
+		tc->bins[i].capacity = TCACHE_MIN_CAP;
+	tc->ops = 0;
+	tc->generation = heap_generation;
+	mm_unlock(&tcache_lock);
+	return (tc);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Create the key whose destructor flushes a thread's cache at exit.
+ */
+static void
+tcache_init(void)
+{
+
+	pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/*
+ * Requires:
+ *   "arg" is the cache of an exiting thread.
+ *
+ * Effects:
+ *   Return the cached blocks to the central lists, fold the statistics
+ *   into those of the exited threads and unregister the cache.
+ */
+static void
+tcache_exit(void *arg)
+{
+	struct tcache *tc = arg;
+	struct tcache_bin *bin;
+	int i;
+
+	for (i = 0; i < TCACHE_CLASSES; i++) {
+		bin = &tc->bins[i];
+		if (tc->generation == heap_generation)
+			tcache_flush(bin, 0, false);
+	}
+	mm_lock(&tcache_lock);
+	for (i = 0; i < TCACHE_CLASSES && tc->generation == heap_generation;
+	    i++) {
+		bin = &tc->bins[i];
+		tcache_retired[i].hits += bin->hits;
+		tcache_retired[i].misses += bin->misses;
+		tcache_retired[i].overflows += bin->overflows;
+		tcache_retired[i].grows += bin->grows;
+		tcache_retired[i].shrinks += bin->shrinks;
+	}
+	for (i = 0; i < MM_TAGS && tc->generation == heap_generation; i++) {
+		tag_retired[i].bytes += tc->tags[i].bytes;
+		tag_retired[i].blocks += tc->tags[i].blocks;
+	}
+	if (tc->slot >= 0)
+		tcaches[tc->slot] = NULL;
+	tc->generation = 0;
+	mm_unlock(&tcache_lock);
+}
+
+/*
+ * Requires:
+ *   "i" is the request class of "asize" and is less than TCACHE_CLASSES.
+ *
+ * Effects:
+ *   Pop a block of at least "asize" bytes from this thread's cache.  The
+ *   head of class "i" - 1 is tried first, since a block freed with the
+ *   same size lands there, and then the head of class "i", all of whose
+ *   blocks fit.  Returns NULL on a miss, after which the caller goes to the
+ *   central lists and refills class "i".
+ */
 static void *
-init_heap(size_t words) 
+tcache_pop(int i, size_t asize)
 {
+	struct tcache *tc;
+	struct tcache_bin *bin;
+	uintptr_t head;
 	void *bp;
-	size_t size, block_size;
-	int i, j;
-	
-	/* Allocate an even number of words to maintain alignment. */
-	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-	for (i = 0; i < NUM_HEAPS; i++) {
-		beginning_heap[i] = 0;
+	int j;
+
+	if ((tc = tcache_get()) == NULL)
+		return (NULL);
+	tc->bins[i].used = true;
+	tcache_tick(tc);
+	for (j = i > 0 ? i - 1 : i; j <= i; j++) {
+		/* A failed swap means that the bin was stolen. */
+		bin = &tc->bins[j];
+		head = __atomic_load_n(&bin->head, __ATOMIC_ACQUIRE);
+		if ((bp = TC_PTR(head)) != NULL &&
+		    GET_SIZE(HDRP(bp)) >= asize &&
+		    __atomic_compare_exchange_n(&bin->head, &head,
+		    TC_HEAD(GET(NEXT_PTR(bp)), TC_COUNT(head) - 1), false,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
 	}
-	for (i = 0; i < NUM_HEAPS; i++) {
-		if (size >= (size_t)(5 * 1 << i)) {
-			if ((bp = mem_sbrk(size)) == (void *)-1)  
-				return (NULL);
+	if (j > i) {
+		STAT_INC(tc->bins[i].misses);
+		return (NULL);
+	}
+	__atomic_store_n(&bin->bytes, bin->bytes - GET_SIZE(HDRP(bp)),
+	    __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&tcache_bytes, GET_SIZE(HDRP(bp)),
+	    __ATOMIC_RELAXED);
+	STAT_INC(tc->bins[i].hits);
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is an allocated block of class "i", which is less than
+ *   TCACHE_CLASSES.
+ *
+ * Effects:
+ *   Cache the block being freed.  Returns false, leaving the block alone,
+ *   if caching is disabled or the process-wide cap would be exceeded.  A
+ *   class that overflows its capacity flushes half of it.
+ */
+static bool
+tcache_push(void *bp, int i)
+{
+	struct tcache *tc;
+	struct tcache_bin *bin;
+	size_t size = GET_SIZE(HDRP(bp));
+	int count;
+
+	if ((tc = tcache_get()) == NULL)
+		return (false);
+	bin = &tc->bins[i];
+	bin->used = true;
+	tcache_tick(tc);
+	if (__atomic_add_fetch(&tcache_bytes, size, __ATOMIC_RELAXED) >
+	    tcache_limit) {
+		__atomic_sub_fetch(&tcache_bytes, size, __ATOMIC_RELAXED);
+		STAT_INC(bin->overflows);
+		return (false);
+	}
+	count = tcache_put(bin, bp, bp, 1);
+	__atomic_store_n(&bin->bytes, bin->bytes + size, __ATOMIC_RELAXED);
+
+	if (count > bin->capacity) {
+		tcache_flush(bin, bin->capacity / 2, true);
+		bin->refills = 0;
+		if (++bin->flushes >= TCACHE_SHRINK &&
+		    bin->capacity > TCACHE_MIN_CAP) {
+			__atomic_store_n(&bin->capacity, bin->capacity / 2,
+			    __ATOMIC_RELAXED);
+			bin->flushes = 0;
+			STAT_INC(bin->shrinks);
 		}
-		else {
+	}
+	return (true);
+}
+
+/*
+ * Requires:
+ *   The central lock is held and "i" is less than TCACHE_CLASSES.
+ *
+ * Effects:
+ *   After a miss in class "i", move blocks from the central list of that
+ *   class into this thread's cache until it is half full.  Repeated
+ *   refills double the capacity.
+ */
+static void
+tcache_refill(int i)
+{
+	struct tcache *tc;
+	struct tcache_bin *bin;
+	void *bp, *first = NULL, *last = NULL;
+	size_t size;
+	int n, added = 0;
+
+	if ((tc = &tcache)->generation != heap_generation)
+		return;
+	bin = &tc->bins[i];
+	bin->flushes = 0;
+	if (++bin->refills >= TCACHE_GROW && bin->capacity < TCACHE_MAX_CAP) {
+		__atomic_store_n(&bin->capacity, bin->capacity * 2,
+		    __ATOMIC_RELAXED);
+		bin->refills = 0;
+		STAT_INC(bin->grows);
+	}
+	n = TC_COUNT(__atomic_load_n(&bin->head, __ATOMIC_RELAXED));
+	while (n + added < bin->capacity / 2 &&
+	    (bp = (void *)beginning_heap[i]) != NULL) {
+		size = GET_SIZE(HDRP(bp));
+		if (__atomic_add_fetch(&tcache_bytes, size,
+		    __ATOMIC_RELAXED) > tcache_limit) {
+			__atomic_sub_fetch(&tcache_bytes, size,
+			    __ATOMIC_RELAXED);
 			break;
 		}
-		
-		/* Initialize free block header/footer and the epilogue header. */
-		PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
-		PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
-		PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
-		/* Coalesce if the previous block was free. */
-	//	bp = coalesce(bp);
-		
-		block_size = (5 * (1 << i)) * WSIZE;
+		remove_free_block(bp);
+		PUT(HDRP(bp), PACK(size, 1));
+		PUT(FTRP(bp), PACK(size, 1));
+		PUT(NEXT_PTR(bp), (uintptr_t)first);
+		if (first == NULL)
+			last = bp;
+		first = bp;
+		added++;
+		__atomic_store_n(&bin->bytes, bin->bytes + size,
+		    __ATOMIC_RELAXED);
+	}
+	if (added > 0)
+		tcache_put(bin, first, last, added);
+}
 
-		for (j = 0; j < (int) (words / block_size); j++) {
-			PUT(HDRP(bp), PACK(block_size, 0));    
-			PUT(FTRP(bp), PACK(block_size, 0));    /* Set new size */
+/*
+ * Requires:
+ *   "bin" belongs to the calling thread's cache and the central lock is
+ *   not held.
+ *
+ * Effects:
+ *   Return cached blocks until "keep" remain.  If "batch" is set and the
+ *   central store is on, whole batches go to the store while it has room
+ *   and the rest to the central lists.
+ */
+static void
+tcache_flush(struct tcache_bin *bin, int keep, bool batch)
+{
+	uintptr_t head;
+	void *bp, *next, *last = NULL;
+	size_t flushed = 0, batched = 0, bytes;
+	int i, n, k;
 
-			/* Set pointers */
-			PUT(PREV_PTR(bp), 0);
-			PUT(NEXT_PTR(bp), beginning_heap[i]);
-			if (beginning_heap[i]) {
-				PUT(PREV_PTR((void *)beginning_heap[i]), (uintptr_t)bp);
-			}			
-			beginning_heap[i] = (uintptr_t)bp;
-			
-			bp = NEXT_BLKP(bp);
+	if (TC_COUNT(__atomic_load_n(&bin->head, __ATOMIC_RELAXED)) <= keep)
+		return;
+
+	/* Hold the list privately, so that no thief sees it half flushed. */
+	head = __atomic_exchange_n(&bin->head, 0, __ATOMIC_ACQUIRE);
+	bp = TC_PTR(head);
+	n = TC_COUNT(head);
+	if (batch && store_mode != MM_STORE_NONE && bp != NULL) {
+		i = free_class(GET_SIZE(HDRP(bp)));
+		while (n - keep >= TCACHE_BATCH) {
+			next = bp;
+			bytes = 0;
+			for (k = 0; k < TCACHE_BATCH; k++) {
+				last = next;
+				bytes += GET_SIZE(HDRP(last));
+				next = (void *)GET(NEXT_PTR(last));
+			}
+			PUT(NEXT_PTR(last), 0);
+			if (!store_push(i, bp)) {
+				PUT(NEXT_PTR(last), (uintptr_t)next);
+				break;
+			}
+			bp = next;
+			n -= TCACHE_BATCH;
+			batched += bytes;
+		}
+	}
+	if (n > keep) {
+		mm_lock(&central_lock);
+		for (; n > keep; n--) {
+			next = (void *)GET(NEXT_PTR(bp));
+			flushed += GET_SIZE(HDRP(bp));
+			free_block(bp);
+			bp = next;
 		}
+		mm_unlock(&central_lock);
 	}
+	__atomic_store_n(&bin->head, TC_HEAD(bp, n), __ATOMIC_RELEASE);
+	__atomic_store_n(&bin->bytes, bin->bytes - flushed - batched,
+	    __ATOMIC_RELAXED);
 
-	return bp;	
+	/* Batched blocks still count as cached, see tcache_store. */
+	__atomic_sub_fetch(&tcache_bytes, flushed, __ATOMIC_RELAXED);
 }
 
 /*
  * Requires:
- *   None.
+ *   "bin" belongs to the calling thread's cache and "first" to "last" are
+ *   "n" allocated blocks linked through their NEXT_PTR words.
  *
  * Effects:
- *   Find a fit for a block with "asize" bytes.  Returns that block's address
- *   or NULL if no suitable block was found. 
+ *   Push the blocks onto "bin" in one swap.  Returns the number of
+ *   blocks the bin then holds.
  */
-void *
-find_fit(size_t asize)
+static int
+tcache_put(struct tcache_bin *bin, void *first, void *last, int n)
 {
+	uintptr_t head = __atomic_load_n(&bin->head, __ATOMIC_RELAXED);
 
-	int D = -1;
-	
-	if (8==D) {
-		first_fit(asize);
-		next_fit(asize);
-		best_fit(asize);
-		explicit_first_fit(asize);
-	}
-	//return first_fit(asize);
-	//return next_fit(asize);
-	//return best_fit(asize);
-	//return explicit_first_fit(asize);
-	//return explicit_best_fit(asize);
-	return segregated_first_fit(asize);
+	do
+		PUT(NEXT_PTR(last), (uintptr_t)TC_PTR(head));
+	while (!__atomic_compare_exchange_n(&bin->head, &head,
+	    TC_HEAD(first, TC_COUNT(head) + n), false, __ATOMIC_RELEASE,
+	    __ATOMIC_RELAXED));
+	return (TC_COUNT(head) + n);
 }
 
-
-void* 
-first_fit(size_t asize)
+/*
+ * Requires:
+ *   "i" is less than TCACHE_CLASSES and the central lock is not held.
+ *
+ * Effects:
+ *   After a miss in class "i", pop a batch of that class from the central
+ *   store.  Returns one of its blocks and caches the others, or returns
+ *   NULL if the store is off or empty.
+ */
+static void *
+tcache_fetch(int i)
 {
-	void *bp;
-	/* Search for the first fit. */
-	for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = (NEXT_BLKP(bp))) {
-		if (!GET_ALLOC(HDRP(bp)) && asize <= GET_SIZE(HDRP(bp)))
-			return (bp);
-	}
-	/* No fit was found. */
-	return (NULL);
-}
+	struct tcache *tc = &tcache;
+	struct tcache_bin *bin;
+	void *bp, *last;
+	size_t bytes = 0;
+	int n = 0;
 
-void* 
-explicit_first_fit(size_t asize)
-{
-	void *bp;
-	void *prev = NULL;
-	/* Search for the first fit. */
-	for (bp = (void*)beginning_heap[heap_index]; bp; bp = (void*)GET(NEXT_PTR(bp))) {
-		
-		if (bp==(void*)GET(NEXT_PTR(bp))) {
-			printf("error: infinate loop\n");
-		}
-		prev = bp;
-		asize=asize;
-		if (!GET_ALLOC(HDRP(bp)) ) {
-		//	printf("a %p b %p\n", (void*)asize, (void*)GET_SIZE(HDRP(bp)));
-			if (asize <= GET_SIZE(HDRP(bp))) {
-				return (bp);
-			}
-			else {
-				printf("asize %p getsize %p\n",(void*)asize, (void*)GET_SIZE(HDRP(bp)));
-			}
-		}
-		else {
-			printf("1\n");	
-		}
+	if (store_mode == MM_STORE_NONE || tc->generation != heap_generation ||
+	    (bp = store_pop(i)) == NULL)
+		return (NULL);
+	for (last = bp; GET(NEXT_PTR(last)) != 0;
+	    last = (void *)GET(NEXT_PTR(last))) {
+		bytes += GET_SIZE(HDRP(last));
+		n++;
 	}
-
-	/* No fit was found. */
-	return (NULL);
+	bytes += GET_SIZE(HDRP(last));
+	__atomic_sub_fetch(&tcache_bytes, GET_SIZE(HDRP(bp)),
+	    __ATOMIC_RELAXED);
+	if (n > 0) {
+		bin = &tc->bins[i];
+		tcache_put(bin, (void *)GET(NEXT_PTR(bp)), last, n);
+		__atomic_store_n(&bin->bytes, bin->bytes + bytes -
+		    GET_SIZE(HDRP(bp)), __ATOMIC_RELAXED);
+	}
+	return (bp);
 }
 
-void* 
-segregated_first_fit(size_t asize)
+/*
+ * Requires:
+ *   "batch" is a batch of blocks of class "i", see tcache_store.
+ *
+ * Effects:
+ *   Push "batch" onto the store of class "i".  Returns false, leaving the
+ *   batch alone, if the store holds STORE_DEPTH batches already.
+ */
+static bool
+store_push(int i, void *batch)
 {
-	int i;
-	asize=asize;
-	/* Search for the first fit. */
-	for (i = heap_index; i < NUM_HEAPS; i++) {
-		if (beginning_heap[i]) {
-			heap_index = i;
-			//printf("thisretuned\n");
-			return ((void *)beginning_heap[i]);
-		}
-		else {
-		
-//			printf("i: %d\n", i);
-		}
+	struct tcache_store *st = &tcache_store[i];
+	uintptr_t head;
 
+	if (store_mode == MM_STORE_MUTEX) {
+		mm_lock(&store_lock);
+		if (st->depth >= STORE_DEPTH) {
+			st->full++;
+			mm_unlock(&store_lock);
+			return (false);
+		}
+		PUT(batch, (uintptr_t)TC_PTR(st->head));
+		st->head = TC_HEAD(batch, TC_COUNT(st->head) + 1);
+		st->depth++;
+		st->pushes++;
+		mm_unlock(&store_lock);
+		return (true);
 	}
-	//printf("this\n");
-	/* No fit was found. */
-	return (NULL);
+	if (__atomic_add_fetch(&st->depth, 1, __ATOMIC_RELAXED) >
+	    STORE_DEPTH) {
+		__atomic_sub_fetch(&st->depth, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&st->full, 1, __ATOMIC_RELAXED);
+		return (false);
+	}
+	head = __atomic_load_n(&st->head, __ATOMIC_RELAXED);
+	do
+		PUT(batch, (uintptr_t)TC_PTR(head));
+	while (!__atomic_compare_exchange_n(&st->head, &head,
+	    TC_HEAD(batch, TC_COUNT(head) + 1), false, __ATOMIC_RELEASE,
+	    __ATOMIC_RELAXED));
+	__atomic_add_fetch(&st->pushes, 1, __ATOMIC_RELAXED);
+	return (true);
 }
 
-void *
-next_fit(size_t asize)
+/*
+ * Requires:
+ *   "i" is less than TCACHE_CLASSES.
+ *
+ * Effects:
+ *   Pop the top batch of the store of class "i".  Returns the batch's
+ *   first block or NULL if the store is empty.  A batch that another
+ *   thread popped in the meantime may be read, but it is still heap
+ *   memory and the tag makes the swap fail.
+ */
+static void *
+store_pop(int i)
 {
+	struct tcache_store *st = &tcache_store[i];
+	uintptr_t head;
 	void *bp;
-	void *bp2;
-
-	/* Search for the first fit. */
-	for (bp = NEXT_BLKP(last_bp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-		if (!GET_ALLOC(HDRP(bp)) && asize <= GET_SIZE(HDRP(bp))) {
-			last_bp = bp;
-			return (bp);
-		}
-	}
-	for (bp2 = heap_listp; bp2 < last_bp; bp2 = NEXT_BLKP(bp2)) {
 
-		if (!GET_ALLOC(HDRP(bp2)) && asize <= GET_SIZE(HDRP(bp2))) {
-			last_bp = bp2; 
-			return (bp2);
+	if (store_mode == MM_STORE_MUTEX) {
+		mm_lock(&store_lock);
+		if ((bp = TC_PTR(st->head)) != NULL) {
+			st->head = TC_HEAD(GET(bp), TC_COUNT(st->head) + 1);
+			st->depth--;
+			st->pops++;
 		}
+		mm_unlock(&store_lock);
+		return (bp);
 	}
-	/* No fit was found. */
-	last_bp = heap_listp;
-
-	return (NULL);
+	head = __atomic_load_n(&st->head, __ATOMIC_ACQUIRE);
+	do {
+		if ((bp = TC_PTR(head)) == NULL)
+			return (NULL);
+	} while (!__atomic_compare_exchange_n(&st->head, &head,
+	    TC_HEAD(GET(bp), TC_COUNT(head) + 1), false, __ATOMIC_ACQUIRE,
+	    __ATOMIC_ACQUIRE));
+	__atomic_sub_fetch(&st->depth, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->pops, 1, __ATOMIC_RELAXED);
+	return (bp);
 }
 
-void* best_fit(size_t asize)
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Free every block of every batch in the central store to the central
+ *   lists.
+ */
+static void
+store_drain(void)
 {
-	void *bp;
-	void *minimum_pointer = NULL;
-	
-	/* Search for the best fit. */
-	for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-		if (!GET_ALLOC(HDRP(bp))) {
-			if (asize == GET_SIZE(HDRP(bp))) {
-				return (bp);
-			}
-			else if (GET_SIZE(HDRP(bp)) > asize && (!minimum_pointer || (GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(minimum_pointer))))) {
-				minimum_pointer = bp;
+	void *batch, *bp, *next;
+	size_t bytes = 0;
+	int i;
+
+	for (i = 0; i < TCACHE_CLASSES; i++) {
+		while ((batch = store_pop(i)) != NULL) {
+			for (bp = batch; bp != NULL; bp = next) {
+				next = (void *)GET(NEXT_PTR(bp));
+				bytes += GET_SIZE(HDRP(bp));
+				free_block(bp);
 			}
 		}
 	}
-
-	return (minimum_pointer);
+	__atomic_sub_fetch(&tcache_bytes, bytes, __ATOMIC_RELAXED);
 }
 
-
-void* 
-explicit_best_fit(size_t asize)
+/*
+ * Requires:
+ *   The central lock is held and "i" is less than TCACHE_CLASSES.
+ *
+ * Effects:
+ *   Called when a request of class "i" found no fit and the heap is about
+ *   to grow.  Take the bin of the lowest class from "i" up that some
+ *   other thread caches, from the cache that holds the most bytes of it,
+ *   swapping the bin for an empty one, and free its blocks to the central
+ *   lists.  Returns the number of bytes taken.
+ */
+static size_t
+tcache_steal(int i)
 {
-	void *bp;
-	void *minimum_pointer = NULL;
+	struct tcache *tc;
+	struct tcache_bin *bin, *victim = NULL;
+	uintptr_t head;
+	size_t idle, most, stolen = 0;
+	void *bp, *next;
+	int t, j;
 
-	/* Search for the best fit. */
-	for (bp = (void*)beginning_heap[heap_index]; bp; bp = (void*)GET(NEXT_PTR(bp))) {
-		
-		if (!GET_ALLOC(HDRP(bp))) {
-			if (asize == GET_SIZE(HDRP(bp))) {
-				return (bp);
-			}
-			else if (GET_SIZE(HDRP(bp)) > asize && (!minimum_pointer || (GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(minimum_pointer))))) {
-				minimum_pointer = bp;
+	if (!tcache_stealing)
+		return (0);
+	steal_stats.tries++;
+
+	/* The registry lock keeps an exiting thread's cache alive. */
+	mm_lock(&tcache_lock);
+	for (j = i; victim == NULL && j < TCACHE_CLASSES; j++) {
+		for (most = 0, t = 0; t < TCACHE_THREADS; t++) {
+			if ((tc = tcaches[t]) == NULL || tc == &tcache ||
+			    tc->generation != heap_generation)
+				continue;
+			bin = &tc->bins[j];
+			idle = MAX(STAT_READ(bin->bytes),
+			    STAT_READ(bin->stolen)) - STAT_READ(bin->stolen);
+			if (idle > most) {
+				most = idle;
+				victim = bin;
 			}
 		}
 	}
-	/* No fit was found. */
-	return (minimum_pointer);
+	if (victim != NULL) {
+		head = __atomic_exchange_n(&victim->head, 0, __ATOMIC_ACQUIRE);
+		for (bp = TC_PTR(head); bp != NULL; bp = next) {
+			next = (void *)GET(NEXT_PTR(bp));
+			stolen += GET_SIZE(HDRP(bp));
+			free_block(bp);
+			steal_stats.blocks++;
+		}
+		__atomic_add_fetch(&victim->stolen, stolen, __ATOMIC_RELAXED);
+	}
+	mm_unlock(&tcache_lock);
+
+	if (stolen > 0) {
+		__atomic_sub_fetch(&tcache_bytes, stolen, __ATOMIC_RELAXED);
+		steal_stats.steals++;
+		steal_stats.bytes += stolen;
+	}
+	return (stolen);
 }
 
-/* 
+/*
  * Requires:
- *   "bp" is the address of a free block that is at least "asize" bytes.
+ *   "tc" is the calling thread's cache.
  *
  * Effects:
- *   Place a block of "asize" bytes at the start of the free block "bp" and
- *   split that block if the remainder would be at least the minimum block
- *   size. 
+ *   Count an operation.  Every TCACHE_IDLE operations, classes that were
+ *   not touched since the previous check halve their capacity and return
+ *   all of their blocks.
  */
 static void
-place(void *bp, size_t asize)
+tcache_tick(struct tcache *tc)
 {
-	size_t csize = GET_SIZE(HDRP(bp));   
-	uintptr_t next_ptr = GET(NEXT_PTR(bp));
+	struct tcache_bin *bin;
 	int i;
-	asize = asize;
-	
-	if (bp == (void*)beginning_heap[heap_index]) {		
-		beginning_heap[heap_index] = (uintptr_t)next_ptr;
-		
-		if (next_ptr) {
-			PUT(PREV_PTR((void *)next_ptr), (uintptr_t)0); 			
-		}
-		//printf("4\n");
-  
-	}
-	else {
-		printf("error2\n");
-	}
-	
-	if ((csize - asize) >= (5*WSIZE)) { 
-		PUT(HDRP(bp), PACK(asize, 1));
-		PUT(FTRP(bp), PACK(asize, 1));
-		
-		void* next_blk = NEXT_BLKP(bp);
 
-		if (next_blk) {
-			PUT(HDRP(next_blk), PACK(csize - asize, 0));
-			PUT(FTRP(next_blk), PACK(csize - asize, 0));
-			
-			for (i = 0; i < NUM_HEAPS; i++) {
-				
-				if ((int)(5*WSIZE * (1 << i)) > (int)asize) {
-					break;
-				}
-			}
-			if (heap_index == -1) {
-				printf("error \n");
+	if (++tc->ops < TCACHE_IDLE)
+		return;
+	tc->ops = 0;
+	for (i = 0; i < TCACHE_CLASSES; i++) {
+		bin = &tc->bins[i];
+		if (!bin->used && __atomic_load_n(&bin->head,
+		    __ATOMIC_RELAXED) != 0) {
+			tcache_flush(bin, 0, false);
+			if (bin->capacity > TCACHE_MIN_CAP) {
+				__atomic_store_n(&bin->capacity,
+				    bin->capacity / 2, __ATOMIC_RELAXED);
+				STAT_INC(bin->shrinks);
 			}
-			PUT(NEXT_PTR(next_blk), beginning_heap[i]);
-			if (beginning_heap[i])
-				PUT(PREV_PTR(beginning_heap[i]), (uintptr_t)next_blk);
-			next_blk = (void *)beginning_heap[i];
-		}						
-	} else {
-		PUT(HDRP(bp), PACK(csize, 1));
-		PUT(FTRP(bp), PACK(csize, 1));				
+		}
+		bin->used = false;
 	}
 }
 
@@ -714,52 +4282,257 @@ place(void *bp, size_t asize)
  * Effects:
  *   Perform a minimal check on the block "bp".
  */
-static void
+static int
 checkblock(void *bp) 
 {
+	int errors = 0;
 
-	if ((uintptr_t)bp % WSIZE)
+	if ((uintptr_t)bp % WSIZE) {
 		printf("Error: %p is not doubleword aligned\n", bp);
-	if (GET(HDRP(bp)) != GET(FTRP(bp)))
+		errors++;
+	}
+	if (GET(HDRP(bp)) != GET(FTRP(bp))) {
 		printf("Error: header does not match footer\n");
+		errors++;
+	}
+	return (errors);
 }
 
 /* 
  * Requires:
- *   None.
+ *   The central lock is held.
  *
  * Effects:
- *   Perform a minimal check of the heap for consistency. 
+ *   Perform a minimal check of the heap for consistency.  Returns the
+ *   number of problems found, each of which is also printed.
  */
-void
+static int
 checkheap(bool verbose) 
 {
-	void *bp;
-	int i;
+	void *bp, *prev;
+	int i, n, errors = 0;
 	
 	if (verbose)
 		printf("Heap (%p):\n", heap_listp);
 
 	if (GET_SIZE(HDRP(heap_listp)) != WSIZE ||
-	    !GET_ALLOC(HDRP(heap_listp)))
+	    !GET_ALLOC(HDRP(heap_listp))) {
 		printf("Bad prologue header\n");
-	checkblock(heap_listp);
+		errors++;
+	}
+	errors += checkblock(heap_listp);
 
 	for (i = 0; i < NUM_HEAPS; i++) {
+		n = 0;
+		prev = NULL;
 		for (bp = (void *)beginning_heap[i]; bp; bp = (void *)GET(NEXT_PTR(bp))) {
+			if (bp < mem_heap_lo() || bp > mem_heap_hi()) {
+				printf("Error: %p on free list %d is outside "
+				    "the heap\n", bp, i);
+				errors++;
+				break;
+			}
 			if (verbose)
 				printblock(bp);
-			checkblock(bp);
+			errors += checkblock(bp);
+			if ((void *)GET(PREV_PTR(bp)) != prev) {
+				printf("Error: %p has a bad previous pointer\n",
+				    bp);
+				errors++;
+			}
+			if (GET_ALLOC(HDRP(bp))) {
+				printf("Error: %p on free list %d is allocated\n",
+				    bp, i);
+				errors++;
+			}
+			if (free_class(GET_SIZE(HDRP(bp))) != i) {
+				printf("Error: %p is on the wrong free list\n",
+				    bp);
+				errors++;
+			}
+			if (SLOT(bp) != SLOT_NONE &&
+			    (SLOT(bp) >= (uintptr_t)size_index[i].count ||
+			    size_index[i].blocks[SLOT(bp)] != bp ||
+			    size_index[i].sizes[SLOT(bp)] !=
+			    GET_SIZE(HDRP(bp)))) {
+				printf("Error: %p has a stale size index slot\n",
+				    bp);
+				errors++;
+			}
+			prev = bp;
+			n++;
+		}
+		if (n != size_index[i].count + size_index[i].spilled) {
+			printf("Error: free list %d has %d blocks, its size "
+			    "index %d\n", i, n,
+			    size_index[i].count + size_index[i].spilled);
+			errors++;
+		}
+	}
+
+	for (i = 0; i < coalesce_len; i++) {
+		bp = coalesce_queue[i];
+		if (GET_ALLOC(HDRP(bp)) ||
+		    GET_QUEUED(HDRP(bp)) != (uintptr_t)i + 1) {
+			printf("Error: %p has a stale coalescing queue "
+			    "position\n", bp);
+			errors++;
 		}
 	}
+	return (errors + checkspans() + checkhuge());
+}
+
 /*
-	if (verbose)
-		printblock(bp);
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Check that the free bytes counted per hugepage region are those of
+ *   the blocks on the free lists.  Returns the number of problems found,
+ *   each of which is also printed.
+ */
+static int
+checkhuge(void)
+{
+	size_t count[HUGE_REGIONS];
+	size_t r;
+	void *bp;
+	int i, errors = 0;
+
+	memcpy(count, huge_free, sizeof(count));
+	memset(huge_free, 0, sizeof(huge_free));
+	for (i = 0; i < NUM_HEAPS; i++) {
+		for (bp = (void *)beginning_heap[i]; bp;
+		    bp = (void *)GET(NEXT_PTR(bp)))
+			huge_account(bp, GET_SIZE(HDRP(bp)), true);
+	}
+	for (r = 0; r < HUGE_REGIONS; r++) {
+		if (count[r] != huge_free[r]) {
+			printf("Error: hugepage region %zu counts %zu free "
+			    "bytes, its blocks %zu\n", r, count[r],
+			    huge_free[r]);
+			errors++;
+		}
+	}
+	memcpy(huge_free, count, sizeof(count));
+	return (errors);
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Check that every span is on the list of its state and class, that the
+ *   page map sends each of its pages to it and that its objects add up,
+ *   and that the clean blocks are allocated and unmapped.  Returns the
+ *   number of problems found, each of which is also printed.
+ */
+static int
+checkspans(void)
+{
+	struct span *sp;
+	size_t i;
+	int a, c, l, n, w, errors = 0;
+
+	for (c = 0; c < SPAN_CLASSES; c++) {
+		for (l = 0; l < 2; l++) {
+			sp = l == 0 ? span_classes[c].partial :
+			    span_classes[c].full;
+			for (; sp != NULL; sp = sp->next) {
+				if (sp->sizeclass != c || sp->state != l ||
+				    (l == SPAN_FULL) !=
+				    (sp->inuse == sp->capacity)) {
+					printf("Error: span %p is on the wrong "
+					    "list\n", sp->start);
+					errors++;
+				}
+				for (i = 0; i < sp->npages *
+				    (sp->naliases + 1); i++) {
+					a = (int)(i / sp->npages);
+					if (pagemap_get((a == 0 ? sp->start :
+					    sp->alias[a - 1]) + i % sp->npages *
+					    SPAN_PAGE) != sp) {
+						printf("Error: page %zu of span "
+						    "%p is not mapped to it\n",
+						    i, sp->start);
+						errors++;
+						break;
+					}
+				}
+				if (!GET_ALLOC(HDRP(sp->start)) ||
+				    GET_SIZE(HDRP(sp->start)) <
+				    sp->npages * SPAN_PAGE + DSIZE) {
+					printf("Error: span %p has a bad block\n",
+					    sp->start);
+					errors++;
+				}
+				for (n = 0, w = 0; w < SPAN_WORDS; w++)
+					n += __builtin_popcountl(sp->used[w]);
+				if (n != sp->inuse || (sp->capacity <
+				    SPAN_WORDS * SPAN_BITS &&
+				    sp->used[sp->capacity / SPAN_BITS] >>
+				    sp->capacity % SPAN_BITS)) {
+					printf("Error: span %p has %d of %d "
+					    "objects marked in use\n", sp->start,
+					    n, sp->inuse);
+					errors++;
+				}
+			}
+		}
+	}
+	for (sp = span_clean; sp != NULL; sp = sp->next) {
+		if (!GET_ALLOC(HDRP(sp->start)) || GET_SIZE(HDRP(sp->start)) <
+		    sp->npages * SPAN_PAGE + DSIZE ||
+		    pagemap_get(sp->start) != NULL) {
+			printf("Error: clean block %p is in use\n", sp->start);
+			errors++;
+		}
+	}
+	return (errors);
+}
+
+/*
+ * Requires:
+ *   The central lock is held.
+ *
+ * Effects:
+ *   Print, per page heap class in use, the spans carved since the last
+ *   mm_init, the live spans and pages, the pages meshed into them and
+ *   the objects in use.
+ */
+static void
+print_spans(void)
+{
+	struct span *sp;
+	unsigned long live, pages, meshed, inuse, capacity;
+	int c, l;
 
-	if (GET_SIZE(HDRP(bp)) != 0 || !GET_ALLOC(HDRP(bp))) {
-		printf("Epilogue %p\n", bp);
-		printf("Bad epilogue header\n");
-	}*/
+	for (pages = 0, sp = span_clean; sp != NULL; sp = sp->next)
+		pages += sp->npages;
+	printf("Page heap: up to %zu bytes, %lu clean pages\n", span_max,
+	    pages);
+	printf("%5s %8s %8s %8s %6s %6s %10s\n", "class", "objsize",
+	    "carved", "live", "pages", "meshed", "inuse");
+	for (c = 0; c < SPAN_CLASSES; c++) {
+		if (span_classes[c].spans == 0)
+			continue;
+		live = pages = meshed = inuse = capacity = 0;
+		for (l = 0; l < 2; l++) {
+			sp = l == 0 ? span_classes[c].partial :
+			    span_classes[c].full;
+			for (; sp != NULL; sp = sp->next) {
+				live++;
+				pages += sp->npages;
+				meshed += sp->npages * sp->naliases;
+				inuse += sp->inuse;
+				capacity += sp->capacity;
+			}
+		}
+		printf("%5d %8zu %8lu %8lu %6lu %6lu %5lu/%-5lu\n", c,
+		    (size_t)(c + 1) * SPAN_ALIGN, span_classes[c].spans, live,
+		    pages, meshed, inuse, capacity);
+	}
 }
 
 /*
@@ -775,7 +4548,6 @@ printblock(void *bp)
 	bool halloc, falloc;
 	size_t hsize, fsize;
 
-	checkheap(false);
 	hsize = GET_SIZE(HDRP(bp));
 	halloc = GET_ALLOC(HDRP(bp));  
 	fsize = GET_SIZE(FTRP(bp));
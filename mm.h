@@ -7,6 +7,153 @@ int mm_init(void);
 void *mm_malloc(size_t size);
 void mm_free(void *ptr);
 void *mm_realloc(void *ptr, size_t size);
+
+/*
+ * Aligned allocation, and a free that is told the size and alignment of
+ * the request, as C++'s sized and aligned operator delete are.
+ */
+void *mm_memalign(size_t alignment, size_t size);
+void mm_free_sized(void *ptr, size_t size, size_t alignment);
+
+/*
+ * Allocation near a hint, such as the parent of a new tree node: the
+ * block comes from the hint's span or within a page of the hint if a
+ * free block is there, and from mm_malloc otherwise.
+ */
+struct mm_near_stats {
+    unsigned long requests; /* calls with a hint */
+    unsigned long near;     /* served close to the hint */
+};
+
+void *mm_malloc_near(size_t size, void *hint);
+void mm_get_near_stats(struct mm_near_stats *stats);
+
+/*
+ * Tagged allocation: mm_malloc_tagged charges the block to a tag from 1
+ * to MM_TAGS - 1, such as a subsystem's id, until it is freed or
+ * reallocated, and mm_get_tag_stats fills an array of MM_TAGS entries
+ * with what each tag holds now.  Entry 0 is unused.
+ */
+#define MM_TAGS 64
+
+struct mm_tag_stats {
+    long bytes;  /* block bytes live, with their overhead */
+    long blocks; /* blocks live */
+};
+
+void *mm_malloc_tagged(size_t size, int tag);
+void mm_get_tag_stats(struct mm_tag_stats *stats);
+
+/* Placement policies accepted by mm_set_fit_policy(). */
+#define MM_FIT_SEGREGATED_FIRST 0 /* head of the first non-empty class */
+#define MM_FIT_SEGREGATED_BEST  1 /* tightest fit found in the size index */
+#define MM_FIT_SEGREGATED_GOOD  2 /* near-exact fit among the first K blocks */
+#define MM_FIT_ADAPTIVE         3 /* one of the above, chosen by the workload */
+
+void mm_set_fit_policy(int policy);
+void mm_set_fit_depth(int depth);
+void mm_set_cache_colors(int colors);
+void mm_set_tcache_limit(size_t bytes);
+
+/*
+ * A thread whose request would grow the heap first steals the cached
+ * blocks that fit from the thread cache holding the most of them.
+ */
+struct mm_steal_stats {
+    unsigned long tries;  /* heap growths that looked for a victim */
+    unsigned long steals; /* tries that took blocks */
+    unsigned long blocks; /* blocks taken */
+    size_t bytes;         /* bytes taken */
+    size_t fits;          /* extensions skipped by steals that fit; an
+			     estimate, as the heap may grow later anyway */
+};
+
+void mm_set_tcache_steal(int on);
+
+/*
+ * How thread caches hand batches of blocks to each other, for
+ * mm_set_tcache_store().  Lock-free by default.
+ */
+#define MM_STORE_NONE     0 /* flush and refill through the central lists */
+#define MM_STORE_LOCKFREE 1 /* a lock-free stack of batches per class */
+#define MM_STORE_MUTEX    2 /* the same stacks behind one mutex */
+
+void mm_set_tcache_store(int mode);
+void mm_get_steal_stats(struct mm_steal_stats *stats);
+void mm_print_stats(void);
+
+/*
+ * Cycles spent in each phase of mm_malloc, mm_free and mm_realloc, by size
+ * class, counted only when mm.c is built with -DMM_PROFILE.
+ */
+void mm_profile_reset(void);
+void mm_profile_report(void);
+
+/* Coalescing modes accepted by mm_set_coalesce(), incremental by default. */
+#define MM_COALESCE_NONE        0 /* never merge free blocks */
+#define MM_COALESCE_IMMEDIATE   1 /* merge each block as it is freed */
+#define MM_COALESCE_DEFERRED    2 /* merge the whole heap on a fit miss */
+#define MM_COALESCE_INCREMENTAL 3 /* merge a few queued frees per call */
+
+void mm_set_coalesce(int mode, int budget);
+
+/*
+ * Serve requests of up to this many bytes from page spans of headerless
+ * objects, 0 (the default) to keep them in the boundary tag heap.
+ */
+void mm_set_page_heap(size_t max);
+
+/*
+ * Meshing folds page heap spans whose objects do not collide onto shared
+ * physical pages, every "period" span frees or on demand with mm_mesh.
+ */
+struct mm_mesh_stats {
+    unsigned long passes;    /* meshing passes run */
+    unsigned long meshed;    /* spans folded into another */
+    unsigned long pages;     /* physical pages given back */
+    unsigned long nsecs;     /* time spent in passes */
+    unsigned long max_nsecs; /* longest pass */
+};
+
+void mm_set_mesh(unsigned long period);
+unsigned long mm_mesh(void);
+void mm_get_mesh_stats(struct mm_mesh_stats *stats);
+
+/*
+ * The hugepage layer packs blocks into the fullest 2 MB regions of the
+ * heap and gives regions that become wholly free back to memlib.  It is
+ * turned on or off by mm_set_hugepage from the next mm_init.  The region
+ * counts are of the heap as it is now; the others are since mm_init.
+ */
+struct mm_huge_stats {
+    unsigned long returned;  /* hugepages given back */
+    unsigned long reused;    /* given back hugepages written again */
+    unsigned long regions;   /* hugepage regions the heap spans */
+    unsigned long dense;     /* regions at least 7/8 in use */
+};
+
+void mm_set_hugepage(int on);
+void mm_get_huge_stats(struct mm_huge_stats *stats);
+int mm_checkheap(int verbose);
+
+/*
+ * Heap limits.  Before the heap grows past the soft limit the allocator
+ * flushes the calling thread's cache, calls the pressure callbacks,
+ * coalesces free blocks and trims the heap; growth past the hard limit
+ * fails.  A limit of 0 is no limit.
+ */
+typedef void (*mm_pressure_fn)(size_t heapsize, void *arg);
+
+struct mm_limit_stats {
+    unsigned long soft;  /* times the soft limit was reached */
+    unsigned long hard;  /* heap extensions refused by the hard limit */
+    unsigned long merged;/* free blocks merged by reclamation */
+    size_t trimmed;      /* bytes given back by reclamation */
+};
+
+void mm_set_heap_limits(size_t soft, size_t hard);
+int mm_add_pressure_callback(mm_pressure_fn fn, void *arg);
+void mm_get_limit_stats(struct mm_limit_stats *stats);
 /* 
  * Students work in teams of one or two.  Teams enter their team name, personal
  * names and login IDs in a struct of this type in their mm.c file.
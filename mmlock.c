@@ -0,0 +1,91 @@
+/*
+ * mmlock.c - Registry and contention report for the allocator's locks.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "mmlock.h"
+
+#if defined(MM_LOCK_STATS)
+static mm_lock_t *locks;  /* registered locks, most recent first */
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * mm_lock_register - Add a lock to the set covered by mm_lock_report
+ */
+void mm_lock_register(mm_lock_t *lock)
+{
+#if defined(MM_LOCK_STATS)
+    pthread_mutex_lock(&registry);
+    if (!lock->registered) {
+	lock->registered = 1;
+	lock->next = locks;
+	locks = lock;
+    }
+    pthread_mutex_unlock(&registry);
+#else
+    (void)lock;
+#endif
+}
+
+/*
+ * mm_lock_reset - Clear the counters of all registered locks
+ */
+void mm_lock_reset(void)
+{
+#if defined(MM_LOCK_STATS)
+    mm_lock_t *l;
+
+    pthread_mutex_lock(&registry);
+    for (l = locks; l != NULL; l = l->next) {
+	mm_lock(l);
+	l->acquisitions = 0;
+	l->contended = 0;
+	l->wait_ns = 0;
+	memset(l->hist, 0, sizeof(l->hist));
+	mm_unlock(l);
+    }
+    pthread_mutex_unlock(&registry);
+#endif
+}
+
+/*
+ * mm_lock_report - Print acquisitions, contention and the wait time
+ *     histogram of every registered lock
+ */
+void mm_lock_report(void)
+{
+#if defined(MM_LOCK_STATS)
+    mm_lock_t *l;
+    unsigned long acq, cont, hist[MM_LOCK_BUCKETS];
+    unsigned long long ns;
+    int b, lo, hi;
+
+    printf("%-16s %12s %12s %7s %12s %10s\n", "lock", "acquired",
+	   "contended", "cont%", "wait(us)", "avg(ns)");
+    pthread_mutex_lock(&registry);
+    for (l = locks; l != NULL; l = l->next) {
+	/* Take a consistent snapshot under the lock itself */
+	pthread_mutex_lock(&l->mutex);
+	acq = l->acquisitions;
+	cont = l->contended;
+	ns = l->wait_ns;
+	memcpy(hist, l->hist, sizeof(hist));
+	pthread_mutex_unlock(&l->mutex);
+
+	printf("%-16s %12lu %12lu %6.2f%% %12.1f %10.0f\n", l->name, acq,
+	       cont, acq ? 100.0 * cont / acq : 0.0, ns / 1e3,
+	       cont ? (double)ns / cont : 0.0);
+	for (lo = 0; lo < MM_LOCK_BUCKETS && hist[lo] == 0; lo++)
+	    ;
+	for (hi = MM_LOCK_BUCKETS - 1; hi > lo && hist[hi] == 0; hi--)
+	    ;
+	for (b = lo; b <= hi && lo < MM_LOCK_BUCKETS; b++)
+	    printf("%16s < %10llu ns: %lu\n", "", 1ULL << b, hist[b]);
+    }
+    pthread_mutex_unlock(&registry);
+#else
+    printf("Lock statistics are not compiled in (build with "
+	   "-DMM_LOCK_STATS).\n");
+#endif
+}
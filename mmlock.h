@@ -0,0 +1,95 @@
+/*
+ * mmlock.h - Mutexes for the allocator's shared state, optionally
+ *     instrumented to show where threads wait.
+ *
+ * When MM_LOCK_STATS is defined, every lock counts its acquisitions and
+ * contended acquisitions and keeps a log2 histogram of the time spent
+ * waiting. The counters are only updated while the lock is held, so they
+ * need no atomics, and the uncontended path costs one extra trylock.
+ * Without MM_LOCK_STATS a lock is a plain pthread mutex.
+ */
+#ifndef __MMLOCK_H_
+#define __MMLOCK_H_
+
+#include <pthread.h>
+#if defined(MM_LOCK_STATS)
+#include <time.h>
+#endif
+
+#define MM_LOCK_BUCKETS 32  /* wait histogram: bucket b counts waits < 2^b ns */
+
+typedef struct mm_lock {
+    pthread_mutex_t mutex;
+    const char *name;
+#if defined(MM_LOCK_STATS)
+    unsigned long acquisitions;          /* all acquisitions */
+    unsigned long contended;             /* acquisitions that had to wait */
+    unsigned long long wait_ns;          /* total time spent waiting */
+    unsigned long hist[MM_LOCK_BUCKETS]; /* waits by power of two ns */
+    struct mm_lock *next;                /* registered locks */
+    int registered;
+#endif
+} mm_lock_t;
+
+#if defined(MM_LOCK_STATS)
+#define MM_LOCK_INITIALIZER(name) \
+    { PTHREAD_MUTEX_INITIALIZER, (name), 0, 0, 0, {0}, NULL, 0 }
+#else
+#define MM_LOCK_INITIALIZER(name) { PTHREAD_MUTEX_INITIALIZER, (name) }
+#endif
+
+/* Add a lock to the set covered by mm_lock_report (idempotent) */
+void mm_lock_register(mm_lock_t *lock);
+
+/* Print the contention report for all registered locks */
+void mm_lock_report(void);
+
+/* Clear the counters of all registered locks */
+void mm_lock_reset(void);
+
+#if defined(MM_LOCK_STATS)
+/*
+ * mm_lock_slow - Wait for a lock that trylock found busy and account for
+ *     the wait once it is held
+ */
+static inline void mm_lock_slow(mm_lock_t *lock)
+{
+    struct timespec t0, t1;
+    unsigned long long ns;
+    int b;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_mutex_lock(&lock->mutex);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+    for (b = 0; b < MM_LOCK_BUCKETS - 1 && (ns >> b) != 0; b++)
+	;
+    lock->contended++;
+    lock->wait_ns += ns;
+    lock->hist[b]++;
+}
+#endif
+
+/*
+ * mm_lock - Acquire a lock
+ */
+static inline void mm_lock(mm_lock_t *lock)
+{
+#if defined(MM_LOCK_STATS)
+    if (pthread_mutex_trylock(&lock->mutex) != 0)
+	mm_lock_slow(lock);
+    lock->acquisitions++;
+#else
+    pthread_mutex_lock(&lock->mutex);
+#endif
+}
+
+/*
+ * mm_unlock - Release a lock
+ */
+static inline void mm_unlock(mm_lock_t *lock)
+{
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+#endif /* __MMLOCK_H_ */
@@ -0,0 +1,188 @@
+/*
+ * mmnew.cc - Replacement of the global operator new and operator delete
+ *     for C++ programs linked with the mm malloc package.
+ *
+ * Linking this file into a program replaces every overload of the global
+ * operators at link time: plain, array, nothrow, sized and aligned. Unlike
+ * a malloc shim loaded with LD_PRELOAD, the sized and aligned overloads
+ * hand the size and alignment down, to mm_memalign and mm_free_sized, so
+ * a sized delete skips the page map lookup of mm_free.
+ *
+ * The simulated heap is set up by the first allocation, which may come
+ * from a static constructor that runs before main. Most C++ allocations
+ * are small nodes, so the page heap is turned on for every size it has;
+ * its objects are 16-byte aligned, which plain new needs.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <pthread.h>
+
+extern "C" {
+#include "memlib.h"
+#include "mm.h"
+}
+
+/* Alignment of plain new, and of new for sizes below it */
+#define NEW_ALIGN __STDCPP_DEFAULT_NEW_ALIGNMENT__
+
+static pthread_once_t new_once = PTHREAD_ONCE_INIT;
+
+/*
+ * new_init - Set up the simulated heap and the allocator, once
+ */
+static void new_init(void)
+{
+    mem_init();
+    mm_set_page_heap(SIZE_MAX);
+    mm_init();
+}
+
+/*
+ * new_alloc - Allocate size bytes aligned to align, calling the new
+ *     handler until it succeeds. Throws std::bad_alloc if there is no
+ *     handler.
+ */
+static void *new_alloc(std::size_t size, std::size_t align)
+{
+    std::new_handler handler;
+    void *p;
+
+    pthread_once(&new_once, new_init);
+    if (size == 0)
+	size = 1;
+    while ((p = mm_memalign(align, size)) == NULL) {
+	if ((handler = std::get_new_handler()) == NULL)
+	    throw std::bad_alloc();
+	handler();
+    }
+    return p;
+}
+
+/*
+ * new_alloc_nothrow - new_alloc, returning NULL rather than throwing
+ */
+static void *new_alloc_nothrow(std::size_t size, std::size_t align) noexcept
+{
+    try {
+	return new_alloc(size, align);
+    } catch (const std::bad_alloc &) {
+	return NULL;
+    }
+}
+
+/*
+ * new_free_sized - Free p, allocated by new_alloc for size bytes
+ *     aligned to align
+ */
+static void new_free_sized(void *p, std::size_t size,
+			   std::size_t align) noexcept
+{
+    mm_free_sized(p, size == 0 ? 1 : size, align);
+}
+
+void *operator new(std::size_t size)
+{
+    return new_alloc(size, NEW_ALIGN);
+}
+
+void *operator new[](std::size_t size)
+{
+    return new_alloc(size, NEW_ALIGN);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return new_alloc_nothrow(size, NEW_ALIGN);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return new_alloc_nothrow(size, NEW_ALIGN);
+}
+
+void *operator new(std::size_t size, std::align_val_t align)
+{
+    return new_alloc(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align)
+{
+    return new_alloc(size, static_cast<std::size_t>(align));
+}
+
+void *operator new(std::size_t size, std::align_val_t align,
+		   const std::nothrow_t &) noexcept
+{
+    return new_alloc_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align,
+		     const std::nothrow_t &) noexcept
+{
+    return new_alloc_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *p) noexcept
+{
+    mm_free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    mm_free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    mm_free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    mm_free(p);
+}
+
+void operator delete(void *p, std::size_t size) noexcept
+{
+    new_free_sized(p, size, NEW_ALIGN);
+}
+
+void operator delete[](void *p, std::size_t size) noexcept
+{
+    new_free_sized(p, size, NEW_ALIGN);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    mm_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept
+{
+    mm_free(p);
+}
+
+void operator delete(void *p, std::align_val_t,
+		     const std::nothrow_t &) noexcept
+{
+    mm_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t,
+		       const std::nothrow_t &) noexcept
+{
+    mm_free(p);
+}
+
+void operator delete(void *p, std::size_t size,
+		     std::align_val_t align) noexcept
+{
+    new_free_sized(p, size, static_cast<std::size_t>(align));
+}
+
+void operator delete[](void *p, std::size_t size,
+		       std::align_val_t align) noexcept
+{
+    new_free_sized(p, size, static_cast<std::size_t>(align));
+}
@@ -0,0 +1,54 @@
+/*
+ * pagemap.c - Three-level radix tree from pages to span descriptors.
+ */
+#include <stdint.h>
+#include <sys/mman.h>
+#include "pagemap.h"
+
+void **pagemap_root[PAGEMAP_NODE];
+
+/*
+ * node_alloc - Map a zeroed node of PAGEMAP_NODE pointers, or return NULL
+ */
+static void **node_alloc(void)
+{
+    void *p = mmap(NULL, PAGEMAP_NODE * sizeof(void *),
+		   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * pagemap_set - Map the npages pages from the one holding addr to value.
+ *     A new node is filled in before it is published, so that lookups
+ *     racing with the update never see a half-built path.
+ */
+int pagemap_set(const void *addr, size_t npages, void *value)
+{
+    uintptr_t page = (uintptr_t)addr >> PAGEMAP_SHIFT;
+    void ***mid, **leaf;
+
+    for (; npages > 0; npages--, page++) {
+	if (page >> (PAGEMAP_LEVELS * PAGEMAP_BITS))
+	    return -1;
+	mid = (void ***)&pagemap_root[page >> (2 * PAGEMAP_BITS)];
+	if (*mid == NULL) {
+	    if (value == NULL)
+		continue;
+	    if ((leaf = node_alloc()) == NULL)
+		return -1;
+	    __atomic_store_n(mid, leaf, __ATOMIC_RELEASE);
+	}
+	mid = (void ***)&(*mid)[(page >> PAGEMAP_BITS) & (PAGEMAP_NODE - 1)];
+	if (*mid == NULL) {
+	    if (value == NULL)
+		continue;
+	    if ((leaf = node_alloc()) == NULL)
+		return -1;
+	    __atomic_store_n(mid, leaf, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&(*mid)[page & (PAGEMAP_NODE - 1)], value,
+			 __ATOMIC_RELEASE);
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * pagemap.h - A radix tree that maps every page of the address space to
+ *     the allocator's descriptor of the span holding it.
+ *
+ * Page numbers of a 48-bit address space have 36 bits, which the tree
+ * splits into three levels of PAGEMAP_BITS bits. The root is static and
+ * the interior nodes and leaves are mmap'ed on first use, so the map costs
+ * memory only near the pages that were ever set. A lookup takes no lock
+ * and reads one word at each level; updates must be serialized by the
+ * caller.
+ */
+#ifndef __PAGEMAP_H_
+#define __PAGEMAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGEMAP_SHIFT 12                         /* log2 of the page size */
+#define PAGEMAP_PAGE  ((uintptr_t)1 << PAGEMAP_SHIFT)
+#define PAGEMAP_BITS  12                         /* index bits per level */
+#define PAGEMAP_NODE  ((uintptr_t)1 << PAGEMAP_BITS) /* entries per node */
+#define PAGEMAP_LEVELS 3
+
+/* Top level of the tree; use pagemap_get rather than reading it */
+extern void **pagemap_root[PAGEMAP_NODE];
+
+/*
+ * pagemap_set - Map the npages pages from the one holding addr to value,
+ *     NULL to unmap them. Returns -1 if a node could not be allocated.
+ */
+int pagemap_set(const void *addr, size_t npages, void *value);
+
+/*
+ * pagemap_get - Return the value the page holding addr maps to, or NULL
+ */
+static inline void *pagemap_get(const void *addr)
+{
+    uintptr_t page = (uintptr_t)addr >> PAGEMAP_SHIFT;
+    void **mid, **leaf;
+
+    if (page >> (PAGEMAP_LEVELS * PAGEMAP_BITS))
+	return NULL;
+    mid = __atomic_load_n(&pagemap_root[page >> (2 * PAGEMAP_BITS)],
+			  __ATOMIC_ACQUIRE);
+    if (mid == NULL)
+	return NULL;
+    leaf = __atomic_load_n((void ***)&mid[(page >> PAGEMAP_BITS) &
+					  (PAGEMAP_NODE - 1)],
+			   __ATOMIC_ACQUIRE);
+    if (leaf == NULL)
+	return NULL;
+    return __atomic_load_n(&leaf[page & (PAGEMAP_NODE - 1)],
+			   __ATOMIC_ACQUIRE);
+}
+
+#endif /* __PAGEMAP_H_ */
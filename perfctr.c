@@ -0,0 +1,117 @@
+/*
+ * perfctr.c - Count hardware events (cache and TLB misses) around a
+ *     test function using the Linux perf_event_open interface.
+ *
+ * Counters are opened once for the calling thread, user mode only. On
+ * systems without perf support (or when perf_event_paranoid forbids it)
+ * the affected events are simply reported as unavailable.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "perfctr.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+static int fds[PC_NEVENTS] = {-1, -1, -1, -1};
+static int initialized = 0;
+
+static const char *names[PC_NEVENTS] = {
+    "L1D-miss", "LLC-miss", "dTLB-miss", "faults"
+};
+
+#if defined(__linux__)
+/*
+ * open_event - Open one counter for the calling thread on any cpu
+ */
+static int open_event(unsigned type, unsigned long long config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Encode a hardware cache event */
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+#endif
+
+/*
+ * perfctr_init - Open every counter that the system lets us use
+ */
+int perfctr_init(void)
+{
+    int i, n = 0;
+
+    if (initialized)
+	goto count;
+    initialized = 1;
+#if defined(__linux__)
+    fds[PC_L1D_MISS] = open_event(PERF_TYPE_HW_CACHE,
+	CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+		    PERF_COUNT_HW_CACHE_RESULT_MISS));
+    fds[PC_LLC_MISS] = open_event(PERF_TYPE_HW_CACHE,
+	CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+		    PERF_COUNT_HW_CACHE_RESULT_MISS));
+    fds[PC_DTLB_MISS] = open_event(PERF_TYPE_HW_CACHE,
+	CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+		    PERF_COUNT_HW_CACHE_RESULT_MISS));
+    fds[PC_FAULTS] = open_event(PERF_TYPE_SOFTWARE,
+				PERF_COUNT_SW_PAGE_FAULTS);
+#endif
+ count:
+    for (i = 0; i < PC_NEVENTS; i++)
+	if (fds[i] >= 0)
+	    n++;
+    return n;
+}
+
+/*
+ * perfctr_measure - Run f(argp) once with every available counter enabled
+ */
+void perfctr_measure(perfctr_test_funct f, void *argp,
+		     long long counts[PC_NEVENTS])
+{
+    int i;
+
+    perfctr_init();
+#if defined(__linux__)
+    for (i = 0; i < PC_NEVENTS; i++) {
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+#endif
+    f(argp);
+    for (i = 0; i < PC_NEVENTS; i++) {
+	counts[i] = -1;
+#if defined(__linux__)
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	    if (read(fds[i], &counts[i], sizeof(counts[i])) !=
+		sizeof(counts[i]))
+		counts[i] = -1;
+	}
+#endif
+    }
+}
+
+/*
+ * perfctr_name - Return a short printable name for an event
+ */
+const char *perfctr_name(int event)
+{
+    return names[event];
+}
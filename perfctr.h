@@ -0,0 +1,25 @@
+/*
+ * perfctr.h - prototypes for the routines in perfctr.c that count
+ *     hardware events (cache and TLB misses) around a test function f
+ */
+
+/* The events we know how to count */
+#define PC_L1D_MISS   0  /* L1 data cache read misses */
+#define PC_LLC_MISS   1  /* last level cache read misses */
+#define PC_DTLB_MISS  2  /* data TLB read misses */
+#define PC_FAULTS     3  /* page faults (a software event) */
+#define PC_NEVENTS    4
+
+/* The test function takes a generic pointer as input */
+typedef void (*perfctr_test_funct)(void *);
+
+/* Open the counters; returns the number of events that are available */
+int perfctr_init(void);
+
+/* Count the events that occur while running f(argp) once. Unavailable
+   events are reported as -1. */
+void perfctr_measure(perfctr_test_funct f, void *argp,
+		     long long counts[PC_NEVENTS]);
+
+/* Return a short printable name for an event */
+const char *perfctr_name(int event);
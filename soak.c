@@ -0,0 +1,361 @@
+/*
+ * soak.c - Long-running randomized soak test for the mm malloc package
+ *
+ * Generates an endless, seeded stream of malloc/realloc/free requests
+ * with a bounded live set and a size mix that drifts slowly over time,
+ * so that fragmentation creep and throughput decay that the short
+ * bundled traces never expose become visible. Every payload is filled
+ * with a pattern that is verified before the block is freed or
+ * reallocated, mm_checkheap runs periodically, and one log line with
+ * throughput, heap size and utilization is printed every interval.
+ *
+ * If the simulated heap is exhausted, the event is logged and the heap
+ * is reset, so that a run can go on for hours.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* Defaults for the command line options */
+#define DEF_LIVE      4096     /* max live blocks */
+#define DEF_INTERVAL  10.0     /* seconds between log lines */
+#define DEF_CHECK     100000   /* ops between heap checks */
+#define DEF_PERIOD    5000000  /* ops per cycle of the size mix drift */
+
+/* Blocks the pressure callback of -L sheds and allocates again */
+#define STASH         16
+
+/* The size mix drifts between these powers of two */
+#define MIN_LOG2      3
+#define MAX_LOG2      12
+
+/* One live block */
+typedef struct {
+    unsigned char *p;  /* payload, or NULL if the slot is free */
+    size_t size;       /* payload size */
+    unsigned char tag; /* fill byte */
+} block_t;
+
+/* Run state shared by the routines below */
+static uint64_t rng;           /* xorshift64* state */
+static block_t *blocks;        /* the live set */
+static unsigned nlive;         /* number of live blocks */
+static size_t live_bytes;      /* payload bytes of the live blocks */
+static size_t peak_live;       /* high water mark of live_bytes */
+static unsigned long errors;   /* pattern and heap check failures */
+static void *stash[STASH];     /* held by the pressure callback */
+static unsigned long pressures;/* calls of the pressure callback */
+
+static void usage(void);
+static uint64_t next_random(void);
+static size_t next_size(unsigned long op, unsigned long period);
+static int check_block(block_t *b);
+static void fill_block(block_t *b);
+static void reset_heap(unsigned live);
+static void pressure(size_t heapsize, void *arg);
+static double now(void);
+
+int main(int argc, char **argv)
+{
+    int c;
+    uint64_t seed = 1;
+    unsigned max_live = DEF_LIVE;
+    double interval = DEF_INTERVAL, duration = 0;
+    unsigned long check = DEF_CHECK, period = DEF_PERIOD;
+    unsigned long max_ops = 0, op, last_ops = 0, resets = 0, checks = 0;
+    double start, last, t;
+    unsigned slot;
+    block_t *b;
+    void *p;
+    uint64_t r;
+
+    while ((c = getopt(argc, argv, "s:l:i:c:d:n:P:p:S:M:L:m:Uh")) != EOF) {
+        switch (c) {
+	case 's': /* Seed of the request stream */
+	    seed = strtoull(optarg, NULL, 0);
+	    break;
+	case 'l': /* Bound on the live set */
+	    max_live = atoi(optarg);
+	    break;
+	case 'i': /* Seconds between log lines */
+	    interval = atof(optarg);
+	    break;
+	case 'c': /* Ops between heap checks (0 = never) */
+	    check = strtoul(optarg, NULL, 0);
+	    break;
+	case 'd': /* Stop after this many seconds */
+	    duration = atof(optarg);
+	    break;
+	case 'n': /* Stop after this many ops */
+	    max_ops = strtoul(optarg, NULL, 0);
+	    break;
+	case 'P': /* Ops per cycle of the size mix drift */
+	    period = strtoul(optarg, NULL, 0);
+	    break;
+	case 'S': /* Serve small requests from the page heap */
+	    mm_set_page_heap(strtoul(optarg, NULL, 0));
+	    break;
+	case 'M': /* Span frees between meshing passes */
+	    mm_set_mesh(strtoul(optarg, NULL, 0));
+	    break;
+	case 'L': /* Soft heap limit, with a callback that allocates */
+	    mm_set_heap_limits(strtoul(optarg, NULL, 0), 0);
+	    if (mm_add_pressure_callback(pressure, NULL) < 0) {
+		fprintf(stderr, "mm_add_pressure_callback failed\n");
+		exit(1);
+	    }
+	    break;
+	case 'm': /* Cap on the bytes held in thread caches */
+	    mm_set_tcache_limit(strtoul(optarg, NULL, 0));
+	    break;
+	case 'U': /* Hugepage backed heap and placement */
+	    mem_set_hugepages(1);
+	    mm_set_hugepage(1);
+	    break;
+	case 'p': /* Placement policy */
+	    if (!strcmp(optarg, "best"))
+		mm_set_fit_policy(MM_FIT_SEGREGATED_BEST);
+	    else if (!strcmp(optarg, "good"))
+		mm_set_fit_policy(MM_FIT_SEGREGATED_GOOD);
+	    else if (!strcmp(optarg, "first"))
+		mm_set_fit_policy(MM_FIT_SEGREGATED_FIRST);
+	    else if (!strcmp(optarg, "adaptive"))
+		mm_set_fit_policy(MM_FIT_ADAPTIVE);
+	    else {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (max_live == 0 || period == 0) {
+	usage();
+	exit(1);
+    }
+
+    rng = seed ? seed : 1;
+    if ((blocks = calloc(max_live, sizeof(block_t))) == NULL) {
+	fprintf(stderr, "calloc failed in main\n");
+	exit(1);
+    }
+    mem_init();
+    reset_heap(max_live);
+
+    printf("# seed %llu, live set %u, check every %lu ops\n",
+	   (unsigned long long)seed, max_live, check);
+    printf("#%9s %12s %10s %10s %12s %12s %6s %8s %6s %6s\n", "secs", "ops",
+	   "Kops", "heap", "live", "peak", "util", "checks", "errors",
+	   "resets");
+    start = last = now();
+
+    for (op = 0; max_ops == 0 || op < max_ops; op++) {
+	/*
+	 * Pick a random slot. A live slot is freed or, one time in eight,
+	 * reallocated; an empty slot is filled. The live set thus hovers
+	 * around half of max_live without ever exceeding it.
+	 */
+	r = next_random();
+	slot = r % max_live;
+	b = &blocks[slot];
+	if (b->p == NULL) {
+	    b->size = next_size(op, period);
+	    if ((b->p = mm_malloc(b->size)) == NULL)
+		goto exhausted;
+	    b->tag = (unsigned char)(r >> 32);
+	    fill_block(b);
+	    nlive++;
+	    live_bytes += b->size;
+	} else if (((r >> 40) & 7) == 0) {
+	    errors += check_block(b);
+	    live_bytes -= b->size;
+	    b->size = next_size(op, period);
+	    if ((p = mm_realloc(b->p, b->size)) == NULL) {
+		b->p = NULL;
+		nlive--;
+		goto exhausted;
+	    }
+	    b->p = p;
+	    fill_block(b);
+	    live_bytes += b->size;
+	} else {
+	    errors += check_block(b);
+	    mm_free(b->p);
+	    b->p = NULL;
+	    nlive--;
+	    live_bytes -= b->size;
+	}
+	if (live_bytes > peak_live)
+	    peak_live = live_bytes;
+	goto next;
+
+    exhausted:
+	printf("# heap exhausted after %lu ops (heap %zu, live %zu), "
+	       "resetting\n", op, mem_heapsize(), live_bytes);
+	resets++;
+	reset_heap(max_live);
+
+    next:
+	if (check && (op + 1) % check == 0) {
+	    errors += mm_checkheap(0);
+	    checks++;
+	}
+
+	/* Look at the clock only every 1024 ops */
+	if ((op & 1023) == 0 && (t = now()) - last >= interval) {
+	    printf("%10.1f %12lu %10.0f %10zu %12zu %12zu %5.1f%% %8lu "
+		   "%6lu %6lu\n", t - start, op + 1,
+		   (op + 1 - last_ops) / 1e3 / (t - last), mem_heapsize(),
+		   live_bytes, peak_live,
+		   100.0 * peak_live / (mem_heapsize() ? mem_heapsize() : 1),
+		   checks, errors, resets);
+	    fflush(stdout);
+	    last = t;
+	    last_ops = op + 1;
+	    if (duration > 0 && t - start >= duration)
+		break;
+	}
+    }
+
+    printf("# %lu ops, %lu errors, %lu resets, %lu pressure callbacks\n",
+	   op, errors, resets, pressures);
+    mem_deinit();
+    exit(errors ? 1 : 0);
+}
+
+/*
+ * next_random - xorshift64*: fast and good enough for a request stream
+ */
+static uint64_t next_random(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ULL;
+}
+
+/*
+ * next_size - Draw a payload size. Sizes are log-uniform over a two
+ *     octave window whose centre drifts between 2^MIN_LOG2 and
+ *     2^MAX_LOG2 and back once per period ops.
+ */
+static size_t next_size(unsigned long op, unsigned long period)
+{
+    double phase = (double)(op % period) / period;
+    double centre = MIN_LOG2 + 1 +
+	(MAX_LOG2 - MIN_LOG2 - 2) * (0.5 - 0.5 * cos(2 * M_PI * phase));
+    double u = (double)(next_random() >> 11) / (double)(1ULL << 53);
+    size_t size = (size_t)exp2(centre - 1 + 2 * u);
+
+    return size ? size : 1;
+}
+
+/*
+ * fill_block - Fill a payload with its tag
+ */
+static void fill_block(block_t *b)
+{
+    memset(b->p, b->tag, b->size);
+}
+
+/*
+ * check_block - Verify the pattern at both ends of a payload. Returns 1
+ *     and reports the block if it was overwritten.
+ */
+static int check_block(block_t *b)
+{
+    size_t n = b->size < 16 ? b->size : 16;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	if (b->p[i] != b->tag || b->p[b->size - 1 - i] != b->tag) {
+	    printf("# payload %p (%zu bytes) was overwritten\n",
+		   (void *)b->p, b->size);
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * pressure - The pressure callback of -L. Like an application cache it
+ *     sheds its blocks and builds them up again, so that the allocator
+ *     is entered from inside its own reclamation path.
+ */
+static void pressure(size_t heapsize, void *arg)
+{
+    int i;
+
+    (void)heapsize;
+    (void)arg;
+    pressures++;
+    for (i = 0; i < STASH; i++) {
+	mm_free(stash[i]);
+	stash[i] = mm_malloc(8 << (i % 4));
+    }
+}
+
+/*
+ * reset_heap - Forget the live set and start over with an empty heap
+ */
+static void reset_heap(unsigned live)
+{
+    memset(blocks, 0, live * sizeof(block_t));
+    memset(stash, 0, sizeof(stash));
+    nlive = 0;
+    live_bytes = 0;
+    peak_live = 0;
+    mem_reset_brk();
+    if (mm_init() < 0) {
+	fprintf(stderr, "mm_init failed\n");
+	exit(1);
+    }
+}
+
+/*
+ * now - Wall clock time in seconds
+ */
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: soak [-h] [-s <seed>] [-l <live>] [-i <secs>] "
+	    "[-c <ops>] [-d <secs>] [-n <ops>] [-P <ops>] [-p <policy>]"
+	    " [-S <bytes>] [-M <frees>] [-L <bytes>] [-m <bytes>] [-U]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-c <ops>    Run mm_checkheap every <ops> ops (0 = never).\n");
+    fprintf(stderr, "\t-d <secs>   Stop after <secs> seconds (default: never).\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+    fprintf(stderr, "\t-i <secs>   Seconds between log lines.\n");
+    fprintf(stderr, "\t-L <bytes>  Soft heap limit, with a pressure callback that frees\n\t            and allocates blocks.\n");
+    fprintf(stderr, "\t-l <live>   Bound on the number of live blocks.\n");
+    fprintf(stderr, "\t-m <bytes>  Cap on the bytes held in thread caches (0 disables them).\n");
+    fprintf(stderr, "\t-M <frees>  Mesh the page spans every <frees> span frees.\n");
+    fprintf(stderr, "\t-n <ops>    Stop after <ops> ops (default: never).\n");
+    fprintf(stderr, "\t-P <ops>    Ops per cycle of the size mix drift.\n");
+    fprintf(stderr, "\t-p <policy> Placement policy: first, best, good or\n\t            adaptive.\n");
+    fprintf(stderr, "\t-S <bytes>  Serve requests up to <bytes> from page spans.\n");
+    fprintf(stderr, "\t-s <seed>   Seed of the request stream.\n");
+    fprintf(stderr, "\t-U          Back the heap with hugepages and pack blocks into them.\n");
+}
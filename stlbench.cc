@@ -0,0 +1,412 @@
+/*
+ * stlbench.cc - Allocation-heavy STL workloads, to compare the mm malloc
+ *     package behind operator new (stlbench, linked with mmnew.o) with
+ *     the C++ runtime's own (stlbench-libc)
+ *
+ * Every workload builds and tears down a container of -n elements -r
+ * times, in each of -t threads at once, and one line with its wall time
+ * and throughput in allocations is printed per workload. Each thread
+ * sums what it reads back, so that the work cannot be optimized away.
+ *
+ * The simulated heap is MAX_HEAP bytes shared by every thread, so -n
+ * times -t must stay well below what the C++ runtime's own allocator
+ * would take: with the defaults, 2 threads already peak near MAX_HEAP.
+ * A workload that runs out of heap in some thread is reported as out
+ * of memory rather than timed, and the rest still run.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+/* Defined only when the mm package is linked in */
+extern "C" size_t mem_heappeak(void) __attribute__((weak));
+
+/* Defaults for the command line options */
+#define DEF_ELEMENTS  10000  /* elements per container */
+#define DEF_ROUNDS    10     /* containers built per thread */
+#define DEF_THREADS   1
+
+/* One workload: builds and frees a container, returns a checksum */
+typedef struct {
+    const char *name;
+    unsigned long (*run)(unsigned n, unsigned seed);
+    unsigned allocs;  /* allocations per element */
+} workload_t;
+
+/* Holds the params to each thread of run_workload */
+typedef struct {
+    const workload_t *w;
+    unsigned n, rounds, seed;
+    pthread_barrier_t *start;   /* released when every thread is ready */
+    double t0, t1;              /* when this thread started and finished */
+    unsigned long sum;          /* checksum of every round */
+    int oom;                    /* set if operator new threw bad_alloc */
+} thread_t;
+
+/* A cache line sized object, allocated through aligned operator new */
+struct alignas(64) line_t {
+    unsigned long words[8];
+};
+
+static void usage(void);
+static unsigned long run_map(unsigned n, unsigned seed);
+static unsigned long run_unordered(unsigned n, unsigned seed);
+static unsigned long run_list(unsigned n, unsigned seed);
+static unsigned long run_vectors(unsigned n, unsigned seed);
+static unsigned long run_strings(unsigned n, unsigned seed);
+static unsigned long run_shared(unsigned n, unsigned seed);
+static unsigned long run_aligned(unsigned n, unsigned seed);
+static void *workload_thread(void *ptr);
+static void check_new(void);
+static double now(void);
+
+static const workload_t workloads[] = {
+    {"map<int,string>",   run_map,       2},
+    {"unordered_map",     run_unordered, 1},
+    {"list<int>",         run_list,      1},
+    {"vector<vector>",    run_vectors,   3},
+    {"string append",     run_strings,   1},
+    {"make_shared",       run_shared,    1},
+    {"aligned new",       run_aligned,   1},
+};
+
+int main(int argc, char **argv)
+{
+    unsigned n = DEF_ELEMENTS, rounds = DEF_ROUNDS, nthreads = DEF_THREADS;
+    unsigned i, t;
+    std::vector<pthread_t> tids;
+    std::vector<thread_t> args;
+    pthread_barrier_t start;
+    unsigned long sum = 0;
+    double t0, t1, secs, allocs;
+    unsigned oom, failed = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:r:t:h")) != EOF) {
+	switch (c) {
+	case 'n': /* Elements per container */
+	    n = atoi(optarg);
+	    break;
+	case 'r': /* Containers built per thread */
+	    rounds = atoi(optarg);
+	    break;
+	case 't': /* Threads running each workload at once */
+	    nthreads = atoi(optarg);
+	    break;
+	case 'h': /* Print this message */
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (n == 0 || rounds == 0 || nthreads == 0) {
+	usage();
+	exit(1);
+    }
+
+    if (mem_heappeak != NULL)
+	check_new();
+    tids.resize(nthreads);
+    args.resize(nthreads);
+    printf("%u threads, %u rounds of %u elements, operator new from %s\n",
+	   nthreads, rounds, n, mem_heappeak != NULL ? "mm" : "libc");
+    printf("%-18s %10s %10s\n", "workload", "secs", "Kallocs/s");
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+	for (t = 0; t < nthreads; t++) {
+	    args[t].w = &workloads[i];
+	    args[t].n = n;
+	    args[t].rounds = rounds;
+	    args[t].seed = t + 1;
+	    args[t].start = &start;
+	    args[t].sum = 0;
+	    args[t].oom = 0;
+	    if (pthread_create(&tids[t], NULL, workload_thread, &args[t])) {
+		perror("pthread_create");
+		exit(1);
+	    }
+	}
+	pthread_barrier_wait(&start);
+	t0 = 1e30;
+	t1 = 0;
+	for (oom = 0, t = 0; t < nthreads; t++) {
+	    pthread_join(tids[t], NULL);
+	    oom += args[t].oom;
+	    sum += args[t].sum;
+	    if (args[t].t0 < t0)
+		t0 = args[t].t0;
+	    if (args[t].t1 > t1)
+		t1 = args[t].t1;
+	}
+	secs = t1 - t0;
+	pthread_barrier_destroy(&start);
+	if (oom > 0) {
+	    printf("%-18s %10s %10s  (%u threads out of memory)\n",
+		   workloads[i].name, "-", "-", oom);
+	    failed++;
+	    continue;
+	}
+	allocs = (double)workloads[i].allocs * n * rounds * nthreads;
+	printf("%-18s %10.4f %10.0f\n", workloads[i].name, secs,
+	       secs > 0 ? allocs / 1e3 / secs : 0.0);
+    }
+    if (mem_heappeak != NULL)
+	printf("Heap peak: %zu KB\n", mem_heappeak() / 1024);
+    printf("Checksum: %lu\n", sum);
+    if (failed > 0)
+	printf("%u workloads ran out of memory; lower -n or -t\n", failed);
+    return 0;
+}
+
+/*
+ * workload_thread - Run one workload for the given number of rounds,
+ *     giving up if operator new throws std::bad_alloc
+ */
+static void *workload_thread(void *ptr)
+{
+    thread_t *arg = static_cast<thread_t *>(ptr);
+    unsigned r;
+
+    pthread_barrier_wait(arg->start);
+    arg->t0 = now();
+    try {
+	for (r = 0; r < arg->rounds; r++)
+	    arg->sum += arg->w->run(arg->n, arg->seed + r);
+    } catch (const std::bad_alloc &) {
+	arg->oom = 1;
+    }
+    arg->t1 = now();
+    return NULL;
+}
+
+/*
+ * check_new - Check that requests too large for any heap, including ones
+ *     whose size would wrap once the allocator adds its overhead, make
+ *     operator new throw std::bad_alloc and its nothrow form return NULL,
+ *     plain and aligned alike. Exits if one returns a block. Only the
+ *     mm package is checked, as some C++ runtimes round the size of an
+ *     aligned request up before they check it.
+ */
+static void check_new(void)
+{
+    static const std::size_t sizes[] = {SIZE_MAX, SIZE_MAX - 15,
+					SIZE_MAX - 64, SIZE_MAX / 2 + 1};
+    volatile std::size_t size;
+    unsigned i, a, failed = 0;
+    void *p;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	size = sizes[i];
+	for (a = 0; a < 2; a++) {
+	    try {
+		p = a ? ::operator new(size, std::align_val_t(64)) :
+		    ::operator new(size);
+	    } catch (const std::bad_alloc &) {
+		p = NULL;
+	    }
+	    if (p == NULL)
+		p = a ? ::operator new(size, std::align_val_t(64),
+				       std::nothrow) :
+		    ::operator new(size, std::nothrow);
+	    if (p != NULL) {
+		fprintf(stderr, "%soperator new(%zu) returned %p\n",
+			a ? "aligned " : "", (std::size_t)size, p);
+		failed++;
+	    }
+	}
+    }
+    if (failed)
+	exit(1);
+}
+
+/*
+ * run_map - Insert n random keys with heap allocated strings into an
+ *     ordered map, then erase them in another order
+ */
+static unsigned long run_map(unsigned n, unsigned seed)
+{
+    std::map<int, std::string> m;
+    unsigned long sum = 0;
+    unsigned i, s = seed;
+
+    for (i = 0; i < n; i++)
+	m.emplace(rand_r(&s), std::string(24 + i % 16, 'a' + i % 26));
+    for (auto &kv : m)
+	sum += kv.second.size();
+    s = seed;
+    for (i = 0; i < n; i += 2)
+	m.erase(rand_r(&s));
+    return sum + m.size();
+}
+
+/*
+ * run_unordered - Insert and erase n keys of a hash map that grows its
+ *     bucket array as it goes
+ */
+static unsigned long run_unordered(unsigned n, unsigned seed)
+{
+    std::unordered_map<unsigned, unsigned> m;
+    unsigned long sum = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+	m[i * 2654435761u + seed] = i;
+    for (i = 0; i < n; i += 3)
+	sum += m.erase(i * 2654435761u + seed);
+    return sum + m.size();
+}
+
+/*
+ * run_list - Push n nodes onto a list, splice out every other one and
+ *     free the rest
+ */
+static unsigned long run_list(unsigned n, unsigned seed)
+{
+    std::list<unsigned> l;
+    unsigned long sum = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+	l.push_back(i ^ seed);
+    for (auto it = l.begin(); it != l.end(); ) {
+	sum += *it;
+	it = l.erase(it);
+	if (it != l.end())
+	    ++it;
+    }
+    return sum + l.size();
+}
+
+/*
+ * run_vectors - Grow n small vectors of random length by push_back, so
+ *     that each reallocates a few times
+ */
+static unsigned long run_vectors(unsigned n, unsigned seed)
+{
+    std::vector<std::vector<unsigned>> v;
+    unsigned long sum = 0;
+    unsigned i, j, len, s = seed;
+
+    for (i = 0; i < n; i++) {
+	v.emplace_back();
+	len = 1 + rand_r(&s) % 12;
+	for (j = 0; j < len; j++)
+	    v.back().push_back(j);
+    }
+    for (auto &e : v)
+	sum += e.size();
+    return sum;
+}
+
+/*
+ * run_strings - Build n strings by appending to them, as a formatter
+ *     does
+ */
+static unsigned long run_strings(unsigned n, unsigned seed)
+{
+    std::vector<std::string> v;
+    unsigned long sum = 0;
+    unsigned i;
+
+    v.reserve(n);
+    for (i = 0; i < n; i++) {
+	std::string s = "key-";
+	s += std::to_string(i + seed);
+	s += "-value-";
+	s += std::to_string(i * 7);
+	v.push_back(std::move(s));
+    }
+    for (auto &s : v)
+	sum += s.size();
+    return sum;
+}
+
+/*
+ * run_shared - Make n shared objects, copy the pointers around and drop
+ *     them
+ */
+static unsigned long run_shared(unsigned n, unsigned seed)
+{
+    std::vector<std::shared_ptr<std::uint64_t>> v, w;
+    unsigned long sum = 0;
+    unsigned i;
+
+    v.reserve(n);
+    for (i = 0; i < n; i++)
+	v.push_back(std::make_shared<std::uint64_t>(i + seed));
+    w.assign(v.rbegin(), v.rend());
+    v.clear();
+    for (auto &p : w)
+	sum += *p;
+    return sum;
+}
+
+/*
+ * run_aligned - Allocate n cache line aligned objects through the
+ *     aligned operator new and free them through the aligned delete
+ */
+static unsigned long run_aligned(unsigned n, unsigned seed)
+{
+    std::vector<std::unique_ptr<line_t>> v;
+    unsigned long sum = 0;
+    unsigned i;
+
+    v.reserve(n);
+    for (i = 0; i < n; i++) {
+	v.emplace_back(new line_t());
+	v.back()->words[0] = i + seed;
+    }
+    for (auto &p : v) {
+	if ((std::uintptr_t)p.get() % alignof(line_t) != 0) {
+	    fprintf(stderr, "aligned new returned %p\n", (void *)p.get());
+	    exit(1);
+	}
+	sum += p->words[0];
+    }
+    return sum;
+}
+
+/*
+ * now - Return the wall clock time in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: stlbench [-h] [-n <elements>] [-r <rounds>] "
+	    "[-t <threads>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h             Print this message.\n");
+    fprintf(stderr, "\t-n <elements>  Elements per container (default %d).\n",
+	    DEF_ELEMENTS);
+    fprintf(stderr, "\t-r <rounds>    Containers built per thread "
+	    "(default %d).\n", DEF_ROUNDS);
+    fprintf(stderr, "\t-t <threads>   Threads running each workload at once "
+	    "(default %d).\n", DEF_THREADS);
+    fprintf(stderr, "The mm heap is %d MB shared by every thread; with the "
+	    "default -n and -r\nit holds 2 threads, and a workload that "
+	    "runs out is reported as out of memory.\n", MAX_HEAP >> 20);
+}
@@ -0,0 +1,378 @@
+/*
+ * trace.c - Read, write and transform allocator traces.
+ *
+ * Traces may also be packed by write_trace_packed in tracepack.c, which
+ * read_trace recognizes.
+ *
+ * The transformations build new traces from old ones: scale the request
+ * sizes, replicate the id space so that the live set grows, concatenate
+ * or splice (interleave) traces, and renumber the ids densely. Every
+ * result is finished by finish_trace, which recomputes the header and
+ * the per-id sequence numbers, so that a trace written out is always
+ * readable by read_trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "trace.h"
+
+#define MAXLINE     1024 /* max string size */
+
+static void trace_error(char *msg);
+
+/*
+ * alloc_trace - Allocate a trace with room for num_ids ids and num_ops
+ *     ops. The header fields other than the counts are zero.
+ */
+trace_t *alloc_trace(unsigned num_ids, unsigned num_ops)
+{
+    trace_t *trace;
+
+    if ((trace = (trace_t *) calloc(1, sizeof(trace_t))) == NULL)
+	trace_error("calloc 1 failed in alloc_trace");
+    trace->num_ids = num_ids;
+    trace->num_ops = num_ops;
+    trace->num_threads = 1;
+    
+    /* We'll store each request line in the trace in this array */
+    if ((trace->ops = 
+	 (traceop_t *)calloc(num_ops ? num_ops : 1, sizeof(traceop_t))) == NULL)
+	trace_error("calloc 2 failed in alloc_trace");
+
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks = 
+	 (char **)calloc(num_ids ? num_ids : 1, sizeof(char *))) == NULL)
+	trace_error("calloc 3 failed in alloc_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes = 
+	 (size_t *)calloc(num_ids ? num_ids : 1, sizeof(size_t))) == NULL)
+	trace_error("calloc 4 failed in alloc_trace");
+    return trace;
+}
+
+/*
+ * read_trace - read a trace file and store it in memory. A packed trace
+ *     is handed to read_trace_packed.
+ */
+trace_t *read_trace(char *tracedir, char *filename)
+{
+    FILE *tracefile;
+    trace_t *trace;
+    char type[MAXLINE];
+    char path[MAXLINE];
+    char msg[MAXLINE];
+    unsigned sugg_heapsize, num_ids, num_ops, weight;
+    unsigned index, size;
+    unsigned max_index = 0;
+    unsigned op_index;
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    char *op;
+    int tid;
+
+    /* Read the trace file header */
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if ((tracefile = fopen(path, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in read_trace", path);
+	trace_error(msg);
+    }
+    if (fread(magic, 1, sizeof(magic), tracefile) == sizeof(magic) &&
+	memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+	trace = read_trace_packed(tracefile, path);
+	fclose(tracefile);
+	return trace;
+    }
+    rewind(tracefile);
+    if (fscanf(tracefile, "%u %u %u %u", &sugg_heapsize, &num_ids,
+	       &num_ops, &weight) != 4) {
+	printf("Bad header in tracefile %s\n", path);
+	exit(1);
+    }
+    trace = alloc_trace(num_ids, num_ops);
+    trace->sugg_heapsize = sugg_heapsize; /* not used */
+    trace->weight = weight;               /* not used */
+    
+    /* 
+     * read every request line in the trace file. A request may be
+     * prefixed with the tag of the thread that made it, as in "3:f 17".
+     */
+    index = 0;
+    op_index = 0;
+    while (fscanf(tracefile, "%s", type) != EOF) {
+	if (op_index >= num_ops) {
+	    printf("More than %u ops in tracefile %s\n", num_ops, path);
+	    exit(1);
+	}
+	tid = 0;
+	op = type;
+	if (strchr(type, ':') != NULL) {
+	    tid = atoi(type);
+	    op = strchr(type, ':') + 1;
+	    if (tid < 0) {
+		printf("Bogus thread tag (%s) in tracefile %s\n", type, path);
+		exit(1);
+	    }
+	}
+	trace->ops[op_index].tid = tid;
+	switch(op[0]) {
+	case 'a':
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = ALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'r':
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = REALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'f':
+	    fscanf(tracefile, "%ud", &index);
+	    trace->ops[op_index].type = FREE;
+	    trace->ops[op_index].index = index;
+	    break;
+	default:
+	    printf("Bogus type character (%c) in tracefile %s\n", 
+		   op[0], path);
+	    exit(1);
+	}
+	op_index++;
+	
+    }
+    fclose(tracefile);
+    assert(max_index == trace->num_ids - 1);
+    assert(trace->num_ops == op_index);
+
+    finish_trace(trace);
+    return trace;
+}
+
+/*
+ * write_trace - Write a trace in the format read by read_trace. Thread
+ *     tags are written only if the trace has more than one thread.
+ *     Returns 0, or -1 if the write failed.
+ */
+int write_trace(FILE *fp, trace_t *trace)
+{
+    traceop_t *op;
+    unsigned i;
+
+    fprintf(fp, "%u\n%u\n%u\n%u\n", trace->sugg_heapsize, trace->num_ids,
+	    trace->num_ops, trace->weight);
+    for (i = 0; i < trace->num_ops; i++) {
+	op = &trace->ops[i];
+	if (trace->num_threads > 1)
+	    fprintf(fp, "%d:", op->tid);
+	switch (op->type) {
+	case ALLOC:
+	    fprintf(fp, "a %d %d\n", op->index, op->size);
+	    break;
+	case REALLOC:
+	    fprintf(fp, "r %d %d\n", op->index, op->size);
+	    break;
+	case FREE:
+	    fprintf(fp, "f %d\n", op->index);
+	    break;
+	}
+    }
+    return (fflush(fp) == 0 && !ferror(fp)) ? 0 : -1;
+}
+
+/*
+ * free_trace - Free the trace record and the three arrays it points
+ *              to, all of which were allocated in alloc_trace().
+ */
+void free_trace(trace_t *trace)
+{
+    free(trace->ops);         /* free the three arrays... */
+    free(trace->blocks);      
+    free(trace->block_sizes);
+    free(trace);              /* and the trace record itself... */
+}
+
+/*
+ * trace_scale - Multiply every request size by factor, rounding to the
+ *     nearest byte and never below one byte
+ */
+trace_t *trace_scale(trace_t *trace, double factor)
+{
+    trace_t *t = alloc_trace(trace->num_ids, trace->num_ops);
+    double size;
+    unsigned i;
+
+    memcpy(t->ops, trace->ops, trace->num_ops * sizeof(traceop_t));
+    for (i = 0; i < t->num_ops; i++) {
+	if (t->ops[i].type == FREE)
+	    continue;
+	size = t->ops[i].size * factor + 0.5;
+	if (size > 0x7fffffff) {
+	    printf("Scaled size %.0f is too large\n", size);
+	    exit(1);
+	}
+	t->ops[i].size = size < 1 ? 1 : (int)size;
+    }
+    t->sugg_heapsize = trace->sugg_heapsize * factor;
+    t->weight = trace->weight;
+    finish_trace(t);
+    return t;
+}
+
+/*
+ * trace_replicate - Make copies of the id space and interleave them: each
+ *     op is issued copies times in a row, copy k on id index + k *
+ *     num_ids. The live set and the op count grow copies times, while
+ *     the order of the requests on each id stays the same.
+ */
+trace_t *trace_replicate(trace_t *trace, unsigned copies)
+{
+    trace_t *t = alloc_trace(trace->num_ids * copies,
+			     trace->num_ops * copies);
+    unsigned i, k;
+    traceop_t *op;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	for (k = 0; k < copies; k++) {
+	    op = &t->ops[i * copies + k];
+	    *op = trace->ops[i];
+	    op->index += k * trace->num_ids;
+	}
+    }
+    t->sugg_heapsize = trace->sugg_heapsize * copies;
+    t->weight = trace->weight;
+    finish_trace(t);
+    return t;
+}
+
+/*
+ * trace_concat - Run n traces one after the other. The ids of each trace
+ *     follow those of the traces before it.
+ */
+trace_t *trace_concat(trace_t **traces, int n)
+{
+    trace_t *t;
+    unsigned ids = 0, ops = 0, i;
+    int j;
+
+    for (j = 0; j < n; j++) {
+	ids += traces[j]->num_ids;
+	ops += traces[j]->num_ops;
+    }
+    t = alloc_trace(ids, ops);
+    ids = 0;
+    ops = 0;
+    for (j = 0; j < n; j++) {
+	for (i = 0; i < traces[j]->num_ops; i++) {
+	    t->ops[ops] = traces[j]->ops[i];
+	    t->ops[ops++].index += ids;
+	}
+	ids += traces[j]->num_ids;
+	if (traces[j]->sugg_heapsize > t->sugg_heapsize)
+	    t->sugg_heapsize = traces[j]->sugg_heapsize;
+    }
+    t->weight = 1;
+    finish_trace(t);
+    return t;
+}
+
+/*
+ * trace_splice - Run n traces at once, taking one op from each in turn
+ *     until all are exhausted. The ids are offset as in trace_concat.
+ */
+trace_t *trace_splice(trace_t **traces, int n)
+{
+    trace_t *t;
+    unsigned ids = 0, ops = 0, i, *base;
+    int j, more;
+
+    if ((base = calloc(n, sizeof(unsigned))) == NULL)
+	trace_error("calloc failed in trace_splice");
+    for (j = 0; j < n; j++) {
+	base[j] = ids;
+	ids += traces[j]->num_ids;
+	ops += traces[j]->num_ops;
+    }
+    t = alloc_trace(ids, ops);
+    ops = 0;
+    for (i = 0, more = 1; more; i++) {
+	more = 0;
+	for (j = 0; j < n; j++) {
+	    if (i >= traces[j]->num_ops)
+		continue;
+	    t->ops[ops] = traces[j]->ops[i];
+	    t->ops[ops++].index += base[j];
+	    more = 1;
+	}
+    }
+    for (j = 0; j < n; j++)
+	t->sugg_heapsize += traces[j]->sugg_heapsize;
+    t->weight = 1;
+    free(base);
+    finish_trace(t);
+    return t;
+}
+
+/*
+ * trace_remap - Renumber the ids densely in the order of their first use,
+ *     dropping ids that no op refers to
+ */
+trace_t *trace_remap(trace_t *trace)
+{
+    trace_t *t;
+    int *map;
+    unsigned i, ids = 0;
+
+    if ((map = malloc(trace->num_ids * sizeof(int))) == NULL)
+	trace_error("malloc failed in trace_remap");
+    memset(map, -1, trace->num_ids * sizeof(int));
+    for (i = 0; i < trace->num_ops; i++) {
+	if (map[trace->ops[i].index] < 0)
+	    map[trace->ops[i].index] = ids++;
+    }
+    t = alloc_trace(ids, trace->num_ops);
+    for (i = 0; i < trace->num_ops; i++) {
+	t->ops[i] = trace->ops[i];
+	t->ops[i].index = map[trace->ops[i].index];
+    }
+    t->sugg_heapsize = trace->sugg_heapsize;
+    t->weight = trace->weight;
+    free(map);
+    finish_trace(t);
+    return t;
+}
+
+/*
+ * finish_trace - Recompute the thread count and number the ops on each
+ *     index, for the sequencing of mdriver's parallel replay
+ */
+void finish_trace(trace_t *trace)
+{
+    unsigned *seq;
+    unsigned i;
+
+    if ((seq = calloc(trace->num_ids ? trace->num_ids : 1,
+		      sizeof(unsigned))) == NULL)
+	trace_error("calloc failed in finish_trace");
+    trace->num_threads = 1;
+    for (i = 0; i < trace->num_ops; i++) {
+	trace->ops[i].seq = seq[trace->ops[i].index]++;
+	if ((unsigned)trace->ops[i].tid >= trace->num_threads)
+	    trace->num_threads = trace->ops[i].tid + 1;
+    }
+    free(seq);
+}
+
+/* 
+ * trace_error - Report a Unix-style error and exit
+ */
+static void trace_error(char *msg) 
+{
+    printf("%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
@@ -0,0 +1,52 @@
+/*
+ * trace.h - Allocator traces: the in-memory form read by mdriver, and
+ *     the transformations used by tracetool and the driver's size sweep
+ *
+ * A trace file has a four line header (suggested heap size, number of
+ * block ids, number of ops, weight) followed by one op per line:
+ * "a <id> <size>", "r <id> <size>" or "f <id>", optionally prefixed with
+ * the tag of the thread that made it, as in "3:f 17". A trace may also
+ * be packed into the binary form described in tracepack.c, which starts
+ * with TRACE_MAGIC.
+ */
+
+#define TRACE_MAGIC "MMTZ"
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request */
+    int tid;                          /* thread tag, 0 if untagged */
+    unsigned seq;                     /* earlier ops on the same index */
+} traceop_t;
+
+/* Holds the information for one trace file*/
+typedef struct {
+    unsigned sugg_heapsize;   /* suggested heap size (unused) */
+    unsigned num_ids;         /* number of alloc/realloc ids */
+    unsigned num_ops;         /* number of distinct requests */
+    unsigned weight;          /* weight for this trace (unused) */
+    unsigned num_threads;     /* 1 + largest thread tag */
+    traceop_t *ops;      /* array of requests */
+    char **blocks;       /* array of ptrs returned by malloc/realloc... */
+    size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+} trace_t;
+
+/* Read, write, allocate and free traces */
+trace_t *read_trace(char *tracedir, char *filename);
+int write_trace(FILE *fp, trace_t *trace);
+trace_t *alloc_trace(unsigned num_ids, unsigned num_ops);
+void free_trace(trace_t *trace);
+void finish_trace(trace_t *trace);
+
+/* Read and write packed traces */
+trace_t *read_trace_packed(FILE *fp, char *path);
+int write_trace_packed(FILE *fp, trace_t *trace);
+
+/* Transformations; each returns a new trace and leaves its inputs alone */
+trace_t *trace_scale(trace_t *trace, double factor);
+trace_t *trace_replicate(trace_t *trace, unsigned copies);
+trace_t *trace_concat(trace_t **traces, int n);
+trace_t *trace_splice(trace_t **traces, int n);
+trace_t *trace_remap(trace_t *trace);
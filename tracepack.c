@@ -0,0 +1,423 @@
+/*
+ * tracepack.c - Packed binary encoding of allocator traces.
+ *
+ * A packed trace is about a fifth of the size of its text and decodes
+ * several times faster, so that large trace archives can be kept and
+ * replayed in this form. read_trace recognizes one by its magic and
+ * hands it to read_trace_packed. The file is
+ *
+ *     "MMTZ" <version byte>
+ *     varints: sugg_heapsize num_ids num_ops weight dict_len
+ *     dict_len varints: the sizes of the dictionary
+ *     the ops, up to the end of the file
+ *
+ * Varints are little-endian groups of 7 bits with the high bit set on
+ * all but the last byte, and signed values are zigzag encoded. Every op
+ * starts with a control byte whose low two bits are its type and whose
+ * high six bits are a code:
+ *
+ *     alloc, realloc  varint id delta, then the size if the code is
+ *                     PACK_LITERAL, or the dictionary index less
+ *                     PACK_FAR if the code is PACK_FAR; a lower code
+ *                     is itself the dictionary index
+ *     free            a zigzag id delta below PACK_LITERAL is the code,
+ *                     a larger one follows as a varint
+ *     thread          varint tag of the thread of the ops that follow
+ *
+ * The id delta of an alloc is from one past the last id allocated, and
+ * that of a realloc or free is from the id of the op before it, which
+ * makes most ids of the usual traces a single byte. The dictionary holds
+ * the sizes used more than once, most frequent first, so that most sizes
+ * cost nothing beyond the control byte.
+ *
+ * The decoder loads eight bytes at a time and finds the end of a varint
+ * and gathers its 7-bit groups with a few shifts and masks, rather than
+ * testing byte by byte. The buffer is padded so that these loads never
+ * run off its end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "trace.h"
+
+#define PACK_VERSION 1
+#define PACK_ALLOC   0        /* op types in the control byte */
+#define PACK_FREE    1
+#define PACK_REALLOC 2
+#define PACK_THREAD  3
+#define PACK_FAR     62       /* size code: dictionary index follows */
+#define PACK_LITERAL 63       /* size code: size follows */
+#define PACK_DICTMAX 65536    /* most sizes in the dictionary */
+#define PACK_SLACK   16       /* padding after the buffer, > one op */
+
+/* A growable output buffer */
+typedef struct {
+    unsigned char *buf;
+    size_t len, cap;
+} packbuf_t;
+
+/* A distinct request size and its number of uses */
+typedef struct {
+    unsigned size;
+    unsigned count;
+} sizecount_t;
+
+static void put_byte(packbuf_t *pb, unsigned char c);
+static void put_varint(packbuf_t *pb, uint64_t v);
+static uint64_t get_varint(const unsigned char **pp);
+static uint64_t zigzag(int64_t v);
+static int64_t unzigzag(uint64_t v);
+static unsigned build_dict(trace_t *trace, unsigned **dict);
+static int dict_code(unsigned *sorted, unsigned *codes, unsigned n,
+		     unsigned size);
+static int cmp_unsigned(const void *a, const void *b);
+static int cmp_count(const void *a, const void *b);
+static void pack_error(char *path, char *msg);
+
+/*
+ * write_trace_packed - Write a trace in the packed format. Returns 0, or
+ *     -1 if the write failed.
+ */
+int write_trace_packed(FILE *fp, trace_t *trace)
+{
+    packbuf_t pb = {NULL, 0, 0};
+    unsigned *dict, *sorted, *codes, n, i, code;
+    int next_alloc = 0, prev = 0, tid = 0, k;
+    uint64_t delta;
+    traceop_t *op;
+    int ret;
+
+    n = build_dict(trace, &dict);
+    if ((sorted = malloc((n + 1) * sizeof(unsigned))) == NULL ||
+	(codes = malloc((n + 1) * sizeof(unsigned))) == NULL) {
+	fprintf(stderr, "malloc failed in write_trace_packed\n");
+	exit(1);
+    }
+    memcpy(sorted, dict, n * sizeof(unsigned));
+    qsort(sorted, n, sizeof(unsigned), cmp_unsigned);
+    for (i = 0; i < n; i++) {
+	k = dict_code(sorted, NULL, n, dict[i]);
+	codes[k] = i;
+    }
+
+    for (i = 0; i < sizeof(TRACE_MAGIC) - 1; i++)
+	put_byte(&pb, TRACE_MAGIC[i]);
+    put_byte(&pb, PACK_VERSION);
+    put_varint(&pb, trace->sugg_heapsize);
+    put_varint(&pb, trace->num_ids);
+    put_varint(&pb, trace->num_ops);
+    put_varint(&pb, trace->weight);
+    put_varint(&pb, n);
+    for (i = 0; i < n; i++)
+	put_varint(&pb, dict[i]);
+
+    for (i = 0; i < trace->num_ops; i++) {
+	op = &trace->ops[i];
+	if (op->tid != tid) {
+	    put_byte(&pb, PACK_THREAD);
+	    put_varint(&pb, op->tid);
+	    tid = op->tid;
+	}
+	if (op->type == FREE) {
+	    delta = zigzag((int64_t)op->index - prev);
+	    if (delta < PACK_LITERAL)
+		put_byte(&pb, PACK_FREE | delta << 2);
+	    else {
+		put_byte(&pb, PACK_FREE | PACK_LITERAL << 2);
+		put_varint(&pb, delta - PACK_LITERAL);
+	    }
+	    prev = op->index;
+	    continue;
+	}
+
+	k = dict_code(sorted, codes, n, op->size);
+	code = k < 0 ? PACK_LITERAL : k < PACK_FAR ? (unsigned)k : PACK_FAR;
+	if (op->type == ALLOC) {
+	    put_byte(&pb, PACK_ALLOC | code << 2);
+	    put_varint(&pb, zigzag((int64_t)op->index - next_alloc));
+	    if (op->index >= next_alloc)
+		next_alloc = op->index + 1;
+	} else {
+	    put_byte(&pb, PACK_REALLOC | code << 2);
+	    put_varint(&pb, zigzag((int64_t)op->index - prev));
+	}
+	if (code == PACK_LITERAL)
+	    put_varint(&pb, op->size);
+	else if (code == PACK_FAR)
+	    put_varint(&pb, k - PACK_FAR);
+	prev = op->index;
+    }
+
+    ret = fwrite(pb.buf, 1, pb.len, fp) == pb.len &&
+	fflush(fp) == 0 && !ferror(fp) ? 0 : -1;
+    free(pb.buf);
+    free(dict);
+    free(sorted);
+    free(codes);
+    return ret;
+}
+
+/*
+ * read_trace_packed - Decode a packed trace from fp, positioned just
+ *     after its magic. path names the file in error messages. Exits on
+ *     a malformed trace, as read_trace does.
+ */
+trace_t *read_trace_packed(FILE *fp, char *path)
+{
+    trace_t *trace;
+    traceop_t *op;
+    unsigned char *buf;
+    const unsigned char *p, *end;
+    unsigned *dict = NULL;
+    unsigned sugg_heapsize, num_ids, num_ops, weight, n, i, c, code;
+    long start, len;
+    int64_t next_alloc = 0, prev = 0, index;
+    uint64_t size, tid = 0;
+
+    /* Read the rest of the file into a padded buffer */
+    if ((start = ftell(fp)) < 0 || fseek(fp, 0, SEEK_END) != 0 ||
+	(len = ftell(fp)) < 0 || fseek(fp, start, SEEK_SET) != 0)
+	pack_error(path, strerror(errno));
+    len -= start;
+    if ((buf = calloc(len + PACK_SLACK, 1)) == NULL)
+	pack_error(path, "out of memory");
+    if (fread(buf, 1, len, fp) != (size_t)len)
+	pack_error(path, "short read");
+    p = buf;
+    end = buf + len;
+
+    if (len < 1 || *p++ != PACK_VERSION)
+	pack_error(path, "unknown version");
+    sugg_heapsize = get_varint(&p);
+    num_ids = get_varint(&p);
+    num_ops = get_varint(&p);
+    weight = get_varint(&p);
+    n = get_varint(&p);
+    if (p > end || n > PACK_DICTMAX)
+	pack_error(path, "bad header");
+    if ((dict = malloc((n + 1) * sizeof(unsigned))) == NULL)
+	pack_error(path, "out of memory");
+    for (i = 0; i < n; i++) {
+	dict[i] = get_varint(&p);
+	if (p > end)
+	    pack_error(path, "bad dictionary");
+    }
+
+    trace = alloc_trace(num_ids, num_ops);
+    trace->sugg_heapsize = sugg_heapsize;
+    trace->weight = weight;
+    for (i = 0; i < num_ops; ) {
+	if (p >= end)
+	    pack_error(path, "fewer ops than the header says");
+	c = *p++;
+	code = c >> 2;
+	op = &trace->ops[i];
+	switch (c & 3) {
+	case PACK_THREAD:
+	    tid = get_varint(&p);
+	    if (tid > INT_MAX)
+		pack_error(path, "bad thread tag");
+	    continue;
+	case PACK_FREE:
+	    op->type = FREE;
+	    index = prev + unzigzag(code < PACK_LITERAL ? code :
+				    get_varint(&p) + PACK_LITERAL);
+	    break;
+	default:
+	    op->type = (c & 3) == PACK_ALLOC ? ALLOC : REALLOC;
+	    index = unzigzag(get_varint(&p)) +
+		(op->type == ALLOC ? next_alloc : prev);
+	    if (code < PACK_FAR)
+		size = code;
+	    else
+		size = get_varint(&p) + (code == PACK_FAR ? PACK_FAR : 0);
+	    if (code != PACK_LITERAL) {
+		if (size >= n)
+		    pack_error(path, "size code beyond the dictionary");
+		size = dict[size];
+	    }
+	    if (size > INT_MAX)
+		pack_error(path, "bad size");
+	    op->size = size;
+	    if (op->type == ALLOC && index >= next_alloc)
+		next_alloc = index + 1;
+	    break;
+	}
+	if (index < 0 || index >= num_ids)
+	    pack_error(path, "id out of range");
+	op->index = index;
+	op->tid = tid;
+	prev = index;
+	i++;
+    }
+    if (p != end)
+	pack_error(path, "trailing bytes after the ops");
+    free(dict);
+    free(buf);
+    finish_trace(trace);
+    return trace;
+}
+
+/*
+ * build_dict - Collect the sizes of the trace used more than once, most
+ *     frequent first and at most PACK_DICTMAX of them. Returns their
+ *     number and stores the malloc'ed array in *dict.
+ */
+static unsigned build_dict(trace_t *trace, unsigned **dict)
+{
+    unsigned *sizes, n = 0, i, j, distinct = 0;
+    sizecount_t *counts;
+
+    if ((sizes = malloc((trace->num_ops + 1) * sizeof(unsigned))) == NULL ||
+	(counts = malloc((trace->num_ops + 1) * sizeof(sizecount_t))) == NULL) {
+	fprintf(stderr, "malloc failed in build_dict\n");
+	exit(1);
+    }
+    for (i = 0; i < trace->num_ops; i++)
+	if (trace->ops[i].type != FREE)
+	    sizes[n++] = trace->ops[i].size;
+    qsort(sizes, n, sizeof(unsigned), cmp_unsigned);
+    for (i = 0; i < n; i = j) {
+	for (j = i + 1; j < n && sizes[j] == sizes[i]; j++)
+	    ;
+	if (j - i > 1) {
+	    counts[distinct].size = sizes[i];
+	    counts[distinct++].count = j - i;
+	}
+    }
+    qsort(counts, distinct, sizeof(sizecount_t), cmp_count);
+    if (distinct > PACK_DICTMAX)
+	distinct = PACK_DICTMAX;
+    for (i = 0; i < distinct; i++)
+	sizes[i] = counts[i].size;
+    free(counts);
+    *dict = sizes;
+    return distinct;
+}
+
+/*
+ * dict_code - Find size among the n sorted dictionary sizes. Returns its
+ *     position, or its dictionary index if codes maps positions to
+ *     indices, or -1 if size is not in the dictionary.
+ */
+static int dict_code(unsigned *sorted, unsigned *codes, unsigned n,
+		     unsigned size)
+{
+    unsigned lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (sorted[mid] < size)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo == n || sorted[lo] != size)
+	return -1;
+    return codes != NULL ? (int)codes[lo] : (int)lo;
+}
+
+/*
+ * get_varint - Decode the varint at *pp and advance *pp past it. The
+ *     eight bytes from *pp must be readable. The bytes up to the first
+ *     one without the high bit are kept and their 7-bit groups packed
+ *     together in three steps of doubling width; a varint of more than
+ *     eight bytes is cut off at the eighth.
+ */
+static uint64_t get_varint(const unsigned char **pp)
+{
+    uint64_t w, stop;
+    int i;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&w, *pp, sizeof(w));
+#else
+    for (w = 0, i = 7; i >= 0; i--)
+	w = w << 8 | (*pp)[i];
+#endif
+    stop = (~w & 0x8080808080808080ULL) | 1ULL << 63;
+    i = __builtin_ctzll(stop);
+    *pp += (i >> 3) + 1;
+    w &= (stop ^ (stop - 1)) & 0x7f7f7f7f7f7f7f7fULL;
+    w = (w & 0x007f007f007f007fULL) | (w & 0x7f007f007f007f00ULL) >> 1;
+    w = (w & 0x00003fff00003fffULL) | (w & 0x3fff00003fff0000ULL) >> 2;
+    w = (w & 0x000000000fffffffULL) | (w & 0x0fffffff00000000ULL) >> 4;
+    return w;
+}
+
+/*
+ * put_varint - Append v as a varint
+ */
+static void put_varint(packbuf_t *pb, uint64_t v)
+{
+    while (v >= 0x80) {
+	put_byte(pb, v | 0x80);
+	v >>= 7;
+    }
+    put_byte(pb, v);
+}
+
+/*
+ * put_byte - Append one byte, growing the buffer as needed
+ */
+static void put_byte(packbuf_t *pb, unsigned char c)
+{
+    if (pb->len == pb->cap) {
+	pb->cap = pb->cap ? 2 * pb->cap : 4096;
+	if ((pb->buf = realloc(pb->buf, pb->cap)) == NULL) {
+	    fprintf(stderr, "realloc failed in put_byte\n");
+	    exit(1);
+	}
+    }
+    pb->buf[pb->len++] = c;
+}
+
+/*
+ * zigzag, unzigzag - Map signed values to unsigned ones of about the
+ *     same magnitude, and back
+ */
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*
+ * cmp_unsigned - qsort comparator for unsigned ints
+ */
+static int cmp_unsigned(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * cmp_count - qsort comparator putting the most used sizes first, and
+ *     the smaller of two equally used ones
+ */
+static int cmp_count(const void *a, const void *b)
+{
+    const sizecount_t *x = a, *y = b;
+
+    if (x->count != y->count)
+	return (x->count < y->count) - (x->count > y->count);
+    return (x->size > y->size) - (x->size < y->size);
+}
+
+/*
+ * pack_error - Report a malformed packed trace and exit
+ */
+static void pack_error(char *path, char *msg)
+{
+    printf("Bad packed trace %s: %s\n", path, msg);
+    exit(1);
+}
@@ -0,0 +1,179 @@
+/*
+ * tracetool.c - Build new allocator traces from existing ones, for
+ *     studies of how the allocator scales with the size of a workload
+ *
+ * The input traces are concatenated (or spliced with -i), then
+ * replicated, scaled and remapped in that order, and the result is
+ * written with a valid header. For example,
+ *
+ *     tracetool -n 4 -s 2 -o big.rep malloc/amptjp-bal.rep
+ *
+ * makes a trace with four interleaved copies of amptjp, each request
+ * twice as large.
+ *
+ * With -z the result is written in the packed format of tracepack.c.
+ * Packed inputs are read like text ones, so "tracetool -z" encodes a
+ * trace and plain "tracetool" decodes it. -t times reading each input
+ * instead, to compare the text parser with the packed decoder.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TIMERUNS 5 /* reads of each input timed by -t, best one kept */
+
+static void usage(void);
+static void time_read(char *path);
+
+int main(int argc, char **argv)
+{
+    int c, i, n;
+    double scale = 1;
+    unsigned copies = 1;
+    int splice = 0, remap = 0, packed = 0, timing = 0, owned;
+    char *outfile = NULL;
+    FILE *fp = stdout;
+    trace_t **traces, *trace, *t;
+
+    while ((c = getopt(argc, argv, "s:n:idmo:zth")) != EOF) {
+        switch (c) {
+	case 's': /* Scale every request size */
+	    scale = atof(optarg);
+	    break;
+	case 'n': /* Interleaved copies of the id space */
+	    copies = atoi(optarg);
+	    break;
+	case 'i': /* Splice the inputs instead of concatenating them */
+	    splice = 1;
+	    break;
+	case 'd': /* Renumber the ids densely */
+	    remap = 1;
+	    break;
+	case 'o': /* Output file */
+	    outfile = optarg;
+	    break;
+	case 'z': /* Write the packed format */
+	    packed = 1;
+	    break;
+	case 't': /* Time reading the inputs */
+	    timing = 1;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    n = argc - optind;
+    if (n < 1 || scale <= 0 || copies < 1) {
+	usage();
+	exit(1);
+    }
+
+    if (timing) {
+	printf("%-24s %10s %10s %8s %10s\n", "trace", "bytes", "ops",
+	       "ns/op", "MB/s");
+	for (i = 0; i < n; i++)
+	    time_read(argv[optind + i]);
+	exit(0);
+    }
+
+    if ((traces = calloc(n, sizeof(trace_t *))) == NULL) {
+	fprintf(stderr, "calloc failed in main\n");
+	exit(1);
+    }
+    for (i = 0; i < n; i++)
+	traces[i] = read_trace("", argv[optind + i]);
+    trace = n == 1 ? traces[0] :
+	splice ? trace_splice(traces, n) : trace_concat(traces, n);
+
+    /* Inputs are freed at exit; intermediate results as they are used */
+    owned = n > 1;
+    if (copies > 1) {
+	t = trace_replicate(trace, copies);
+	if (owned)
+	    free_trace(trace);
+	trace = t;
+	owned = 1;
+    }
+    if (scale != 1) {
+	t = trace_scale(trace, scale);
+	if (owned)
+	    free_trace(trace);
+	trace = t;
+	owned = 1;
+    }
+    if (remap) {
+	t = trace_remap(trace);
+	if (owned)
+	    free_trace(trace);
+	trace = t;
+    }
+
+    if (outfile != NULL && (fp = fopen(outfile, "w")) == NULL) {
+	perror(outfile);
+	exit(1);
+    }
+    if ((packed ? write_trace_packed(fp, trace) : write_trace(fp, trace)) < 0 ||
+	(fp != stdout && fclose(fp) != 0)) {
+	perror(outfile != NULL ? outfile : "stdout");
+	exit(1);
+    }
+    exit(0);
+}
+
+/*
+ * time_read - Read the trace at path TIMERUNS times and print the best
+ *     time per op and the bytes of the file read per second
+ */
+static void time_read(char *path)
+{
+    struct timespec t0, t1;
+    struct stat st;
+    trace_t *trace;
+    double secs, best = 0;
+    unsigned ops = 0;
+    int r;
+
+    if (stat(path, &st) < 0) {
+	perror(path);
+	exit(1);
+    }
+    for (r = 0; r < TIMERUNS; r++) {
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	trace = read_trace("", path);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	if (r == 0 || secs < best)
+	    best = secs;
+	ops = trace->num_ops;
+	free_trace(trace);
+    }
+    printf("%-24s %10lld %10u %8.1f %10.1f\n", path, (long long)st.st_size,
+	   ops, ops ? best * 1e9 / ops : 0.0, st.st_size / best / 1e6);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracetool [-hidtz] [-s <factor>] [-n <copies>] "
+	    "[-o <file>] <trace>...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-d          Renumber the ids densely in order of first use.\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+    fprintf(stderr, "\t-i          Splice (interleave) the traces instead of concatenating them.\n");
+    fprintf(stderr, "\t-n <copies> Interleave <copies> copies of the id space.\n");
+    fprintf(stderr, "\t-o <file>   Write the result to <file> instead of stdout.\n");
+    fprintf(stderr, "\t-s <factor> Multiply every request size by <factor>.\n");
+    fprintf(stderr, "\t-t          Time reading each trace instead of writing one.\n");
+    fprintf(stderr, "\t-z          Write the packed format instead of text.\n");
+}